@@ -0,0 +1,199 @@
+/*
+  bench_journal_recovery.cpp
+
+  A benchmark for journal.hpp: it measures how long it takes to recover a
+    journal when the server restarts, as the journal grows, with and
+    without the segment indexes and checkpoint.
+
+  For each step, the program fills a fresh journal with messages until
+    it reaches the step's size, acking all but one in every 'keep'
+    messages, the way a consumer would. The unacked messages stop any
+    segment being deleted, so the whole journal stays on disk -- this is
+    the worst case for recovery, and what happens when a queue has a few
+    messages that nobody consumes. The journal is then stopped (which
+    writes a checkpoint), and recovered twice: once using the checkpoint,
+    and once after deleting it, so that every record has to be read.
+
+  Before each recovery, the program asks the kernel to drop the journal's
+    files from the page cache, so that the times include reading from
+    disk. This is only advice, and not every filesystem takes it; if the
+    two times are suspiciously close for big journals, try dropping the
+    caches by hand (as root: echo 3 > /proc/sys/vm/drop_caches).
+
+  With the checkpoint, recovery time should depend mostly on the number
+    of live messages, each of which costs a random read; without it, on
+    the size of the journal.
+
+  Recovery after a crash, rather than a clean stop, also reads whatever was
+    written since the last checkpoint -- at most checkpoint_bytes, plus
+    one group commit window.
+
+  This program doesn't use Proton at all. Settings are in main(), at the
+    end.
+*/
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "journal.hpp"
+
+typedef std::chrono::steady_clock Clock;
+
+// Somewhere to put a result, so the compiler can't optimize away the work
+volatile uint64_t sink;
+
+/** The names of the files in a directory. */
+std::vector<std::string> list_files (const std::string &dir)
+  {
+  std::vector<std::string> files;
+  DIR *d = opendir (dir.c_str());
+  if (!d) return files;
+  struct dirent *e;
+  while ((e = readdir (d)))
+    {
+    std::string name = e->d_name;
+    if (name != "." && name != "..") files.push_back (dir + "/" + name);
+    }
+  closedir (d);
+  return files;
+  }
+
+void remove_dir (const std::string &dir)
+  {
+  std::vector<std::string> files = list_files (dir);
+  for (size_t i = 0; i < files.size(); i++)
+    unlink (files[i].c_str());
+  rmdir (dir.c_str());
+  }
+
+/** Ask the kernel to forget the cached contents of the journal files. */
+void drop_cache (const std::string &dir)
+  {
+  std::vector<std::string> files = list_files (dir);
+  for (size_t i = 0; i < files.size(); i++)
+    {
+    int fd = open (files[i].c_str(), O_RDONLY);
+    if (fd < 0) continue;
+    fdatasync (fd);
+    posix_fadvise (fd, 0, 0, POSIX_FADV_DONTNEED);
+    close (fd);
+    }
+  }
+
+/** Bytes of segment files in the directory. */
+uint64_t journal_bytes (const std::string &dir)
+  {
+  uint64_t total = 0;
+  std::vector<std::string> files = list_files (dir);
+  for (size_t i = 0; i < files.size(); i++)
+    {
+    struct stat st;
+    if (files[i].size() > 4 && files[i].substr (files[i].size() - 4) == ".seg"
+        && stat (files[i].c_str(), &st) == 0)
+      total += st.st_size;
+    }
+  return total;
+  }
+
+/** Write messages until 'bytes' have been appended, acking all but one
+    in every 'keep'. Returns the number of messages left unacked. */
+long fill (const std::string &dir, uint64_t bytes, size_t segment_size,
+      size_t checkpoint_bytes, size_t body_size, int keep)
+  {
+  Journal journal (dir, segment_size, std::chrono::microseconds (2000),
+    checkpoint_bytes);
+  journal.recover ([](uint64_t, const std::string &, const char *, size_t)
+    {});
+  std::string body (body_size, 'x');
+  long live = 0;
+  for (uint64_t written = 0, i = 0; written < bytes; i++)
+    {
+    uint64_t id = journal.append ("foo", body.data(), body.size());
+    written += body.size();
+    if (i % keep == 0)
+      live++;
+    else
+      journal.ack (id);
+    }
+  return live;
+  }
+
+/** Recover the journal, and return the time taken in milliseconds. */
+double recover (const std::string &dir, size_t segment_size,
+      size_t checkpoint_bytes, long &messages, uint64_t &scanned)
+  {
+  drop_cache (dir);
+  Journal journal (dir, segment_size, std::chrono::microseconds (2000),
+    checkpoint_bytes);
+  uint64_t payload = 0;
+  Clock::time_point start = Clock::now();
+  journal.recover ([&payload](uint64_t, const std::string &,
+      const char *data, size_t length)
+    {
+    // Touch the message, as the server would when it decodes it
+    payload += data[0] + data[length - 1];
+    });
+  Clock::time_point end = Clock::now();
+  sink = payload;
+  messages = journal.last_recovery().messages;
+  scanned = journal.last_recovery().bytes_scanned;
+  return std::chrono::duration<double, std::milli> (end - start).count();
+  }
+
+int main (int argc, char **argv)
+  {
+  try
+    {
+    std::string dir = "/tmp/bench_journal_recovery";
+    size_t segment_size = 64 * 1024 * 1024;
+    size_t checkpoint_bytes = 16 * 1024 * 1024;
+    size_t body_size = 1000;
+    // One message in this many is never acked
+    int keep = 1000;
+    // Bytes of messages written at each step
+    std::vector<uint64_t> steps_mb = { 64, 256, 1024, 4096 };
+
+    std::cout << "journal_MB  live_msgs  checkpoint_ms  scanned_MB"
+      << "  full_scan_ms  scanned_MB" << std::endl;
+    for (size_t i = 0; i < steps_mb.size(); i++)
+      {
+      remove_dir (dir);
+      long live = fill (dir, steps_mb[i] << 20, segment_size,
+        checkpoint_bytes, body_size, keep);
+      uint64_t size = journal_bytes (dir);
+
+      long found_cp, found_full;
+      uint64_t scanned_cp, scanned_full;
+      double cp_ms = recover (dir, segment_size, checkpoint_bytes,
+        found_cp, scanned_cp);
+      unlink ((dir + "/checkpoint").c_str());
+      double full_ms = recover (dir, segment_size, checkpoint_bytes,
+        found_full, scanned_full);
+      if (found_cp != live || found_full != live)
+        std::cerr << "expected " << live << " messages, recovered "
+          << found_cp << " and " << found_full << std::endl;
+
+      std::cout << std::fixed << std::setprecision (1)
+        << std::setw (10) << (size >> 20)
+        << std::setw (11) << live
+        << std::setw (15) << cp_ms
+        << std::setw (12) << scanned_cp / 1048576.0
+        << std::setw (14) << full_ms
+        << std::setw (12) << scanned_full / 1048576.0 << std::endl;
+      }
+    remove_dir (dir);
+    }
+  catch (const std::exception& e)
+    {
+    std::cerr << e.what() << std::endl;
+    return 1;
+    }
+  return 0;
+  }
@@ -0,0 +1,420 @@
+/*
+  bench_pinned_containers.cpp
+
+  A benchmark for core_local.hpp: it compares consumers that run one
+    container per thread, as container_per_thread.cpp does, with the
+    threads left for the scheduler to place, and with each one pinned to
+    a core of its own.
+
+  For each step, the program starts 'consumers' threads, each of which
+    creates its own container, handler and arena, and opens a receiver on
+    its own connection. With pinning, each thread pins itself to its core
+    before it creates anything. When all the receivers are open, a
+    sender on another thread sends 'count' messages, each stamped with
+    the time it was sent, either as fast as its credit allows, or at a
+    steady 'rate' per second. The step ends when every message has been
+    received.
+
+  For each message, a consumer works through its own 'working_set' bytes
+    of data, allocated from its CoreArena -- standing in for whatever
+    state a real handler keeps -- so that a thread that has been moved to
+    another core has to fetch that data again. It counts the times it
+    has found itself on a different core from the last message. It
+    counts the messages, and records the latency from sending to
+    receiving, in a block of a ThreadStats (see thread_stats.hpp) of its
+    own, which main() adds up to follow the progress of the step, and to
+    find the latency percentiles at the end of it.
+
+  The table shows, for each step, the total throughput, latency
+    percentiles, and migrations, followed by the throughput of each
+    thread and the core it ran on. Expect pinning to make more difference
+    to the tail than to the median, and more on a busy machine than on an
+    idle one; at a steady rate, throughput is just the rate, unless the
+    consumers can't keep up.
+
+  The broker should have a queue called 'foo', with nothing in it; the
+    server in this repository will do. Keep the broker, and anything
+    else busy, off the cores that the consumers are pinned to, if you
+    can.
+
+  Settings are in main(), at the end.
+*/
+
+#include <proton/connection.hpp>
+#include <proton/connection_options.hpp>
+#include <proton/container.hpp>
+#include <proton/delivery.hpp>
+#include <proton/duration.hpp>
+#include <proton/message.hpp>
+#include <proton/messaging_handler.hpp>
+#include <proton/receiver.hpp>
+#include <proton/receiver_options.hpp>
+#include <proton/sender.hpp>
+#include <proton/tracker.hpp>
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <memory_resource>
+#include <vector>
+#include <string>
+
+#include "core_local.hpp"
+#include "thread_stats.hpp"
+
+typedef std::chrono::steady_clock Clock;
+
+// The counter and histogram each consumer keeps, in its ThreadStats block
+enum { MESSAGES };
+enum { LATENCY_NS };
+
+static int64_t now_ns ()
+  {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>
+    (Clock::now().time_since_epoch()).count();
+  }
+
+/*
+ * What a consumer thread leaves behind, for main() to report.
+ */
+struct ConsumerResult
+  {
+  int core; // The core the thread was pinned to, or -1
+  long messages;
+  long migrations;
+
+  ConsumerResult () : core (-1), messages (0), migrations (0) {}
+  };
+
+/*
+ * Consumer receives on one connection, and closes it when 'done' is set.
+ */
+class Consumer : public proton::messaging_handler
+  {
+  protected:
+    std::string address;
+    int credit;
+    std::pmr::vector<unsigned char> working_set;
+    ThreadStats::Local &counts;
+    ConsumerResult &result;
+    std::atomic<int> &ready;
+    const std::atomic<bool> &done;
+    long migrations;
+    int last_core;
+    unsigned checksum;
+
+    void check_done (proton::connection c)
+      {
+      if (done)
+        {
+        c.close();
+        return;
+        }
+      c.container().schedule (proton::duration::MILLISECOND * 10,
+        [this, c]() { check_done (c); });
+      }
+
+  public:
+    Consumer (const std::string &address, int credit, size_t working_set,
+          CoreArena &arena, ThreadStats::Local &counts,
+          ConsumerResult &result, std::atomic<int> &ready,
+          const std::atomic<bool> &done)
+        : working_set (working_set, 0, arena.resource()),
+          counts (counts), result (result), ready (ready), done (done)
+      {
+      this->address = address;
+      this->credit = credit;
+      this->migrations = 0;
+      this->last_core = current_core();
+      this->checksum = 0;
+      }
+
+    /** Hand over the results; call after the container has stopped. */
+    void finish ()
+      {
+      result.messages = counts.get (MESSAGES);
+      result.migrations = migrations;
+      }
+
+    void on_connection_open (proton::connection &c) override
+      {
+      c.open_receiver (address, proton::receiver_options()
+        .credit_window (credit));
+      check_done (c);
+      }
+
+    void on_receiver_open (proton::receiver &r) override
+      {
+      ready++;
+      }
+
+    void on_message (proton::delivery &d, proton::message &m) override
+      {
+      int64_t sent = proton::get<int64_t> (m.properties().get ("sent_ns"));
+      // The work: a pass over this consumer's own data
+      for (size_t i = 0; i < working_set.size(); i += 64)
+        checksum += ++working_set[i];
+      int64_t latency = now_ns() - sent;
+      counts.record (LATENCY_NS, latency > 0 ? latency : 0);
+      int core = current_core();
+      if (core != last_core) migrations++;
+      last_core = core;
+      counts.add (MESSAGES);
+      }
+
+    void on_error (const proton::error_condition &e) override
+      {
+      std::cerr << "consumer: " << e.what() << std::endl;
+      }
+  };
+
+/*
+ * StampedSender sends 'count' messages, each with the time it was sent,
+ *   at 'rate' per second (or as fast as it can, if 'rate' is 0), and
+ *   closes the connection when they have all been accepted.
+ */
+class StampedSender : public proton::messaging_handler
+  {
+  protected:
+    std::string address;
+    long count;
+    int rate;
+    long sent;
+    long accepted;
+    proton::message msg;
+    proton::sender sender;
+    Clock::time_point start;
+
+    void send_due ()
+      {
+      long due = count;
+      if (rate > 0)
+        {
+        double secs = std::chrono::duration<double>
+          (Clock::now() - start).count();
+        due = std::min (count, (long)(secs * rate) + 1);
+        }
+      while (sender.credit() > 0 && sent < due)
+        {
+        msg.properties().put ("sent_ns", now_ns());
+        sender.send (msg);
+        sent++;
+        }
+      }
+
+    void tick ()
+      {
+      send_due();
+      if (sent < count)
+        sender.container().schedule (proton::duration::MILLISECOND,
+          [this]() { tick(); });
+      }
+
+  public:
+    StampedSender (const std::string &address, long count, int rate,
+          size_t body_size)
+      {
+      this->address = address;
+      this->count = count;
+      this->rate = rate;
+      this->sent = 0;
+      this->accepted = 0;
+      this->msg.body (std::string (body_size, 'x'));
+      }
+
+    void on_connection_open (proton::connection &c) override
+      {
+      c.open_sender (address);
+      }
+
+    void on_sender_open (proton::sender &s) override
+      {
+      sender = s;
+      start = Clock::now();
+      if (rate > 0) tick();
+      }
+
+    void on_sendable (proton::sender &s) override
+      {
+      send_due();
+      }
+
+    void on_tracker_accept (proton::tracker &t) override
+      {
+      if (++accepted == count) t.connection().close();
+      }
+
+    void on_error (const proton::error_condition &e) override
+      {
+      std::cerr << "sender: " << e.what() << std::endl;
+      }
+  };
+
+/*
+ * The settings for one step.
+ */
+struct Step
+  {
+  std::string host_and_port;
+  std::string queue;
+  int consumers;
+  std::vector<int> cores; // Empty for unpinned
+  int sender_core;
+  long count;
+  int rate;
+  size_t body_size;
+  size_t working_set;
+  int credit;
+  };
+
+void run_step (const Step &step)
+  {
+  std::unique_ptr<ConsumerResult[]> results
+    (new ConsumerResult[step.consumers]);
+  std::atomic<int> ready (0);
+  std::atomic<bool> done (false);
+  bool pinned = !step.cores.empty();
+  ThreadStats stats ({ "messages" }, { "latency ns" });
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < step.consumers; i++)
+    {
+    int core = pinned ? step.cores[i % step.cores.size()] : -1;
+    threads.emplace_back ([&step, &results, &ready, &done, &stats, i, core]()
+      {
+      if (core >= 0 && pin_to_core (core) == 0) results[i].core = core;
+      // Created after pinning, so that they are local to the core
+      ThreadStats::Local &counts = stats.attach();
+      CoreArena arena (step.working_set + (1 << 16));
+      Consumer consumer (step.queue, step.credit, step.working_set, arena,
+        counts, results[i], ready, done);
+      proton::container container;
+      container.connect (step.host_and_port, proton::connection_options()
+        .handler (consumer).sasl_allow_insecure_mechs (true));
+      container.run();
+      consumer.finish();
+      stats.detach (counts);
+      });
+    }
+
+  Clock::time_point wait_until = Clock::now() + std::chrono::seconds (10);
+  while (ready < step.consumers && Clock::now() < wait_until)
+    std::this_thread::sleep_for (std::chrono::milliseconds (10));
+
+  Clock::time_point start = Clock::now();
+  Clock::time_point end = start;
+  if (ready == step.consumers)
+    {
+    std::thread sender_thread ([&step, pinned]()
+      {
+      if (pinned && step.sender_core >= 0) pin_to_core (step.sender_core);
+      StampedSender sender (step.queue, step.count, step.rate,
+        step.body_size);
+      proton::container container;
+      container.connect (step.host_and_port, proton::connection_options()
+        .handler (sender).sasl_allow_insecure_mechs (true));
+      container.run();
+      });
+
+    // Wait for the messages to arrive, or to stop arriving
+    long received = 0, last_received = -1;
+    Clock::time_point last_progress = Clock::now();
+    while (received < step.count
+        && Clock::now() - last_progress < std::chrono::seconds (10))
+      {
+      std::this_thread::sleep_for (std::chrono::milliseconds (1));
+      received = stats.merge().counter (MESSAGES);
+      if (received != last_received) last_progress = end = Clock::now();
+      last_received = received;
+      }
+    sender_thread.join();
+    }
+  else
+    std::cerr << "Only " << ready << " of " << step.consumers
+      << " consumers started" << std::endl;
+
+  done = true;
+  for (size_t i = 0; i < threads.size(); i++) threads[i].join();
+
+  double secs = std::chrono::duration<double> (end - start).count();
+  // Every consumer has detached by now, so this is the whole step
+  ThreadStats::Snapshot totals = stats.merge();
+  long total = 0, migrations = 0;
+  for (int i = 0; i < step.consumers; i++)
+    {
+    total += results[i].messages;
+    migrations += results[i].migrations;
+    }
+  std::cout << std::setw (8) << (step.rate ? std::to_string (step.rate)
+      : std::string ("max"))
+    << std::setw (10) << (pinned ? "pinned" : "unpinned")
+    << std::setw (11) << (long)(secs > 0 ? total / secs : 0)
+    << std::setw (9) << totals.percentile (LATENCY_NS, 0.5) / 1000
+    << std::setw (9) << totals.percentile (LATENCY_NS, 0.99) / 1000
+    << std::setw (10) << totals.percentile (LATENCY_NS, 0.999) / 1000
+    << std::setw (10) << totals.max (LATENCY_NS) / 1000.0
+    << std::setw (12) << migrations << std::endl;
+  for (int i = 0; i < step.consumers; i++)
+    {
+    int core = results[i].core;
+    std::cout << std::setw (18) << "core "
+      << std::left << std::setw (4)
+      << (core >= 0 ? std::to_string (core) : std::string ("any"))
+      << std::right << std::setw (9)
+      << (long)(secs > 0 ? results[i].messages / secs : 0)
+      << std::endl;
+    }
+  if (total < step.count)
+    std::cout << "  (only " << total << " of " << step.count
+      << " messages received)" << std::endl;
+  }
+
+int main (int argc, char **argv)
+  {
+  try
+    {
+    Step step;
+    step.host_and_port = "127.0.0.1:5672";
+    step.queue = "foo";
+    step.consumers = 4;
+    step.count = 200000;
+    step.body_size = 100;
+    // Bytes of data each consumer works through, for each message
+    step.working_set = 256 * 1024;
+    step.credit = 100;
+    // Cores for the consumers, when pinned; an empty list means 0, 1,
+    //   2... in turn, and the next core for the sender
+    std::vector<int> cores;
+    int sender_core = -1;
+    // Messages per second for each step, or 0 for as fast as possible
+    std::vector<int> rates = { 0, 20000 };
+
+    if (cores.empty())
+      {
+      for (int i = 0; i < step.consumers; i++)
+        cores.push_back (i % core_count());
+      sender_core = step.consumers % core_count();
+      }
+    step.sender_core = sender_core;
+
+    std::cout << std::fixed << std::setprecision (1);
+    std::cout << "    rate      mode   msgs/sec   p50 us   p99 us "
+      << "p99.9 us    max us  migrations" << std::endl;
+    for (size_t r = 0; r < rates.size(); r++)
+      {
+      step.rate = rates[r];
+      step.cores.clear();
+      run_step (step);
+      step.cores = cores;
+      run_step (step);
+      }
+    }
+  catch (const std::exception& e)
+    {
+    std::cerr << e.what() << std::endl;
+    return 1;
+    }
+  return 0;
+  }
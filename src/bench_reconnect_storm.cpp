@@ -0,0 +1,269 @@
+/*
+  bench_reconnect_storm.cpp
+
+  A benchmark for server.cpp: it measures what a misconfigured client
+    costs the server -- one that keeps trying to attach to an address that
+    doesn't exist.
+
+  The program opens a number of connections, and on each one attaches a
+    receiver to a bad address. Whenever the server refuses, it tries
+    again, as fast as it can: if the server refused just the link, it
+    attaches a new link on the same connection; if the server closed the
+    connection, it reconnects, which means a new TCP connection and SASL
+    exchange every time. After a fixed time it reports how many attempts
+    were refused, and how much CPU time the server and this program used
+    for each one.
+
+  Run it twice, once with refuse_links set to true in the server's main()
+    and once with it set to false, to compare the two ways of refusing.
+    The server's CPU time is read from /proc, so the server must be
+    running on the same machine; this program looks for a process called
+    'server', unless server_pid is set. Turn off the server's per-event
+    logging (or send its output to /dev/null) before taking the numbers
+    seriously, since otherwise most of its time goes on printing.
+
+  Settings are in main(), at the end.
+*/
+
+#include <proton/connection.hpp>
+#include <proton/connection_options.hpp>
+#include <proton/container.hpp>
+#include <proton/messaging_handler.hpp>
+#include <proton/receiver.hpp>
+#include <proton/transport.hpp>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <vector>
+#include <string>
+
+typedef std::chrono::steady_clock Clock;
+
+/** CPU time used by a process so far, in seconds, or -1 if it can't be
+    read. */
+double process_cpu (pid_t pid)
+  {
+  std::ifstream f ("/proc/" + std::to_string (pid) + "/stat");
+  std::string line;
+  if (!std::getline (f, line)) return -1;
+  // The command name, in brackets, can contain spaces; the fields that
+  //   we want are the 12th and 13th after it
+  std::istringstream in (line.substr (line.rfind (')') + 2));
+  std::string field;
+  double utime = 0, stime = 0;
+  for (int i = 0; i < 13 && in >> field; i++)
+    {
+    if (i == 11) utime = std::stod (field);
+    if (i == 12) stime = std::stod (field);
+    }
+  return (utime + stime) / sysconf (_SC_CLK_TCK);
+  }
+
+/** CPU time used by this process so far, in seconds. */
+double own_cpu ()
+  {
+  struct rusage u;
+  getrusage (RUSAGE_SELF, &u);
+  return u.ru_utime.tv_sec + u.ru_utime.tv_usec / 1e6
+    + u.ru_stime.tv_sec + u.ru_stime.tv_usec / 1e6;
+  }
+
+/** The ID of a process with the given name, or 0 if there isn't one. */
+pid_t find_process (const std::string &name)
+  {
+  DIR *d = opendir ("/proc");
+  if (!d) return 0;
+  pid_t found = 0;
+  struct dirent *e;
+  while (!found && (e = readdir (d)))
+    {
+    pid_t pid = atoi (e->d_name);
+    if (pid <= 0) continue;
+    std::ifstream f (std::string ("/proc/") + e->d_name + "/comm");
+    std::string comm;
+    if (std::getline (f, comm) && comm == name) found = pid;
+    }
+  closedir (d);
+  return found;
+  }
+
+/*
+ * StormClient keeps attaching to a bad address on one connection, and
+ *   reconnects whenever the server closes the connection. All the
+ *   clients run on the container's one thread, so the counters need no
+ *   locking.
+ */
+class StormClient : public proton::messaging_handler
+  {
+  protected:
+    std::string url;
+    std::string address;
+    proton::connection connection;
+
+    void attach (proton::connection &c)
+      {
+      c.open_receiver (address);
+      }
+
+  public:
+    bool running;
+    long link_refusals;
+    long connection_refusals;
+    long connections;
+
+    StormClient (const std::string &url, const std::string &address)
+      {
+      this->url = url;
+      this->address = address;
+      this->running = true;
+      this->link_refusals = this->connection_refusals = 0;
+      this->connections = 0;
+      }
+
+    void connect (proton::container &c)
+      {
+      connections++;
+      c.connect (url, proton::connection_options().handler (*this)
+        .sasl_allow_insecure_mechs (true));
+      }
+
+    void stop ()
+      {
+      running = false;
+      if (connection.active()) connection.close();
+      }
+
+    void on_connection_open (proton::connection &c) override
+      {
+      connection = c;
+      if (running)
+        attach (c);
+      else
+        c.close();
+      }
+
+    /** The server refused the link, and left the connection open. */
+    void on_receiver_close (proton::receiver &r) override
+      {
+      if (r.error().empty()) return;
+      link_refusals++;
+      proton::connection c = r.connection();
+      if (running)
+        attach (c);
+      else
+        c.close();
+      }
+
+    /** The server closed the connection, or it went away. */
+    void on_transport_close (proton::transport &t) override
+      {
+      if (!running) return;
+      connection_refusals++;
+      connect (t.connection().container());
+      }
+
+    // The refusals are what we expect, so don't let them stop the
+    //   container, or flood the output
+    void on_error (const proton::error_condition &e) override {}
+  };
+
+/*
+ * StormHandler starts the clients, and stops them after a while.
+ */
+class StormHandler : public proton::messaging_handler
+  {
+  protected:
+    std::vector<StormClient*> &clients;
+    int seconds;
+
+  public:
+    Clock::time_point started;
+
+    StormHandler (std::vector<StormClient*> &clients, int seconds) :
+        clients (clients)
+      {
+      this->seconds = seconds;
+      }
+
+    void on_container_start (proton::container &c) override
+      {
+      started = Clock::now();
+      for (size_t i = 0; i < clients.size(); i++)
+        clients[i]->connect (c);
+      c.schedule (proton::duration::SECOND * seconds, [this]()
+        {
+        for (size_t i = 0; i < clients.size(); i++)
+          clients[i]->stop();
+        });
+      }
+  };
+
+int main (int argc, char **argv)
+  {
+  try
+    {
+    std::string host_and_port = "127.0.0.1:5672";
+    // An address that the server doesn't have
+    std::string bad_address = "no_such_queue";
+    // Connections trying at the same time
+    int clients = 8;
+    int seconds = 10;
+    // The server's process ID; 0 to look for a process called 'server'
+    pid_t server_pid = 0;
+
+    if (server_pid == 0) server_pid = find_process ("server");
+    if (server_pid == 0)
+      std::cerr << "Can't find the server process; "
+        << "its CPU time won't be reported" << std::endl;
+
+    std::vector<StormClient*> storm;
+    for (int i = 0; i < clients; i++)
+      storm.push_back (new StormClient (host_and_port, bad_address));
+    StormHandler h (storm, seconds);
+    proton::container container (h);
+
+    double server_cpu = server_pid ? process_cpu (server_pid) : -1;
+    double client_cpu = own_cpu();
+    container.run();
+    double secs = std::chrono::duration<double>
+      (Clock::now() - h.started).count();
+    if (server_pid) server_cpu = process_cpu (server_pid) - server_cpu;
+    client_cpu = own_cpu() - client_cpu;
+
+    long link_refusals = 0, connection_refusals = 0, connections = 0;
+    for (int i = 0; i < clients; i++)
+      {
+      link_refusals += storm[i]->link_refusals;
+      connection_refusals += storm[i]->connection_refusals;
+      connections += storm[i]->connections;
+      delete storm[i];
+      }
+    long attempts = link_refusals + connection_refusals;
+
+    std::cout << std::fixed << std::setprecision (1);
+    std::cout << "refused links:       " << link_refusals << std::endl;
+    std::cout << "refused connections: " << connection_refusals
+      << std::endl;
+    std::cout << "connections opened:  " << connections << std::endl;
+    std::cout << "attempts/sec:        " << (secs > 0 ? attempts / secs : 0)
+      << std::endl;
+    if (attempts == 0) return 0;
+    if (server_pid)
+      std::cout << "server CPU:          " << server_cpu * 1e6 / attempts
+        << " us/attempt (" << server_cpu * 100 / secs << "% of a core)"
+        << std::endl;
+    std::cout << "client CPU:          " << client_cpu * 1e6 / attempts
+      << " us/attempt" << std::endl;
+    }
+  catch (const std::exception& e)
+    {
+    std::cerr << e.what() << std::endl;
+    return 1;
+    }
+  return 0;
+  }
@@ -0,0 +1,173 @@
+/*
+  bench_selector_index.cpp
+
+  A benchmark for selector_index.hpp: it measures how long it takes to
+    find all the selectors, out of many, that a message matches -- using
+    a SelectorIndex, and by evaluating every selector in turn, which is
+    what a program without an index would do.
+
+  The selectors are like a large number of subscriptions, each for one
+    customer's orders above some price: "customer = 'customer-N' AND
+    price > X". There are ten or so for each customer, so the index finds
+    about ten candidates for each message. A small share of them (set by
+    unindexed_percent) has no equality condition that the index could
+    use, and so has to be evaluated for every message; these set the
+    floor on what the index can do.
+
+  The messages are encoded and decoded, as in bench_selector.cpp, so that
+    their properties are read in their encoded form. Both ways must find
+    the same selectors, and the program checks that they do.
+
+  This program doesn't need a broker. Settings are in main(), at the end.
+*/
+
+#include <proton/message.hpp>
+#include <proton/scalar.hpp>
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <memory>
+#include <algorithm>
+
+#include "selector_index.hpp"
+
+typedef std::chrono::steady_clock Clock;
+
+// Somewhere to put a result, so the compiler can't optimize away the work
+volatile long sink;
+
+/** An order from one of the customers, as it would be received. */
+proton::message make_message (int i, int customers)
+  {
+  proton::message m;
+  m.body (std::string (100, 'x'));
+  m.properties().put ("customer", "customer-"
+    + std::to_string ((i * 7919L) % customers));
+  m.properties().put ("price", (int64_t)(i * 37 % 200));
+  m.properties().put ("region", std::string (i % 2 ? "eu" : "us"));
+  m.properties().put ("urgent", i % 5 == 0);
+  std::vector<char> bytes;
+  m.encode (bytes);
+  proton::message received;
+  received.decode (bytes);
+  return received;
+  }
+
+/** The selector for subscription i. */
+std::string make_selector (int i, int customers, int unindexed_percent)
+  {
+  int price = i * 13 % 200;
+  if (i % 100 < unindexed_percent)
+    return "price BETWEEN " + std::to_string (price) + " AND "
+      + std::to_string (price + 5) + " OR region = 'apac'";
+  return "customer = 'customer-" + std::to_string (i % customers)
+    + "' AND price > " + std::to_string (price);
+  }
+
+/** Time one way of matching, for 'count' messages taken in turn. Returns
+    microseconds per message. */
+template <class F>
+double run (F match, const std::vector<proton::message> &messages,
+      long count)
+  {
+  long matched = 0;
+  std::vector<SelectorIndex::Id> out;
+  Clock::time_point start = Clock::now();
+  for (long i = 0; i < count; i++)
+    {
+    match (messages[i % messages.size()], out);
+    matched += out.size();
+    }
+  Clock::time_point end = Clock::now();
+  sink = matched;
+  return std::chrono::duration<double, std::micro> (end - start).count()
+    / count;
+  }
+
+int main (int argc, char **argv)
+  {
+  try
+    {
+    std::vector<int> sizes = { 10, 1000, 100000 };
+    // Subscriptions per customer, on average
+    int per_customer = 10;
+    // Subscriptions that the index can't use, as a percentage
+    int unindexed_percent = 1;
+    // Different messages to match, in turn
+    int message_count = 256;
+    // Roughly how many selector evaluations to time, for each size and
+    //   each way; fewer messages are used as the number of selectors grows
+    long work = 20000000;
+
+    std::cout << std::fixed << std::setprecision (2);
+    std::cout << "  selectors  unindexed  candidates/msg  matches/msg"
+      << "  index us/msg  all us/msg  speed-up" << std::endl;
+    for (size_t s = 0; s < sizes.size(); s++)
+      {
+      int n = sizes[s];
+      int customers = std::max (1, n / per_customer);
+      std::vector<proton::message> messages;
+      for (int i = 0; i < message_count; i++)
+        messages.push_back (make_message (i, customers));
+
+      SelectorIndex index;
+      std::vector<std::unique_ptr<CompiledSelector>> all;
+      for (int i = 0; i < n; i++)
+        {
+        std::string selector = make_selector (i, customers,
+          unindexed_percent);
+        SelectorIndex::Id id = index.add (selector);
+        if (id != (SelectorIndex::Id)i)
+          throw std::runtime_error ("unexpected selector ID");
+        all.emplace_back (new CompiledSelector (selector));
+        }
+
+      // Check that the two ways agree, and count the work the index does
+      std::vector<SelectorIndex::Id> by_index, by_all;
+      long candidates = 0, matches = 0;
+      for (int j = 0; j < message_count; j++)
+        {
+        candidates += index.match (messages[j], by_index);
+        by_all.clear();
+        for (int i = 0; i < n; i++)
+          if (all[i]->matches (messages[j])) by_all.push_back (i);
+        std::sort (by_index.begin(), by_index.end());
+        if (by_index != by_all)
+          std::cerr << "disagree on message " << j << " with " << n
+            << " selectors" << std::endl;
+        matches += by_all.size();
+        }
+
+      double index_us = run ([&index](const proton::message &m,
+          std::vector<SelectorIndex::Id> &out)
+        {
+        index.match (m, out);
+        }, messages, std::max (1000L, work / (candidates / message_count
+          + 1)));
+      double all_us = run ([&all](const proton::message &m,
+          std::vector<SelectorIndex::Id> &out)
+        {
+        out.clear();
+        for (size_t i = 0; i < all.size(); i++)
+          if (all[i]->matches (m)) out.push_back (i);
+        }, messages, std::max (100L, work / n));
+
+      std::cout << std::setw (11) << n
+        << std::setw (11) << index.unindexed_count()
+        << std::setw (16) << (double)candidates / message_count
+        << std::setw (13) << (double)matches / message_count
+        << std::setw (14) << index_us
+        << std::setw (12) << all_us
+        << std::setw (9) << std::setprecision (0) << all_us / index_us
+        << "x" << std::setprecision (2) << std::endl;
+      }
+    }
+  catch (const std::exception& e)
+    {
+    std::cerr << e.what() << std::endl;
+    return 1;
+    }
+  return 0;
+  }
@@ -0,0 +1,194 @@
+/*
+  bench_selector_sharding.cpp
+
+  A benchmark for selector_shard.hpp: it measures how the rate at which
+    one queue is consumed grows, as the subscription is split into more
+    shards, each on its own connection and container thread.
+
+  For each step, the program first fills the queue with 'count' messages,
+    each with an integer 'seq' property, and then consumes them with a
+    ShardedSubscription of N shards, partitioned on 'seq' (or on the
+    message ID). Each message costs the consumer 'work_us' microseconds
+    of busy work, standing in for whatever a real application would do
+    with it -- with no work at all, the broker is the bottleneck, and
+    sharding can't help. The step ends when every message has been
+    received. The program checks that no message was received twice,
+    and none was missed, and shows how evenly the shards shared the
+    work.
+
+  This needs a broker that applies selectors, such as server.cpp. The
+    queue should be empty at the start. Give the server enough threads
+    for the largest step, and bear in mind that every shard's selector is
+    evaluated by the server against the messages it passes over, so the
+    server's CPU use grows with the number of shards, too.
+
+  Settings are in main(), at the end.
+*/
+
+#include <proton/connection.hpp>
+#include <proton/connection_options.hpp>
+#include <proton/container.hpp>
+#include <proton/message.hpp>
+#include <proton/messaging_handler.hpp>
+#include <proton/sender.hpp>
+#include <proton/tracker.hpp>
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <string>
+
+#include "selector_shard.hpp"
+
+typedef std::chrono::steady_clock Clock;
+
+/*
+ * FillSender sends 'count' numbered messages, and closes the connection
+ *   when they have all been accepted.
+ */
+class FillSender : public proton::messaging_handler
+  {
+  protected:
+    std::string address;
+    int count;
+    int sent;
+    int accepted;
+    proton::message msg;
+
+  public:
+    FillSender (const std::string &address, int count, size_t body_size)
+      {
+      this->address = address;
+      this->count = count;
+      this->sent = 0;
+      this->accepted = 0;
+      this->msg.body (std::string (body_size, 'x'));
+      }
+
+    void on_connection_open (proton::connection &c) override
+      {
+      c.open_sender (address);
+      }
+
+    void on_sendable (proton::sender &s) override
+      {
+      while (s.credit() > 0 && sent < count)
+        {
+        msg.id (proton::message_id ((uint64_t)sent));
+        msg.properties().put ("seq", (int64_t)sent);
+        s.send (msg);
+        sent++;
+        }
+      }
+
+    void on_tracker_accept (proton::tracker &t) override
+      {
+      if (++accepted == count) t.connection().close();
+      }
+
+    void on_error (const proton::error_condition &e) override
+      {
+      std::cerr << "error: " << e.what() << std::endl;
+      }
+  };
+
+void fill (const std::string &host_and_port, const std::string &queue,
+      int count, size_t body_size)
+  {
+  FillSender sender (queue, count, body_size);
+  proton::container container;
+  container.connect (host_and_port, proton::connection_options()
+    .handler (sender).sasl_allow_insecure_mechs (true));
+  container.run();
+  }
+
+/** Spin for about 'us' microseconds. */
+void busy (int us)
+  {
+  Clock::time_point until = Clock::now() + std::chrono::microseconds (us);
+  while (Clock::now() < until) {}
+  }
+
+int main (int argc, char **argv)
+  {
+  try
+    {
+    std::string host_and_port = "127.0.0.1:5672";
+    std::string queue = "foo";
+    // The user's own selector, which every message should match
+    std::string selector = "seq >= 0";
+    // Partition on the 'seq' property, or on the message ID
+    ShardedSubscription::By by = ShardedSubscription::PROPERTY;
+    int count = 20000;
+    size_t body_size = 100;
+    // Time spent on each message by the consumer
+    int work_us = 50;
+    int credit = 100;
+    // Shards (and consumer threads) at each step
+    std::vector<int> steps = { 1, 2, 4, 8 };
+
+    std::cout << std::fixed << std::setprecision (1);
+    std::cout << "shards   msgs/sec  speed-up  duplicates  missed"
+      << "  busiest shard" << std::endl;
+    double base = 0;
+    for (size_t s = 0; s < steps.size(); s++)
+      {
+      int n = steps[s];
+      fill (host_and_port, queue, count, body_size);
+
+      // Times each message was received, by seq
+      std::unique_ptr<std::atomic<int>[]> seen (new std::atomic<int>[count]);
+      for (int i = 0; i < count; i++) seen[i] = 0;
+      std::atomic<long> total (0);
+      std::unique_ptr<ShardedSubscription> subscription;
+      Clock::time_point end;
+      subscription.reset (new ShardedSubscription (host_and_port, queue,
+        selector, n, by, "seq",
+        [&](int shard, proton::delivery &d, proton::message &m)
+        {
+        busy (work_us);
+        int64_t seq = proton::get<int64_t> (m.properties().get ("seq"));
+        if (seq >= 0 && seq < count) seen[seq]++;
+        if (++total == count)
+          {
+          end = Clock::now();
+          subscription->stop();
+          }
+        }, credit));
+
+      proton::container container;
+      Clock::time_point start = Clock::now();
+      subscription->start (container, proton::connection_options()
+        .sasl_allow_insecure_mechs (true));
+      container.run (n);
+
+      long duplicates = 0, missed = 0, busiest = 0;
+      for (int i = 0; i < count; i++)
+        {
+        if (seen[i] == 0) missed++;
+        if (seen[i] > 1) duplicates += seen[i] - 1;
+        }
+      for (int i = 0; i < n; i++)
+        if (subscription->received (i) > busiest)
+          busiest = subscription->received (i);
+      if (total < count) end = Clock::now();
+      double secs = std::chrono::duration<double> (end - start).count();
+      double rate = secs > 0 ? total / secs : 0;
+      if (s == 0) base = rate;
+      std::cout << std::setw (6) << n
+        << std::setw (11) << (long)rate
+        << std::setw (9) << (base > 0 ? rate / base : 0) << "x"
+        << std::setw (12) << duplicates
+        << std::setw (8) << missed
+        << std::setw (14) << busiest * 100.0 / count << "%" << std::endl;
+      }
+    }
+  catch (const std::exception& e)
+    {
+    std::cerr << e.what() << std::endl;
+    return 1;
+    }
+  return 0;
+  }
@@ -0,0 +1,235 @@
+/*
+  bench_server_scaling.cpp
+
+  A benchmark for server.cpp: it measures how many messages per second the
+    server accepts, as the number of connections, and the number of
+    threads, grow together.
+
+  For each step, the program opens N connections to the server, each with
+    one sender, and runs its container on N threads. Each step sends the
+    same number of messages, shared between the senders, which send as
+    fast as their link credit allows, and the step ends when the server
+    has accepted all of them. The time taken is from the first connection
+    being opened, to the last message being accepted.
+
+  Nothing consumes from the queue while a step runs, so the server stores
+    every message that the step sends. Once the server holds more bytes
+    than its high watermark (256MB, set in server.cpp's main()), it gives
+    the senders no more credit until consumers bring it down again, and a
+    step that needs to send more than that never ends. So the number of
+    messages in each step is kept well below the watermark, for the body
+    size set in main(); change one, and check the other. After each step,
+    and before the next one starts, this program consumes all the
+    messages that the step sent -- this is not timed -- so that the steps
+    don't add up. That needs the queue to have no other consumers.
+
+  The server can't be told to change its thread count while it runs, so
+    to step the server's threads with the connections, run it once for
+    each step, with the thread count as its argument, and give this
+    program that step's connection count as its argument:
+
+    for n in 1 2 4 8 16; do
+      ./server $n & sleep 1; ./bench_server_scaling $n; kill $!; wait
+    done
+
+  With no arguments, this program runs all the steps set in main() against
+    one server, whose thread count stays the same throughout; that shows
+    how the server copes with more connections, rather than how it
+    scales. Either way, make sure that the machine has enough cores for
+    both programs.
+
+  Settings are in main(), at the end.
+*/
+
+#include <proton/connection.hpp>
+#include <proton/connection_options.hpp>
+#include <proton/container.hpp>
+#include <proton/message.hpp>
+#include <proton/messaging_handler.hpp>
+#include <proton/receiver_options.hpp>
+#include <proton/delivery.hpp>
+#include <proton/sender.hpp>
+#include <proton/tracker.hpp>
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <cstdlib>
+
+typedef std::chrono::steady_clock Clock;
+
+/*
+ * BenchSender sends 'count' messages on one connection, and closes it
+ *   when they have all been accepted.
+ */
+class BenchSender : public proton::messaging_handler
+  {
+  protected:
+    std::string address;
+    int count;
+    int sent;
+    int accepted;
+    proton::message msg;
+
+  public:
+    Clock::time_point finished;
+
+    BenchSender (const std::string &address, int count, size_t body_size)
+      {
+      this->address = address;
+      this->count = count;
+      this->sent = 0;
+      this->accepted = 0;
+      this->msg.body (std::string (body_size, 'x'));
+      }
+
+    void on_connection_open (proton::connection &c) override
+      {
+      c.open_sender (address);
+      }
+
+    void on_sendable (proton::sender &s) override
+      {
+      while (s.credit() > 0 && sent < count)
+        {
+        s.send (msg);
+        sent++;
+        }
+      }
+
+    void on_tracker_accept (proton::tracker &t) override
+      {
+      if (++accepted == count)
+        {
+        finished = Clock::now();
+        t.connection().close();
+        }
+      }
+
+    void on_error (const proton::error_condition &e) override
+      {
+      std::cerr << "error: " << e.description() << std::endl;
+      }
+  };
+
+/*
+ * BenchDrainer consumes 'count' messages from the queue, so that the
+ *   next step starts with the queue empty.
+ */
+class BenchDrainer : public proton::messaging_handler
+  {
+  protected:
+    std::string address;
+    long count;
+    long received;
+
+  public:
+    BenchDrainer (const std::string &address, long count)
+      {
+      this->address = address;
+      this->count = count;
+      this->received = 0;
+      }
+
+    void on_connection_open (proton::connection &c) override
+      {
+      if (count == 0)
+        {
+        c.close();
+        return;
+        }
+      c.open_receiver (address, proton::receiver_options()
+        .credit_window (1000));
+      }
+
+    void on_message (proton::delivery &d, proton::message &m) override
+      {
+      // Accepted when this returns
+      if (++received == count) d.connection().close();
+      }
+
+    void on_error (const proton::error_condition &e) override
+      {
+      std::cerr << "error: " << e.description() << std::endl;
+      }
+  };
+
+/** Consume 'count' messages from the queue. */
+void drain (const std::string &host_and_port, const std::string &queue,
+      long count)
+  {
+  BenchDrainer drainer (queue, count);
+  proton::container container;
+  container.connect (host_and_port, proton::connection_options()
+    .handler (drainer).sasl_allow_insecure_mechs (true));
+  container.run();
+  }
+
+/** Run one step of the benchmark with n connections, on n threads, each
+    sending 'count' messages. Returns the number of messages accepted per
+    second. */
+double run_step (const std::string &host_and_port, const std::string &queue,
+      int n, int count, size_t body_size)
+  {
+  std::vector<BenchSender*> senders;
+  proton::container container;
+  Clock::time_point start = Clock::now();
+  for (int i = 0; i < n; i++)
+    {
+    BenchSender *s = new BenchSender (queue, count, body_size);
+    senders.push_back (s);
+    container.connect (host_and_port, proton::connection_options()
+      .handler (*s).sasl_allow_insecure_mechs (true));
+    }
+  container.run (n);
+
+  Clock::time_point end = start;
+  for (int i = 0; i < n; i++)
+    {
+    if (senders[i]->finished > end) end = senders[i]->finished;
+    delete senders[i];
+    }
+  double secs = std::chrono::duration<double> (end - start).count();
+  return secs > 0 ? (double)n * count / secs : 0;
+  }
+
+int main (int argc, char **argv)
+  {
+  try
+    {
+    std::string host_and_port = "127.0.0.1:5672";
+    std::string queue = "foo";
+    // Messages in each step, shared between its connections. With the
+    //   encoding, each message takes about 150 bytes of the server's
+    //   256MB high watermark, so this is about 60MB
+    int messages = 400000;
+    size_t body_size = 100;
+    // Connections (and client threads) at each step, unless the steps
+    //   are given as arguments
+    std::vector<int> steps = { 1, 2, 4, 8, 16 };
+    if (argc > 1)
+      {
+      steps.clear();
+      for (int i = 1; i < argc; i++) steps.push_back (atoi (argv[i]));
+      }
+
+    std::cout << "connections   msgs/sec   msgs/sec/connection" << std::endl;
+    for (size_t i = 0; i < steps.size(); i++)
+      {
+      int count = messages / steps[i];
+      double rate = run_step (host_and_port, queue, steps[i], count,
+        body_size);
+      drain (host_and_port, queue, (long)steps[i] * count);
+      std::cout << std::setw (11) << steps[i]
+        << std::setw (11) << (long)rate
+        << std::setw (22) << (long)(rate / steps[i]) << std::endl;
+      }
+    }
+  catch (const std::exception& e)
+    {
+    std::cerr << e.what() << std::endl;
+    return 1;
+    }
+  return 0;
+  }
@@ -0,0 +1,93 @@
+/*
+  body_view.hpp
+
+  BodyView gives read-only access to the body of a received message
+    without copying it. The usual ways of getting at a body --
+    proton::get<std::string>, proton::coerce<std::string>, or
+    proton::get<proton::binary> -- all copy the payload into a new object,
+    which, for large messages, costs far more than anything else the
+    consumer does.
+
+  When Proton decodes a message, the body ends up in a pn_data_t object
+    belonging to the message, and the C API can return a pointer into that
+    object's buffer. The C++ API doesn't expose the pn_data_t, but the
+    codec::decoder class does hold one, and makes it available to
+    subclasses. So BodyView is a decoder that shares the message's body,
+    and returns a std::string_view of the bytes in place.
+
+  The view is only valid for as long as the message is alive and
+    unmodified. In practice, that means it must not outlive the
+    on_message() call in which it was created -- Proton decodes each
+    delivery into a message that it owns.
+
+  AMQP 'amqp-value' bodies of type string, symbol and binary, and 'data'
+    sections (which Proton presents as binary) can be viewed. Anything
+    else raises proton::conversion_error, just as proton::get would.
+*/
+
+#ifndef BODY_VIEW_HPP
+#define BODY_VIEW_HPP
+
+#include <proton/message.hpp>
+#include <proton/value.hpp>
+#include <proton/error.hpp>
+#include <proton/codec/decoder.hpp>
+#include <proton/codec.h>
+#include <string_view>
+
+class BodyView : protected proton::codec::decoder
+  {
+  protected:
+    pn_bytes_t bytes;
+    pn_type_t type;
+
+  public:
+    explicit BodyView (const proton::message &m) :
+        proton::codec::decoder (m.body())
+      {
+      bytes.size = 0;
+      bytes.start = 0;
+      type = PN_NULL;
+      pn_data_t *data = pn_object();
+      pn_data_rewind (data);
+      if (!pn_data_next (data)) return; // Empty body
+      type = pn_data_type (data);
+      switch (type)
+        {
+        case PN_STRING: bytes = pn_data_get_string (data); break;
+        case PN_SYMBOL: bytes = pn_data_get_symbol (data); break;
+        case PN_BINARY: bytes = pn_data_get_binary (data); break;
+        default: break;
+        }
+      }
+
+    /** True if the body is a string, symbol, or binary. */
+    bool viewable () const
+      {
+      return type == PN_STRING || type == PN_SYMBOL || type == PN_BINARY;
+      }
+
+    /** True if the body is an AMQP string -- what a JMS client would
+          send as a TextMessage. */
+    bool is_text () const { return type == PN_STRING; }
+
+    /** Returns the body bytes, whether text or binary. */
+    std::string_view view () const
+      {
+      if (!viewable())
+        throw proton::conversion_error ("message body is not string or binary");
+      return std::string_view (bytes.start, bytes.size);
+      }
+
+    /** Returns the body, which must be an AMQP string (UTF-8). */
+    std::string_view text () const
+      {
+      if (!is_text())
+        throw proton::conversion_error ("message body is not a string");
+      return std::string_view (bytes.start, bytes.size);
+      }
+
+    size_t size () const { return bytes.size; }
+  };
+
+#endif
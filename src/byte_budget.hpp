@@ -0,0 +1,141 @@
+/*
+  byte_budget.hpp
+
+  ByteBudget controls a receiver's link credit by the number of bytes
+    that are buffered, rather than by the number of messages. AMQP credit
+    is counted in messages, so a credit window of 1000 might mean 12kB of
+    prefetched data, or 1GB, depending on how big the messages are. With
+    a mixture of message sizes, there's no single window that is both
+    big enough to keep small messages flowing, and small enough not to
+    exhaust memory when large ones arrive.
+
+  The budget covers two kinds of bytes:
+    - messages that have arrived, but which the application has not yet
+      finished with (it reports these with received() and processed());
+    - messages that the broker is entitled to send, because we have given
+      it credit for them. We can't know how big these will be, so we use
+      the larger of a running average of the sizes of recent messages and
+      a slowly-decaying peak, so one large message shrinks the window at
+      once rather than after a few tens of them.
+    Credit is only issued while the sum of these is below the budget.
+
+  The budget is a soft target, not a hard limit. Credit that has been
+    granted can't be taken back, so if the messages the broker sends
+    against it are bigger than the estimate, the bytes held can pass the
+    budget -- by up to the outstanding credit times the difference in
+    size. No more credit is issued until they drop below it again. Where
+    memory is tight, max_messages bounds the overshoot too.
+
+  Whatever the budget, at least one message is allowed when nothing is
+    buffered and there is no credit outstanding; otherwise, a single
+    message larger than the budget would stop the link for ever.
+
+  To use it, set the receiver's credit_window to zero, so that Proton does
+    not issue credit itself, and call top_up() when the link opens, and
+    whenever processed() has released some bytes. ByteBudget is not
+    thread-safe -- call it only on the receiver's container thread.
+*/
+
+#ifndef BYTE_BUDGET_HPP
+#define BYTE_BUDGET_HPP
+
+#include <proton/receiver.hpp>
+#include <proton/message.hpp>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+#include "body_view.hpp"
+
+class ByteBudget
+  {
+  protected:
+    uint64_t budget; // Bytes
+    int max_messages; // Limit on buffered messages + credit, if not 0
+    uint64_t held_bytes;
+    int held_messages;
+    double average_size; // Exponentially-weighted, bytes
+    double peak_size; // Largest recent message, decaying, bytes
+    uint64_t credit_granted; // Total, for reporting
+
+  public:
+    /** initial_estimate is the message size to assume until some have
+          actually arrived. max_messages, if not zero, is an upper limit
+          on the number of messages buffered or in flight -- useful when
+          messages are held in a fixed-size structure. */
+    ByteBudget (uint64_t budget, uint64_t initial_estimate = 1024,
+          int max_messages = 0)
+      {
+      this->budget = budget;
+      this->max_messages = max_messages;
+      this->held_bytes = 0;
+      this->held_messages = 0;
+      this->average_size = initial_estimate;
+      this->peak_size = initial_estimate;
+      this->credit_granted = 0;
+      }
+
+    /** An estimate of the size of a message, for accounting purposes. For
+          string and binary bodies this is the body size, which costs
+          nothing to find out; anything else is encoded to find its size. */
+    static size_t message_bytes (const proton::message &m)
+      {
+      BodyView body (m);
+      if (body.viewable()) return body.size();
+      static thread_local std::vector<char> buf;
+      m.encode (buf);
+      return buf.size();
+      }
+
+    /** Record that a message of this many bytes has arrived. */
+    void received (size_t bytes)
+      {
+      held_bytes += bytes;
+      held_messages++;
+      // A weight of 1/16 forgets old sizes within a few tens of messages
+      average_size += (bytes - average_size) / 16.0;
+      peak_size = std::max ((double)bytes, peak_size * 15 / 16);
+      }
+
+    /** Record that the application has finished with messages totalling
+          this many bytes. */
+    void processed (size_t bytes, int messages = 1)
+      {
+      held_bytes -= bytes;
+      held_messages -= messages;
+      }
+
+    /** How much credit to add to a link that currently has link_credit. */
+    int credit_to_issue (int link_credit)
+      {
+      double size = std::max (std::max (average_size, peak_size), 1.0);
+      double room = (double)budget - held_bytes - link_credit * size;
+      // (Clamped, so a huge budget and tiny messages can't overflow)
+      int n = room > 0 ? (int)std::min (room / size, 1e6) : 0;
+      if (max_messages > 0 && n > max_messages - held_messages - link_credit)
+        n = max_messages - held_messages - link_credit;
+      if (n <= 0 && held_messages == 0 && link_credit == 0) n = 1;
+      return n > 0 ? n : 0;
+      }
+
+    /** Issue whatever credit the budget allows. To avoid sending a flow
+          frame for every message processed, credit is only added when the
+          link has run dry, or when it would grow by at least an eighth. */
+    void top_up (proton::receiver &r)
+      {
+      int credit = r.credit();
+      int n = credit_to_issue (credit);
+      if (n > 0 && (credit == 0 || n * 8 >= credit + n))
+        {
+        r.add_credit (n);
+        credit_granted += n;
+        }
+      }
+
+    uint64_t buffered_bytes () const { return held_bytes; }
+    int buffered_messages () const { return held_messages; }
+    double estimated_message_size () const { return average_size; }
+    uint64_t total_credit_granted () const { return credit_granted; }
+  };
+
+#endif
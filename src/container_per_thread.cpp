@@ -20,10 +20,42 @@
  With later C++ versions, most of the Proton artefacts are thread-safe,
  because the container maintains an internal thread pool for connections.
 
+ Each thread can be pinned to a CPU core of its own (see core_local.hpp),
+ so that the scheduler does not move it about, leaving its working data
+ in the caches of the core it left. The handler and container are
+ created on the container thread itself, after it has been pinned, so
+ that their memory is allocated, and first touched, on that core; so is
+ an arena (CoreArena) from which handle_message() can allocate whatever
+ it needs. While the threads run, main() reports the throughput of each
+ one, with the core that it is pinned to. bench_pinned_containers.cpp
+ compares the throughput and latency, pinned and unpinned.
+
+ The threads, containers and handlers are all owned by a ContainerPool
+ (see container_pool.hpp), which can change the number of threads while
+ it runs, and stop them all cleanly. Here, that happens on SIGINT or
+ SIGTERM: each container closes its connection, waiting no longer than 
+ DRAIN_SECS, and the program reports its totals and exits.
+
+ The program starts with THREADS threads, but with AUTOSCALE, the number
+ changes to suit the load, between MIN_THREADS and MAX_THREADS (see
+ pool_autoscaler.hpp). Each handler measures the time it spends in
+ handle_message(), and counts the messages that arrive when its 
+ receiver has used up its credit; from these, and the rate at which
+ messages arrive, the autoscaler works out whether the consumers are
+ falling behind, or have capacity to spare.
+
+ Each handler counts each message once, through the pool (see
+ ContainerStats in container_pool.hpp), which keeps the counts, and the
+ time that each message took to handle, in a block of counters and
+ histograms for each thread (see thread_stats.hpp), so that the threads
+ never write to the same cache line. The same counts give the throughput
+ of each thread, and drive the autoscaler; a reporter thread adds the
+ blocks up every REPORT_SECS, and prints the totals for the process.
+
  Kevin Boone, April 2022 
 */
 
-#include <unistd.h>
+#include <signal.h>
 #include <proton/connection.hpp>
 #include <proton/connection_options.hpp>
 #include <proton/container.hpp>
@@ -31,16 +63,37 @@
 #include <proton/message.hpp>
 #include <proton/receiver_options.hpp>
 #include <proton/delivery.hpp>
+#include <proton/receiver.hpp>
 #include <proton/value.hpp>
 
 #include <iostream>
-#include <thread>
+#include <iomanip>
+#include <chrono>
+#include <vector>
+#include <memory>
+#include <string_view>
+
+#include "body_view.hpp"
+#include "container_pool.hpp"
+#include "pool_autoscaler.hpp"
+#include "thread_stats.hpp"
 
 #define URL "localhost:5672/foo"
 #define USER "admin"
 #define PASSWORD "admin"
-// Number of threads (and thus connections) on which to consume
+// Number of threads (and thus connections) on which to consume, at
+//   first
 #define THREADS 10
+// Whether to change the number of threads with the load, and the limits
+#define AUTOSCALE true
+#define MIN_THREADS 1
+#define MAX_THREADS 32
+// Whether to pin each thread to a core; see main() for which
+#define PIN true
+// Seconds between throughput reports
+#define REPORT_SECS 5
+// Seconds to wait for the containers to finish, when stopping
+#define DRAIN_SECS 5
 
 #define BOLD_ON "\x1B[1m"
 #define BOLD_OFF "\x1B[0m"
@@ -48,24 +101,33 @@
 
 /** handle_message() is the terminal point for the handling of all messages.
     There are no inherent thread-safety issues, because no Proton artefacts 
-    are passed to this method, and the string argument is itself 
-    stack-based. */
-int handle_message (const std::string &msg)
+    are passed to this method. The string_view argument points into the 
+    message that is being delivered, which belongs to the calling container 
+    thread, and is not touched by anything else until on_message() 
+    returns -- so handle_message() must not keep the view after it returns
+    (make a std::string from it, if the text is needed later).
+    Anything that handle_message() needs to allocate should come from
+    'arena' (with std::pmr containers, for example), which belongs to
+    the calling thread, and is local to its core. */
+int handle_message (std::string_view msg, std::pmr::memory_resource *arena)
   {
   std::cout << "Handling message " << msg << std::endl; 
   return 1; // 1 == OK
   }
 
 /** MyHandler -- the usual Proton interaction handler. There will be one
-    instance per consuming thread. */
-class MyHandler : public proton::messaging_handler 
+    instance per consuming thread. It is a PoolHandler, so that the
+    pool can stop it. */
+class MyHandler : public PoolHandler
   {
-  int count; // Number of msgs received in this handler 
   int my_num; // Human-readable ID number for this handler instance
   std::string cont_id; // Container ID, for logging purposes
+  CoreArena &arena; // For handle_message()
 
   public:
-    MyHandler (int _my_num) : count (0), my_num (_my_num) { LOG_FUNC; }
+    MyHandler (int _my_num, CoreArena &_arena) 
+        : my_num (_my_num), arena (_arena)
+      { LOG_FUNC; }
 
     // For each container, start a receiver
     void on_container_start (proton::container &c) 
@@ -73,6 +135,8 @@ class MyHandler : public proton::messaging_handler
       LOG_FUNC;
       // Open a receiver, etc
       cont_id = c.id(); // Store the ID, for logging
+      std::cout << "Container thread " << cont_id << " started" 
+        << std::endl;
       proton::connection_options conn_options;
       conn_options.user (USER);
       conn_options.password (PASSWORD);
@@ -89,55 +153,148 @@ class MyHandler : public proton::messaging_handler
     void on_message (proton::delivery& dlv, proton::message& msg) 
       {
       LOG_FUNC;
-      count++;
-      std::cout << "Received " << count << " in handler " 
-            << my_num << std::endl; 
-      proton::value v = msg.body();
-      std::string m = proton::coerce<std::string> (v);
-      if (handle_message (m))
+      // This message isn't counted until it has been handled
+      std::cout << "Received " << stats().get (ContainerStats::MESSAGES) + 1
+            << " in handler " << my_num << std::endl; 
+      // If this message used the last of the credit, the broker may well
+      //   have more for us, that it can't send yet
+      bool drained = dlv.receiver().credit() == 0;
+      std::chrono::steady_clock::time_point start 
+        = std::chrono::steady_clock::now();
+      // BodyView gives us the text or binary body in place, without
+      //   copying it. Other types of body (numbers, maps...) still have to
+      //   be converted to a string.
+      int ok;
+      BodyView body (msg);
+      if (body.viewable())
+        ok = handle_message (body.view(), arena.resource());
+      else
+        ok = handle_message (proton::coerce<std::string> (msg.body()),
+          arena.resource());
+      if (ok)
         dlv.accept();
       else
         dlv.reject();
+      long busy_ns = std::chrono::duration_cast<std::chrono::nanoseconds>
+        (std::chrono::steady_clock::now() - start).count();
+      stats().message (ok, busy_ns, drained);
       }
   };
 
-/* Handler function for container thread. Just runs the container (and
- * so, never exits except on error)
- */
-void run_container (proton::container* cont)
+/** Print the pool's throughput since the last report, for each 
+    container and the core it's pinned to, and in total. 'last' holds 
+    the message counts from the last report, by container index. */
+void report (ContainerPool &pool, std::vector<long> &last, int secs)
   {
-  LOG_FUNC;
-
-  std::cout << "Container thread " << cont->id() << " started" << std::endl;
-  try
+  std::vector<ContainerPool::Stats> stats = pool.container_stats();
+  long total = 0;
+  std::cout << "Throughput, msgs/sec:" << std::endl;
+  for (size_t i = 0; i < stats.size(); i++)
     {
-    cont->run();
+    const ContainerPool::Stats &s = stats[i];
+    if ((size_t)s.index >= last.size()) last.resize (s.index + 1, 0);
+    long n = s.messages - last[s.index];
+    last[s.index] = s.messages;
+    total += n;
+    std::cout << "  container " << std::setw (3) << s.index << "  core "
+      << std::setw (3);
+    if (s.core >= 0)
+      std::cout << s.core;
+    else
+      std::cout << "any";
+    std::cout << std::setw (10) << n / secs << std::endl;
     }
-  catch (const std::exception& e) 
-    {
-    std::cerr << "container::run failed: " << e.what() << std::endl;
-    }
-  };
+  std::cout << "  total" << std::setw (27) << total / secs << std::endl;
+  }
 
+/** Print the process totals from the pool's ThreadStats, and the rate,
+    unless it's -1. */
+void print_totals (const ThreadStats::Snapshot &total, long rate)
+  {
+  std::cout << "Totals: " << total.counter (ContainerStats::MESSAGES)
+    << " messages";
+  if (rate >= 0) std::cout << " (" << rate << " msgs/sec)";
+  std::cout << ", " << total.counter (ContainerStats::ACCEPTED)
+    << " accepted, " << total.counter (ContainerStats::REJECTED)
+    << " rejected; handle_message() "
+    << "p50 " << total.percentile (ContainerStats::HANDLE_NS, 0.5) / 1000
+    << " us, "
+    << "p99 " << total.percentile (ContainerStats::HANDLE_NS, 0.99) / 1000
+    << " us, "
+    << "max " << total.max (ContainerStats::HANDLE_NS) / 1000.0 << " us"
+    << std::endl;
+  }
 
 int main(int argc, char **argv) 
   {
   try 
     {
-    // Instantiate a number of containers, each with its own 
-    //   proton::messaging_handler
-    for (int i = 0; i < THREADS; i++)
+    // The core for each thread; with PIN, thread i goes on core 
+    //   cores[i % cores.size()]. An empty list means cores 0, 1, 2...
+    //   in turn.
+    std::vector<int> cores;
+
+    if (PIN && cores.empty())
+      for (int i = 0; i < core_count(); i++) cores.push_back (i);
+    if (!PIN) cores.clear();
+
+    // SIGINT and SIGTERM are blocked here, before any threads are 
+    //   started, so that they are delivered only to the sigtimedwait() 
+    //   below
+    sigset_t signals;
+    sigemptyset (&signals);
+    sigaddset (&signals, SIGINT);
+    sigaddset (&signals, SIGTERM);
+    pthread_sigmask (SIG_BLOCK, &signals, NULL);
+
+    // The pool owns the threads, and each thread creates its own 
+    //   container, with its own proton::messaging_handler
+    ContainerPool pool ([](int i, CoreArena &arena)
+        {
+        return std::unique_ptr<PoolHandler> (new MyHandler (i, arena));
+        }, cores, std::chrono::seconds (DRAIN_SECS));
+
+    // Every handler's counts, added up by the reporter thread
+    ThreadStats &stats = pool.thread_stats();
+    stats.start_reporter (std::chrono::seconds (REPORT_SECS), 
+      [](const ThreadStats::Snapshot &total, 
+          const ThreadStats::Snapshot &interval)
+        {
+        print_totals (total,
+          interval.counter (ContainerStats::MESSAGES) / REPORT_SECS);
+        });
+    pool.resize (THREADS);
+
+    PoolAutoscaler::Settings scaling;
+    scaling.min_containers = MIN_THREADS;
+    scaling.max_containers = MAX_THREADS;
+    PoolAutoscaler autoscaler (pool, scaling);
+
+    // Report the throughput of each thread, and so of each core, and 
+    //   resize the pool to suit the load, until we are told to stop
+    std::vector<long> last;
+    struct timespec timeout = { REPORT_SECS, 0 };
+    while (sigtimedwait (&signals, NULL, &timeout) < 0)
       {
-      // We must allocate the handler and container using new, so they
-      // survives after this for loop finishes.
-      MyHandler *handler = new MyHandler (i);
-      proton::container *container = new proton::container (*handler);
-      new std::thread (run_container, container);
+      report (pool, last, REPORT_SECS);
+      if (!AUTOSCALE) continue;
+      PoolAutoscaler::Decision d = autoscaler.tick();
+      std::cout << "Load: " << (long)d.rate_per_connection 
+        << " msgs/sec per connection, " << (int)(d.utilisation * 100) 
+        << "% busy, " << (int)(d.drain * 100) << "% credit drained";
+      if (d.resized_to >= 0)
+        std::cout << "; " << d.reason << ", " << d.containers << " -> " 
+          << d.resized_to << " threads";
+      std::cout << std::endl;
       }
 
-    while (1) { sleep (1); }
-    // Don't need to clean up, as we never exit
-    
+    std::cout << "Stopping" << std::endl;
+    pool.stop();
+    stats.stop_reporter();
+    ThreadStats::Snapshot total = stats.merge();
+    print_totals (total, -1);
+    std::cout << total.counter (ContainerStats::ERRORS) << " errors"
+      << std::endl;
     return 0;
     } 
   catch (const std::exception& e) 
@@ -146,4 +303,3 @@ int main(int argc, char **argv)
     return 1;
     }
   }
-
@@ -0,0 +1,531 @@
+/*
+  container_pool.hpp
+
+  ContainerPool runs a number of proton::container instances, each on a
+    thread of its own, with its own handler -- the arrangement of
+    container_per_thread.cpp -- and owns all of them: the threads, the
+    containers and the handlers. It can be grown and shrunk while it
+    runs, stopped without losing track of anything, and then started
+    again, so that a fleet of consumers can live inside a long-running
+    service rather than in a program of its own.
+
+  Each thread creates its own handler, through a factory function that
+    the pool is given, and then its own container, so that both belong
+    to the thread (and, if the pool is given a list of cores, are
+    allocated on the core that the thread is pinned to -- see
+    core_local.hpp). When the container's run() returns, the thread
+    destroys them, and the pool joins the thread.
+
+  Handlers must be derived from PoolHandler, which keeps track of the
+    handler's connection, so that the pool can ask for it to be closed
+    from another thread. Each handler has one connection, as in
+    container_per_thread.cpp. A handler that overrides
+    on_connection_open(), on_transport_close() or on_error() must call
+    PoolHandler's version.
+
+  Stopping a container is a bounded drain. First the pool asks the
+    handler to stop, on the connection's own thread; by default, that
+    closes the connection, which settles nothing that has not already
+    been settled -- messages that were prefetched, but not handled, go
+    back to the broker when the link closes. A handler can override
+    on_pool_stop() to finish its work first, so long as it closes the
+    connection in the end. The container's run() returns when its
+    connection has closed. If it hasn't returned within the drain
+    time, the pool stops the container outright.
+
+  A container can also finish on its own -- if its connection fails, say.
+    Its slot stays in the pool, counted by size() but not running, until
+    the pool is resized past it, stopped, or reaped: reap() removes the
+    containers that have finished, and releases their threads, so that
+    the pool holds only the ones that are still running, and a resize()
+    that follows starts new ones in their place.
+
+  Each handler counts its messages through its ContainerStats -- along
+    with the time it spent handling them, and how many arrived when the
+    receiver had no credit left, meaning the broker was holding more for
+    it. The counts are kept in a block of the pool's ThreadStats (see
+    thread_stats.hpp) that belongs to the container's thread, so the
+    threads never write to the same cache line. The pool adds them up,
+    along with the counts of containers that have been retired, for a
+    view of each container and of the whole; pool_autoscaler.hpp uses
+    them to decide how many containers the pool needs. thread_stats()
+    gives the ThreadStats itself, for a reporter thread, and for the
+    distribution of the handling times.
+*/
+
+#ifndef CONTAINER_POOL_HPP
+#define CONTAINER_POOL_HPP
+
+#include <proton/connection.hpp>
+#include <proton/container.hpp>
+#include <proton/error_condition.hpp>
+#include <proton/messaging_handler.hpp>
+#include <proton/transport.hpp>
+#include <proton/work_queue.hpp>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <cstring>
+
+#include "core_local.hpp"
+#include "thread_stats.hpp"
+
+/*
+ * ContainerStats are the counts for one container, in its thread's block
+ *   of the pool's ThreadStats. Only that thread changes them; any thread
+ *   can read them.
+ */
+class ContainerStats
+  {
+  friend class ContainerPool;
+
+  public:
+    // The pool's counters and histograms, as indexes in its ThreadStats
+    enum Counter { MESSAGES, ACCEPTED, REJECTED, ERRORS, BUSY_NS, DRAINED };
+    enum Histogram { HANDLE_NS };
+
+  protected:
+    // Null until the pool hands the handler its thread's block; anything
+    //   counted before then isn't kept
+    ThreadStats::Local *local;
+
+  public:
+    ContainerStats () { this->local = 0; }
+
+    /** Count a message, whether it was accepted, how long it took to
+          handle, and whether the receiver's credit was used up when it
+          arrived. */
+    void message (bool ok, long busy_ns = 0, bool drained = false)
+      {
+      if (!local) return;
+      local->add (MESSAGES);
+      local->add (ok ? ACCEPTED : REJECTED);
+      local->add (BUSY_NS, busy_ns);
+      local->record (HANDLE_NS, busy_ns);
+      if (drained) local->add (DRAINED);
+      }
+
+    void error ()
+      {
+      if (local) local->add (ERRORS);
+      }
+
+    /** This container's count so far, for counter c. */
+    long get (Counter c) const
+      {
+      return local ? local->get (c) : 0;
+      }
+  };
+
+/*
+ * PoolHandler is the base for the handlers that a ContainerPool runs.
+ */
+class PoolHandler : public proton::messaging_handler
+  {
+  friend class ContainerPool;
+
+  protected:
+    std::mutex lock; // Guards the members below
+    proton::work_queue *work_queue; // Null unless connected
+    proton::connection connection;
+    bool stopping;
+    ContainerStats counters;
+
+    /** Ask for the connection to be closed. Safe to call from any
+          thread. */
+    void request_stop ()
+      {
+      std::lock_guard<std::mutex> l (lock);
+      if (stopping) return;
+      stopping = true;
+      if (work_queue)
+        work_queue->add ([this]() { on_pool_stop (connection); });
+      }
+
+  public:
+    PoolHandler ()
+      {
+      this->work_queue = 0;
+      this->stopping = false;
+      }
+
+    /** This container's counts. */
+    ContainerStats &stats () { return counters; }
+
+    /** Called on the connection's thread when the pool stops this
+          container. Override it to finish work in hand before closing;
+          but the connection must be closed in the end. */
+    virtual void on_pool_stop (proton::connection &c)
+      {
+      c.close();
+      }
+
+    void on_connection_open (proton::connection &c) override
+      {
+      bool stop;
+        {
+        std::lock_guard<std::mutex> l (lock);
+        connection = c;
+        work_queue = &c.work_queue();
+        stop = stopping;
+        }
+      if (stop) on_pool_stop (c);
+      }
+
+    void on_transport_close (proton::transport &t) override
+      {
+      std::lock_guard<std::mutex> l (lock);
+      work_queue = 0;
+      }
+
+    void on_error (const proton::error_condition &e) override
+      {
+      counters.error();
+      std::cerr << "error: " << e.what() << std::endl;
+      }
+  };
+
+class ContainerPool
+  {
+  public:
+    /** Makes the handler for container 'index', on the container's own
+          thread. The handler can allocate from 'arena', which belongs to
+          the thread. */
+    typedef std::function<std::unique_ptr<PoolHandler> (int index,
+      CoreArena &arena)> Factory;
+
+    /** A snapshot of the counts for one container, or, from stats(),
+          the totals for the pool. */
+    struct Stats
+      {
+      int index; // -1 for the totals
+      int core; // -1 if not pinned, or for the totals
+      int containers; // Running now
+      long messages;
+      long accepted;
+      long rejected;
+      long errors;
+      long busy_ns;
+      long drained;
+      };
+
+  protected:
+    struct Slot
+      {
+      int index;
+      int core; // Guarded by the pool's lock
+      std::thread thread;
+      std::mutex lock; // Guards the members below
+      PoolHandler *handler; // Null unless running
+      proton::container *container; // Null unless running
+      bool stop_requested;
+      bool finished; // Guarded by the pool's lock, not the slot's
+      // The thread's block of counts; null until it starts. Guarded by
+      //   the pool's lock
+      ThreadStats::Local *block;
+
+      Slot (int index, int core)
+        {
+        this->index = index;
+        this->core = core;
+        this->handler = 0;
+        this->container = 0;
+        this->stop_requested = false;
+        this->finished = false;
+        this->block = 0;
+        }
+      };
+
+    Factory factory;
+    ThreadStats counts; // A block for each container's thread
+    std::vector<int> cores;
+    std::chrono::milliseconds drain;
+    std::mutex control; // Serialises resize() and stop()
+    std::mutex lock; // Guards the members below
+    std::condition_variable finished_changed;
+    std::vector<std::unique_ptr<Slot>> slots; // Oldest first
+    Stats retired; // Totals for containers that have gone
+    int next_index;
+
+    /** Add a slot's counts. Call with the lock held. */
+    static void add (Stats &to, const Slot &from)
+      {
+      ThreadStats::Local *c = from.block;
+      if (!c) return;
+      to.messages += c->get (ContainerStats::MESSAGES);
+      to.accepted += c->get (ContainerStats::ACCEPTED);
+      to.rejected += c->get (ContainerStats::REJECTED);
+      to.errors += c->get (ContainerStats::ERRORS);
+      to.busy_ns += c->get (ContainerStats::BUSY_NS);
+      to.drained += c->get (ContainerStats::DRAINED);
+      }
+
+    /** Move a slot that has finished counting into the totals, and give
+          back its block. Call with the lock held. */
+    void retire (Slot &slot)
+      {
+      add (retired, slot);
+      if (slot.block) counts.detach (*slot.block);
+      slot.block = 0;
+      }
+
+    static Stats zero (int index, int core)
+      {
+      Stats s;
+      s.index = index;
+      s.core = core;
+      s.containers = 0;
+      s.messages = s.accepted = s.rejected = s.errors = 0;
+      s.busy_ns = s.drained = 0;
+      return s;
+      }
+
+    /** The body of a container's thread. */
+    void run_slot (Slot *slot)
+      {
+      if (slot->core >= 0)
+        {
+        int err = pin_to_core (slot->core);
+        if (err)
+          {
+          std::cerr << "Can't pin container " << slot->index << " to core "
+            << slot->core << ": " << strerror (err) << std::endl;
+          std::lock_guard<std::mutex> l (lock);
+          slot->core = -1;
+          }
+        }
+      try
+        {
+        // Created here, after pinning, and destroyed here too, in the
+        //   reverse order. The block of counts is kept until the slot is
+        //   removed
+        ThreadStats::Local &local = counts.attach();
+          {
+          std::lock_guard<std::mutex> l (lock);
+          slot->block = &local;
+          }
+        CoreArena arena;
+        std::unique_ptr<PoolHandler> handler = factory (slot->index, arena);
+        handler->counters.local = &local;
+        proton::container container (*handler);
+          {
+          std::lock_guard<std::mutex> l (slot->lock);
+          slot->handler = handler.get();
+          slot->container = &container;
+          if (slot->stop_requested) handler->request_stop();
+          }
+        try
+          {
+          container.run();
+          }
+        catch (const std::exception &e)
+          {
+          std::cerr << "container::run failed: " << e.what() << std::endl;
+          }
+        std::lock_guard<std::mutex> l (slot->lock);
+        slot->handler = 0;
+        slot->container = 0;
+        }
+      catch (const std::exception &e)
+        {
+        std::cerr << "Can't start container " << slot->index << ": "
+          << e.what() << std::endl;
+        }
+      std::lock_guard<std::mutex> l (lock);
+      slot->finished = true;
+      finished_changed.notify_all();
+      }
+
+    /** Stop the slots from 'first' onwards, waiting no longer than the
+          drain time for them to finish, and then remove them. Call with
+          'control' held. */
+    void retire_from (size_t first)
+      {
+      std::vector<Slot*> victims;
+        {
+        std::lock_guard<std::mutex> l (lock);
+        for (size_t i = first; i < slots.size(); i++)
+          victims.push_back (slots[i].get());
+        }
+      for (size_t i = 0; i < victims.size(); i++)
+        {
+        std::lock_guard<std::mutex> l (victims[i]->lock);
+        victims[i]->stop_requested = true;
+        if (victims[i]->handler) victims[i]->handler->request_stop();
+        }
+
+        {
+        std::unique_lock<std::mutex> l (lock);
+        finished_changed.wait_for (l, drain, [&victims]()
+          {
+          for (size_t i = 0; i < victims.size(); i++)
+            if (!victims[i]->finished) return false;
+          return true;
+          });
+        }
+
+      // Anything still running after the drain time is stopped outright
+      for (size_t i = 0; i < victims.size(); i++)
+        {
+        std::lock_guard<std::mutex> l (victims[i]->lock);
+        if (victims[i]->container) victims[i]->container->stop();
+        }
+      for (size_t i = 0; i < victims.size(); i++)
+        victims[i]->thread.join();
+
+      std::lock_guard<std::mutex> l (lock);
+      for (size_t i = first; i < slots.size(); i++) retire (*slots[i]);
+      slots.resize (first);
+      }
+
+  public:
+    /** A pool whose handlers are made by 'factory'. If 'cores' isn't
+          empty, container i is pinned to core cores[i % cores.size()].
+          Stopping a container waits up to 'drain' for it to finish. */
+    ContainerPool (Factory factory,
+          const std::vector<int> &cores = std::vector<int>(),
+          std::chrono::milliseconds drain = std::chrono::seconds (5))
+        : counts ({ "messages", "accepted", "rejected", "errors", "busy ns",
+            "drained" }, { "handle ns" })
+      {
+      this->factory = factory;
+      this->cores = cores;
+      this->drain = drain;
+      this->retired = zero (-1, -1);
+      this->next_index = 0;
+      }
+
+    ~ContainerPool ()
+      {
+      stop();
+      }
+
+    /** Run 'n' containers: start new ones, or stop the newest. Call from
+          any thread but a container thread of this pool. */
+    void resize (int n)
+      {
+      if (n < 0) n = 0;
+      std::lock_guard<std::mutex> c (control);
+      if ((size_t)n < slots.size())
+        {
+        retire_from (n);
+        return;
+        }
+      std::lock_guard<std::mutex> l (lock);
+      while (slots.size() < (size_t)n)
+        {
+        int index = next_index++;
+        int core = cores.empty() ? -1 : cores[index % cores.size()];
+        Slot *slot = new Slot (index, core);
+        slots.emplace_back (slot);
+        slot->thread = std::thread (&ContainerPool::run_slot, this, slot);
+        }
+      }
+
+    /** Stop every container, with a bounded drain, and join the
+          threads. The pool can be started again with resize(). */
+    void stop ()
+      {
+      std::lock_guard<std::mutex> c (control);
+      retire_from (0);
+      }
+
+    /** Wait until every container has finished -- because stop() was
+          called from another thread, or because they stopped on their
+          own -- and release their threads. */
+    void join ()
+      {
+        {
+        std::unique_lock<std::mutex> l (lock);
+        finished_changed.wait (l, [this]()
+          {
+          for (size_t i = 0; i < slots.size(); i++)
+            if (!slots[i]->finished) return false;
+          return true;
+          });
+        }
+      std::lock_guard<std::mutex> c (control);
+      retire_from (0);
+      }
+
+    /** Remove the containers that have finished on their own, and
+          release their threads; their counts go into the totals. Returns
+          the number removed. Call from any thread but a container thread
+          of this pool. */
+    int reap ()
+      {
+      std::lock_guard<std::mutex> c (control);
+      std::vector<std::unique_ptr<Slot>> gone;
+        {
+        std::lock_guard<std::mutex> l (lock);
+        std::vector<std::unique_ptr<Slot>> running;
+        for (size_t i = 0; i < slots.size(); i++)
+          {
+          if (!slots[i]->finished)
+            {
+            running.push_back (std::move (slots[i]));
+            continue;
+            }
+          // Its thread has finished counting
+          retire (*slots[i]);
+          gone.push_back (std::move (slots[i]));
+          }
+        slots.swap (running);
+        }
+      // Each thread's last act is to mark itself finished, so these don't
+      //   wait long
+      for (size_t i = 0; i < gone.size(); i++)
+        gone[i]->thread.join();
+      return gone.size();
+      }
+
+    /** The number of containers, running or stopping, or finished but not
+          yet reaped. */
+    int size ()
+      {
+      std::lock_guard<std::mutex> l (lock);
+      return slots.size();
+      }
+
+    /** The counters and histograms of every container, in the blocks that
+          ContainerStats keeps them in, by the indexes in ContainerStats:
+          for a reporter thread, or for the handling times. */
+    ThreadStats &thread_stats () { return counts; }
+
+    /** The counts for each container in the pool now, oldest first. */
+    std::vector<Stats> container_stats ()
+      {
+      std::lock_guard<std::mutex> l (lock);
+      std::vector<Stats> result;
+      for (size_t i = 0; i < slots.size(); i++)
+        {
+        Stats s = zero (slots[i]->index, slots[i]->core);
+        s.containers = slots[i]->finished ? 0 : 1;
+        add (s, *slots[i]);
+        result.push_back (s);
+        }
+      return result;
+      }
+
+    /** The totals for the pool, including containers that have been
+          retired. */
+    Stats stats ()
+      {
+      std::lock_guard<std::mutex> l (lock);
+      Stats s = retired;
+      for (size_t i = 0; i < slots.size(); i++)
+        {
+        if (!slots[i]->finished) s.containers++;
+        add (s, *slots[i]);
+        }
+      return s;
+      }
+  };
+
+#endif
@@ -0,0 +1,198 @@
+/*
+  duplicate_filter.hpp
+
+  DuplicateFilter remembers the message IDs of recently-received messages,
+    so that a consumer can spot a redelivery. After a reconnect, a broker
+    will redeliver any message whose disposition it did not see, even if
+    the client had, in fact, processed it. If processing is not idempotent,
+    the client needs to be able to recognize these duplicates.
+
+  The filter uses a fixed amount of memory, set when it is constructed;
+    when it is full, the least-recently-seen IDs are forgotten. It is a
+    hash table of buckets, each exactly one cache line long, holding seven
+    64-bit hashes of message IDs. An ID is looked up by hashing it, which
+    selects a bucket, and comparing the hash with the seven in that bucket
+    -- which is one memory access, and no pointer-chasing. When a bucket is
+    full, one entry is evicted using the CLOCK algorithm: each entry has a
+    'referenced' bit, set whenever the entry is hit, and the bucket's clock
+    hand sweeps past referenced entries (clearing the bit) until it finds
+    one that is not referenced.
+
+  Only hashes are stored, not the IDs themselves, so two different IDs
+    with the same hash will be mistaken for one another. The bucket is
+    chosen from the low bits of the hash, so within a bucket only the
+    remaining bits distinguish entries. The chance of a false positive is
+    therefore tiny, but it is not zero, and the filter keeps a running
+    estimate of how many false positives it has probably reported.
+
+  A lookup costs one hash of the ID, and a scan of one cache line. For
+    numeric and UUID message IDs, nothing is allocated. String and binary
+    IDs have to be copied out of the proton::message_id first, because
+    Proton offers no way to look at them in place.
+
+  The filter is not thread-safe. Use one per receiver, on the receiver's
+    container thread.
+*/
+
+#ifndef DUPLICATE_FILTER_HPP
+#define DUPLICATE_FILTER_HPP
+
+#include <proton/message_id.hpp>
+#include <proton/types.hpp>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <functional>
+
+class DuplicateFilter
+  {
+  public:
+    static const int SLOTS = 7; // Entries per bucket
+
+    struct Stats
+      {
+      uint64_t lookups;
+      uint64_t hits; // Lookups that reported a duplicate
+      uint64_t inserts;
+      uint64_t evictions;
+      double expected_false_positives; // Estimate, included in 'hits'
+      };
+
+  protected:
+    struct alignas(64) Bucket
+      {
+      uint64_t hash[SLOTS]; // 0 means 'empty'
+      uint8_t referenced; // One bit per slot
+      uint8_t hand; // CLOCK hand: next slot to consider for eviction
+      };
+
+    std::vector<Bucket> buckets;
+    uint64_t mask;
+    double false_positive_per_entry;
+    Stats stats;
+
+    /** The splitmix64 finalizer -- a cheap way to spread the bits of a
+          hash that might be poorly distributed (e.g., a counter). */
+    static uint64_t mix (uint64_t h)
+      {
+      h ^= h >> 30; h *= 0xbf58476d1ce4e5b9ULL;
+      h ^= h >> 27; h *= 0x94d049bb133111ebULL;
+      h ^= h >> 31;
+      return h;
+      }
+
+  public:
+    /** Create a filter that can remember at least max_ids IDs. The
+          memory used is about 9.2 bytes per ID, rounded up to a power
+          of two number of buckets. */
+    DuplicateFilter (size_t max_ids)
+      {
+      size_t n = 1;
+      int bucket_bits = 0;
+      while (n * SLOTS < max_ids) { n <<= 1; bucket_bits++; }
+      buckets.resize (n);
+      mask = n - 1;
+      // Entries in the same bucket share their low bucket_bits bits, so
+      //   only the rest of the hash tells them apart
+      false_positive_per_entry = std::ldexp (1.0, bucket_bits - 64);
+      clear();
+      }
+
+    void clear ()
+      {
+      for (size_t i = 0; i < buckets.size(); i++)
+        {
+        for (int s = 0; s < SLOTS; s++) buckets[i].hash[s] = 0;
+        buckets[i].referenced = 0;
+        buckets[i].hand = 0;
+        }
+      stats = Stats();
+      }
+
+    /** Hash a message ID. The type is mixed in, so that (say) the
+          integer 1 and the string "1" are different IDs. */
+    static uint64_t hash_of (const proton::message_id &id)
+      {
+      uint64_t h;
+      switch (id.type())
+        {
+        case proton::ULONG:
+          h = proton::get<uint64_t> (id);
+          break;
+        case proton::UUID:
+          {
+          proton::uuid u = proton::get<proton::uuid> (id);
+          h = std::hash<std::string_view>()
+            (std::string_view ((const char *)u.begin(), u.size()));
+          break;
+          }
+        case proton::BINARY:
+          {
+          proton::binary b = proton::get<proton::binary> (id);
+          h = std::hash<std::string_view>()
+            (std::string_view ((const char *)b.data(), b.size()));
+          break;
+          }
+        case proton::STRING:
+          h = std::hash<std::string>() (proton::get<std::string> (id));
+          break;
+        default:
+          h = std::hash<std::string>() (proton::to_string (id));
+        }
+      return mix (h + id.type());
+      }
+
+    /** Look up a hash, and insert it if it is not present. Returns true if
+          it was present -- that is, the message is probably a duplicate. */
+    bool check_and_insert (uint64_t h)
+      {
+      if (h == 0) h = 1; // 0 marks an empty slot
+      Bucket &b = buckets[h & mask];
+      stats.lookups++;
+      int empty = -1;
+      int used = 0;
+      for (int s = 0; s < SLOTS; s++)
+        {
+        if (b.hash[s] == h)
+          {
+          b.referenced |= (1 << s);
+          stats.hits++;
+          return true;
+          }
+        if (b.hash[s] == 0) { if (empty < 0) empty = s; }
+        else used++;
+        }
+      // A miss. Any of the 'used' entries could have matched by accident
+      stats.expected_false_positives += used * false_positive_per_entry;
+      if (empty < 0)
+        {
+        while (b.referenced & (1 << b.hand))
+          {
+          b.referenced &= ~(1 << b.hand);
+          b.hand = (b.hand + 1) % SLOTS;
+          }
+        empty = b.hand;
+        b.hand = (b.hand + 1) % SLOTS;
+        stats.evictions++;
+        }
+      b.hash[empty] = h;
+      b.referenced &= ~(1 << empty);
+      stats.inserts++;
+      return false;
+      }
+
+    /** Returns true if this message ID has (probably) been seen before,
+          and records it if it has not. */
+    bool seen (const proton::message_id &id)
+      {
+      return check_and_insert (hash_of (id));
+      }
+
+    const Stats &get_stats () const { return stats; }
+
+    size_t memory_bytes () const { return buckets.size() * sizeof (Bucket); }
+  };
+
+#endif
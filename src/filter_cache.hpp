@@ -0,0 +1,159 @@
+/*
+  filter_cache.hpp
+
+  FilterCache holds ready-made proton::source_options for filter
+    expressions, such as JMS selectors, keyed by the filter's descriptor
+    and the expression. Setting a filter on a link means building a
+    filter_map holding an AMQP described value, which means running
+    proton::codec::encoder; for a program that opens thousands of
+    filtered links, or keeps re-attaching them, with the same few
+    expressions, that is work done over and over for the same result.
+    With the cache, it's done once per expression, and each link just
+    takes a copy of the finished options.
+
+  The cache holds up to a fixed number of entries, and forgets the least
+    recently used when it's full. It is thread-safe, so that the links
+    of several connections, on different container threads, can share
+    it. That is why entries are handed out as copies, made with the lock
+    held, and not shared: the filter in a source_options is held as
+    proton values, and even reading one -- which is what copying it
+    does -- moves the cursor of its data, so two threads copying the
+    same options at once would get in each other's way.
+
+  A program that opens many links with the same options can go one step
+    further, and build its proton::receiver_options once, with the
+    source options in them, and pass the same receiver_options to every
+    open_receiver() -- see bench_filter_cache.cpp. For the same reason,
+    those options should be used by one thread only.
+*/
+
+#ifndef FILTER_CACHE_HPP
+#define FILTER_CACHE_HPP
+
+#include <proton/source.hpp>
+#include <proton/source_options.hpp>
+#include <proton/symbol.hpp>
+#include <proton/value.hpp>
+#include <proton/codec/encoder.hpp>
+#include <unordered_map>
+#include <list>
+#include <mutex>
+#include <string>
+#include <cstdint>
+
+class FilterCache
+  {
+  public:
+    // The descriptor for a JMS selector, as brokers generally expect it
+    static constexpr const char *SELECTOR
+      = "apache.org:selector-filter:string";
+
+    struct Stats
+      {
+      uint64_t hits;
+      uint64_t misses; // Each one an encoding
+      uint64_t evictions;
+      };
+
+    /** Build source options that ask for one filter, the hard way. */
+    static void encode (proton::source_options &opts,
+          const std::string &name, const std::string &descriptor,
+          const std::string &expression)
+      {
+      // A filter_map is a map from an arbitrary key to a filter
+      //   expression. It has to be a map, because multiple filters can be
+      //   applied.
+      proton::source::filter_map map;
+
+      // The value stored along with the key is a filter expression as an
+      //   AMQP 'described type'. This is a primitive value annotated with
+      //   a specific descriptor, making it a kind of custom type. We need
+      //   to use proton::codec to write the described type in the
+      //   appropriate format. Although AMQP provides a way for the
+      //   attach performative to specify the filter as a described type,
+      //   AMQP says nothing about what the filter expression should
+      //   actually be. There is some loose consensus, but no specification.
+      proton::value filter_value;
+      proton::codec::encoder enc (filter_value);
+      enc << proton::codec::start::described()
+        << proton::symbol (descriptor)
+        << expression
+        << proton::codec::finish();
+
+      map.put (proton::symbol (name), filter_value);
+      opts.filters (map);
+      }
+
+  protected:
+    struct Slot
+      {
+      proton::source_options options;
+      std::list<std::string>::iterator position; // In 'order'
+      };
+
+    std::string name;
+    size_t max_entries;
+    std::mutex lock; // Guards everything below
+    std::unordered_map<std::string, Slot> slots;
+    std::list<std::string> order; // Keys, most recently used first
+    Stats stats;
+
+  public:
+    /** A cache of up to max_entries filters, each put in the filter map
+          under 'name' (which is arbitrary, as far as AMQP is concerned). */
+    explicit FilterCache (const std::string &name = "selector",
+          size_t max_entries = 10000)
+      {
+      this->name = name;
+      this->max_entries = max_entries ? max_entries : 1;
+      this->stats = Stats();
+      }
+
+    /** Source options that ask for a filter; they are built the first
+          time they are asked for. */
+    proton::source_options source_options (const std::string &expression,
+          const std::string &descriptor = SELECTOR)
+      {
+      // The descriptor is a symbol, so it can't contain a zero byte
+      std::string key = descriptor;
+      key += '\0';
+      key += expression;
+      std::lock_guard<std::mutex> l (lock);
+      std::unordered_map<std::string, Slot>::iterator i = slots.find (key);
+      if (i != slots.end())
+        {
+        stats.hits++;
+        order.splice (order.begin(), order, i->second.position);
+        // The copy is made before the lock is released
+        return i->second.options;
+        }
+      stats.misses++;
+      proton::source_options opts;
+      encode (opts, name, descriptor, expression);
+      if (slots.size() >= max_entries)
+        {
+        slots.erase (order.back());
+        order.pop_back();
+        stats.evictions++;
+        }
+      order.push_front (key);
+      Slot &slot = slots[key];
+      slot.options = opts;
+      slot.position = order.begin();
+      return opts;
+      }
+
+    size_t size ()
+      {
+      std::lock_guard<std::mutex> l (lock);
+      return slots.size();
+      }
+
+    Stats get_stats ()
+      {
+      std::lock_guard<std::mutex> l (lock);
+      return stats;
+      }
+  };
+
+#endif
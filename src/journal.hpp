@@ -0,0 +1,885 @@
+/*
+  journal.hpp
+
+  Journal is an append-only, persistent log of messages, for server.cpp.
+    It doesn't depend on Proton: it just stores, for each message, the
+    name of a queue and a block of bytes (the encoded message).
+
+  The journal is a directory of segment files, each of a fixed size
+    (unless a single message is bigger), named journal-00000001.seg and so
+    on. A segment is allocated in full when it is created, and mapped into
+    memory, so appending a record is a memcpy() -- there are no write()
+    calls, and the file never has to grow. The directory is synced as
+    soon as a segment is created, before anything is appended to it, so
+    the segment's name is on disk before any record in it can be.
+
+  A message is identified by its position in the journal: the segment
+    number in the top 32 bits, and the offset of its record in the bottom
+    32. So IDs always increase, and an ID says where to find the message.
+    When a message is consumed, an 'ack' record is appended for it. A
+    segment is deleted when all the messages in it, and in all the
+    segments before it, have been acked.
+
+  Appending doesn't make a record durable. A background thread does that,
+    by calling msync() on the part of the journal written since last time.
+    It doesn't do this after every append. Instead, when something is
+    appended, it waits for a short time (the 'group commit window') so
+    that other appends can pile up, and then syncs them all at once. An
+    application that needs to know when a message is safe -- the server
+    mustn't accept a message until then -- registers a callback with
+    wait_for(), which is called, on the sync thread, once the message is
+    on disk. A longer window means fewer syncs, and more messages per
+    sync, but a longer wait for each message.
+
+  Ack records are not waited for. If an ack is lost in a crash, the
+    message will just be delivered again, which AMQP's at-least-once
+    delivery allows.
+
+  Each record starts with a header that includes a checksum. Recovery
+    reads the segments in order, stopping at the first record whose
+    header is blank or whose checksum is wrong -- that's where the last
+    write before a crash was cut short.
+
+  Reading every record of a big journal is slow, though, and most of the
+    records are usually for messages that were consumed long ago. So each
+    segment also has an index, kept in memory as records are written: one
+    eight-byte entry per message, with its offset, its queue (as a number),
+    and whether it has been acked. Every so often (every checkpoint_bytes
+    bytes appended, and when the journal is stopped) the sync thread writes
+    a checkpoint: the index of every segment that has changed since the
+    last one, to journal-00000001.idx and so on, and then a small file,
+    'checkpoint', with the queue names and the position in the journal
+    that the indexes cover. Recovery loads the indexes, reads only the
+    records written after that position, and then reads just the messages
+    that are still live. If the checkpoint or any index is missing or
+    damaged, recovery falls back to reading everything.
+
+  All the public methods are thread-safe.
+*/
+
+#ifndef JOURNAL_HPP
+#define JOURNAL_HPP
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <algorithm>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+class Journal
+  {
+  public:
+    enum RecordType { ENQUEUE = 1, ACK = 2 };
+
+    // Called by recover() for each message that was not acked
+    typedef std::function<void (uint64_t id, const std::string &queue,
+      const char *data, size_t length)> RecoverFunc;
+
+    // What the last recover() did, for reporting
+    struct RecoveryStats
+      {
+      bool from_checkpoint; // False if every record had to be read
+      long segments;
+      uint64_t bytes_scanned; // Of records read one by one
+      long messages; // Handed back to the application
+      };
+
+  protected:
+    static const uint32_t MAGIC = 0x4a524e4c; // "JRNL"
+    static const uint32_t INDEX_MAGIC = 0x4a494458; // "JIDX"
+    static const uint32_t CHECKPOINT_MAGIC = 0x4a43504b; // "JCPK"
+
+    struct RecordHeader
+      {
+      uint32_t magic;
+      uint32_t type;
+      uint64_t id; // For ACK: the ID of the message acked
+      uint32_t length; // Bytes of payload after the header
+      uint32_t checksum; // Of the payload and the fields above
+      };
+
+    struct IndexEntry
+      {
+      uint32_t offset; // Of the message's record in the segment
+      uint16_t queue; // Position in queue_names
+      uint16_t acked;
+      };
+
+    struct IndexHeader
+      {
+      uint32_t magic;
+      uint32_t segment;
+      uint32_t used; // Bytes of the segment that the index covers
+      uint32_t count; // Entries after the header
+      uint32_t checksum; // Of the entries and the fields above
+      uint32_t pad;
+      };
+
+    struct CheckpointHeader
+      {
+      uint32_t magic;
+      uint32_t queues; // Names after the header, each a length and bytes
+      uint64_t position; // The indexes cover everything before this
+      uint32_t length; // Bytes of names
+      uint32_t checksum; // Of the names and the fields above
+      };
+
+    struct Segment
+      {
+      uint32_t number;
+      int fd;
+      char *base;
+      size_t size;
+      size_t used; // Bytes of valid records
+      long live; // Messages in this segment not yet acked
+      std::vector<IndexEntry> index; // In order of offset
+      bool index_dirty; // Changed since the last checkpoint
+      };
+
+    std::string dir;
+    size_t segment_size;
+    std::chrono::microseconds window;
+    size_t checkpoint_bytes;
+
+    std::mutex lock; // Guards everything below
+    std::map<uint32_t, Segment*> segments;
+    Segment *current;
+    uint64_t tail; // Position after the last record appended
+    uint64_t flushed; // Position up to which everything is durable
+    std::multimap<uint64_t, std::function<void()>> waiters;
+    std::condition_variable work;
+    bool running;
+    std::thread flusher;
+    std::vector<std::string> queue_names;
+    std::unordered_map<std::string, uint16_t> queue_numbers;
+    size_t since_checkpoint; // Bytes appended
+    RecoveryStats recovery;
+
+    static uint64_t position (uint32_t segment, size_t offset)
+      {
+      return ((uint64_t)segment << 32) | offset;
+      }
+
+    static size_t align8 (size_t n) { return (n + 7) & ~(size_t)7; }
+
+    /** A fast, non-cryptographic checksum, eight bytes at a time. It
+          only has to catch torn writes, not malice. */
+    static uint32_t checksum (uint64_t seed, const char *data, size_t length)
+      {
+      uint64_t sum = 0x9e3779b97f4a7c15ULL ^ seed;
+      size_t i = 0;
+      for (; i + 8 <= length; i += 8)
+        {
+        uint64_t w;
+        memcpy (&w, data + i, 8);
+        sum = (sum ^ w) * 0x100000001b3ULL;
+        sum ^= sum >> 29;
+        }
+      for (; i < length; i++)
+        sum = (sum ^ (unsigned char)data[i]) * 0x100000001b3ULL;
+      return (uint32_t)(sum ^ (sum >> 32));
+      }
+
+    static uint32_t checksum (const RecordHeader &h, const char *data,
+          size_t length)
+      {
+      return checksum (h.type ^ (h.id << 8) ^ length, data, length);
+      }
+
+    std::string file_path (uint32_t number, const char *extension)
+      {
+      char name[32];
+      snprintf (name, sizeof (name), "journal-%08u.%s", number, extension);
+      return dir + "/" + name;
+      }
+
+    std::string segment_path (uint32_t number)
+      {
+      return file_path (number, "seg");
+      }
+
+    std::string index_path (uint32_t number)
+      {
+      return file_path (number, "idx");
+      }
+
+    /** Sync the journal directory, so that files created in it, or
+          renamed into it, are there after a crash. Returns false if the
+          sync failed. */
+    bool sync_dir ()
+      {
+      int fd = open (dir.c_str(), O_RDONLY);
+      if (fd < 0) return false;
+      bool ok = fsync (fd) == 0;
+      close (fd);
+      return ok;
+      }
+
+    /** Map a segment file, creating and preallocating it if need be. */
+    Segment *map_segment (uint32_t number, size_t size, bool create)
+      {
+      std::string path = segment_path (number);
+      int fd = open (path.c_str(), O_RDWR | (create ? O_CREAT : 0), 0644);
+      if (fd < 0)
+        throw std::runtime_error ("Can't open " + path + ": "
+          + strerror (errno));
+      if (create)
+        {
+        int err = posix_fallocate (fd, 0, size);
+        if (err != 0)
+          {
+          close (fd);
+          throw std::runtime_error ("Can't allocate " + path + ": "
+            + strerror (err));
+          }
+        // Syncing the file's data doesn't make its directory entry
+        //   durable; without this, a crash could lose the whole segment,
+        //   with records in it that had been accepted
+        if (!sync_dir())
+          {
+          int saved = errno;
+          close (fd);
+          throw std::runtime_error ("Can't sync " + dir + ": "
+            + strerror (saved));
+          }
+        }
+      else
+        {
+        struct stat st;
+        fstat (fd, &st);
+        size = st.st_size;
+        }
+      void *base = mmap (0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if (base == MAP_FAILED)
+        {
+        close (fd);
+        throw std::runtime_error ("Can't map " + path + ": "
+          + strerror (errno));
+        }
+      Segment *s = new Segment;
+      s->number = number;
+      s->fd = fd;
+      s->base = (char *)base;
+      s->size = size;
+      s->used = 0;
+      s->live = 0;
+      s->index_dirty = true;
+      return s;
+      }
+
+    void unmap_segment (Segment *s)
+      {
+      munmap (s->base, s->size);
+      close (s->fd);
+      delete s;
+      }
+
+    /** Start a new segment, big enough for at least 'needed' bytes. Call
+          with the lock held. */
+    void roll (size_t needed)
+      {
+      uint32_t number = current ? current->number + 1 : 1;
+      size_t size = needed > segment_size ? needed : segment_size;
+      current = map_segment (number, size, true);
+      segments[number] = current;
+      tail = position (number, 0);
+      }
+
+    /** The number for a queue name, for the index. */
+    uint16_t queue_number (const std::string &queue)
+      {
+      std::unordered_map<std::string, uint16_t>::iterator i
+        = queue_numbers.find (queue);
+      if (i != queue_numbers.end()) return i->second;
+      if (queue_names.size() >= 0xffff)
+        throw std::runtime_error ("Too many queues in the journal");
+      uint16_t n = queue_names.size();
+      queue_names.push_back (queue);
+      queue_numbers[queue] = n;
+      return n;
+      }
+
+    /** Add a message at this offset to a segment's index. */
+    void index_message (Segment *s, size_t offset, const std::string &queue)
+      {
+      IndexEntry e;
+      e.offset = offset;
+      e.queue = queue_number (queue);
+      e.acked = 0;
+      s->index.push_back (e);
+      s->index_dirty = true;
+      s->live++;
+      }
+
+    /** Mark a message as acked in its segment's index. */
+    void index_ack (uint64_t id)
+      {
+      std::map<uint32_t, Segment*>::iterator i = segments.find (id >> 32);
+      if (i == segments.end()) return;
+      Segment *s = i->second;
+      IndexEntry key;
+      key.offset = (uint32_t)id;
+      std::vector<IndexEntry>::iterator e = std::lower_bound
+        (s->index.begin(), s->index.end(), key,
+         [](const IndexEntry &a, const IndexEntry &b)
+           { return a.offset < b.offset; });
+      if (e == s->index.end() || e->offset != key.offset || e->acked) return;
+      e->acked = 1;
+      s->index_dirty = true;
+      s->live--;
+      }
+
+    /** Write a record at the tail. Call with the lock held. Returns the
+          position of the record. */
+    uint64_t write_record (RecordType type, uint64_t id,
+          const std::string &queue,
+          const std::vector<std::string_view> &pieces)
+      {
+      size_t length = 0;
+      for (size_t i = 0; i < pieces.size(); i++)
+        length += pieces[i].size();
+      size_t payload = type == ENQUEUE ? 2 + queue.size() + length : 0;
+      size_t needed = align8 (sizeof (RecordHeader) + payload);
+      if (!current || current->used + needed > current->size)
+        roll (needed);
+      char *p = current->base + current->used;
+      RecordHeader h;
+      h.magic = MAGIC;
+      h.type = type;
+      h.length = payload;
+      if (type == ENQUEUE)
+        {
+        id = position (current->number, current->used);
+        char *body = p + sizeof (RecordHeader);
+        uint16_t qlen = queue.size();
+        memcpy (body, &qlen, 2);
+        memcpy (body + 2, queue.data(), qlen);
+        char *to = body + 2 + qlen;
+        for (size_t i = 0; i < pieces.size(); i++)
+          {
+          memcpy (to, pieces[i].data(), pieces[i].size());
+          to += pieces[i].size();
+          }
+        index_message (current, current->used, queue);
+        }
+      h.id = id;
+      h.checksum = checksum (h, p + sizeof (RecordHeader), payload);
+      memcpy (p, &h, sizeof (h));
+      current->used += needed;
+      tail = position (current->number, current->used);
+      since_checkpoint += needed;
+      work.notify_one();
+      return id;
+      }
+
+    /** Read the records of a segment from an offset onwards, adding them
+          to the indexes. Call with the lock held. */
+    void scan (Segment *s, size_t from)
+      {
+      s->used = from;
+      while (s->used + sizeof (RecordHeader) <= s->size)
+        {
+        RecordHeader h;
+        memcpy (&h, s->base + s->used, sizeof (h));
+        const char *payload = s->base + s->used + sizeof (h);
+        if (h.magic != MAGIC
+            || s->used + sizeof (h) + h.length > s->size
+            || h.checksum != checksum (h, payload, h.length))
+          break;
+        if (h.type == ENQUEUE)
+          {
+          uint16_t qlen;
+          memcpy (&qlen, payload, 2);
+          index_message (s, s->used, std::string (payload + 2, qlen));
+          }
+        else if (h.type == ACK)
+          index_ack (h.id);
+        size_t n = align8 (sizeof (h) + h.length);
+        s->used += n;
+        recovery.bytes_scanned += n;
+        }
+      }
+
+    /** Write a file under a temporary name, sync it, and rename it, so
+          that the file is either the old version or the new one. */
+    bool write_file (const std::string &path, const std::vector<char> &data)
+      {
+      std::string tmp = path + ".tmp";
+      int fd = open (tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (fd < 0) return false;
+      bool ok = write (fd, data.data(), data.size()) == (ssize_t)data.size()
+        && fsync (fd) == 0;
+      close (fd);
+      if (ok) ok = rename (tmp.c_str(), path.c_str()) == 0;
+      if (!ok) unlink (tmp.c_str());
+      return ok;
+      }
+
+    bool read_file (const std::string &path, std::vector<char> &data)
+      {
+      int fd = open (path.c_str(), O_RDONLY);
+      if (fd < 0) return false;
+      struct stat st;
+      fstat (fd, &st);
+      data.resize (st.st_size);
+      bool ok = read (fd, data.data(), data.size()) == (ssize_t)data.size();
+      close (fd);
+      return ok;
+      }
+
+    /** Write the index of every segment that has changed, and then the
+          checkpoint file. The indexes are copied with the lock held, and
+          written without it. Call on the sync thread. */
+    void write_checkpoint (std::unique_lock<std::mutex> &l)
+      {
+      std::vector<std::pair<std::string, std::vector<char>>> files;
+      for (std::map<uint32_t, Segment*>::iterator i = segments.begin();
+          i != segments.end(); ++i)
+        {
+        Segment *s = i->second;
+        if (!s->index_dirty) continue;
+        s->index_dirty = false;
+        IndexHeader h;
+        memset (&h, 0, sizeof (h));
+        h.magic = INDEX_MAGIC;
+        h.segment = s->number;
+        h.used = s->used;
+        h.count = s->index.size();
+        size_t bytes = s->index.size() * sizeof (IndexEntry);
+        h.checksum = checksum (position (h.segment, h.used) ^ h.count,
+          (const char *)s->index.data(), bytes);
+        files.push_back (std::make_pair (index_path (s->number),
+          std::vector<char> (sizeof (h) + bytes)));
+        std::vector<char> &data = files.back().second;
+        memcpy (data.data(), &h, sizeof (h));
+        memcpy (data.data() + sizeof (h), s->index.data(), bytes);
+        }
+
+      std::vector<char> names;
+      for (size_t i = 0; i < queue_names.size(); i++)
+        {
+        uint16_t n = queue_names[i].size();
+        names.insert (names.end(), (char *)&n, (char *)&n + 2);
+        names.insert (names.end(), queue_names[i].begin(),
+          queue_names[i].end());
+        }
+      CheckpointHeader h;
+      memset (&h, 0, sizeof (h));
+      h.magic = CHECKPOINT_MAGIC;
+      h.queues = queue_names.size();
+      h.position = tail;
+      h.length = names.size();
+      h.checksum = checksum (h.position ^ ((uint64_t)h.queues << 32),
+        names.data(), names.size());
+      std::vector<char> checkpoint (sizeof (h));
+      memcpy (checkpoint.data(), &h, sizeof (h));
+      checkpoint.insert (checkpoint.end(), names.begin(), names.end());
+      since_checkpoint = 0;
+      l.unlock();
+
+      // The checkpoint file must not refer to indexes that aren't on disk
+      bool ok = true;
+      for (size_t i = 0; i < files.size() && ok; i++)
+        ok = write_file (files[i].first, files[i].second);
+      if (ok) ok = write_file (dir + "/checkpoint", checkpoint);
+      if (ok)
+        {
+        sync_dir();
+        checkpoints++;
+        }
+      else
+        perror ("checkpoint");
+
+      l.lock();
+      if (!ok)
+        {
+        // Try again, with everything, next time
+        for (std::map<uint32_t, Segment*>::iterator i = segments.begin();
+            i != segments.end(); ++i)
+          i->second->index_dirty = true;
+        }
+      }
+
+    /** Load the checkpoint file and the indexes it covers. Returns the
+          position from which records must be read, or 0 if the checkpoint
+          can't be used. Call with the lock held, after the segments have
+          been mapped, and before anything has been indexed. */
+    uint64_t load_checkpoint ()
+      {
+      std::vector<char> data;
+      CheckpointHeader h;
+      if (!read_file (dir + "/checkpoint", data) || data.size() < sizeof (h))
+        return 0;
+      memcpy (&h, data.data(), sizeof (h));
+      const char *names = data.data() + sizeof (h);
+      if (h.magic != CHECKPOINT_MAGIC
+          || data.size() != sizeof (h) + h.length
+          || h.checksum != checksum (h.position ^ ((uint64_t)h.queues << 32),
+            names, h.length))
+        return 0;
+      size_t p = 0;
+      for (uint32_t i = 0; i < h.queues; i++)
+        {
+        uint16_t n;
+        memcpy (&n, names + p, 2);
+        queue_number (std::string (names + p + 2, n));
+        p += 2 + n;
+        }
+
+      uint32_t last = h.position >> 32;
+      uint32_t end = (uint32_t)h.position;
+      for (std::map<uint32_t, Segment*>::iterator i = segments.begin();
+          i != segments.end() && i->first <= last; ++i)
+        {
+        Segment *s = i->second;
+        IndexHeader ih;
+        if (!read_file (index_path (s->number), data)
+            || data.size() < sizeof (ih))
+          return 0;
+        memcpy (&ih, data.data(), sizeof (ih));
+        size_t bytes = (size_t)ih.count * sizeof (IndexEntry);
+        if (ih.magic != INDEX_MAGIC || ih.segment != s->number
+            || data.size() != sizeof (ih) + bytes
+            || ih.checksum != checksum (position (ih.segment, ih.used)
+              ^ ih.count, data.data() + sizeof (ih), bytes))
+          return 0;
+        // The index for the last segment can be newer than the checkpoint,
+        //   but not older
+        if (s->number == last ? ih.used < end : ih.used > s->size)
+          return 0;
+        s->index.resize (ih.count);
+        memcpy (s->index.data(), data.data() + sizeof (ih), bytes);
+        if (s->number == last)
+          {
+          // Anything after the checkpoint is read again from the segment
+          while (!s->index.empty() && s->index.back().offset >= end)
+            s->index.pop_back();
+          }
+        s->used = s->number == last ? end : ih.used;
+        for (size_t j = 0; j < s->index.size(); j++)
+          {
+          if (s->index[j].queue >= queue_names.size()) return 0;
+          if (!s->index[j].acked) s->live++;
+          }
+        }
+      return h.position;
+      }
+
+    /** Delete segments from the front of the journal, as long as they
+          have no live messages. The current segment is never deleted.
+          Call with the lock held. */
+    void retire_segments ()
+      {
+      while (!segments.empty())
+        {
+        Segment *s = segments.begin()->second;
+        if (s == current || s->live > 0) break;
+        if (position (s->number + 1, 0) > flushed) break; // Not synced yet
+        std::string path = segment_path (s->number);
+        segments.erase (segments.begin());
+        unlink (path.c_str());
+        unlink (index_path (s->number).c_str());
+        unmap_segment (s);
+        }
+      }
+
+    /** The sync thread: wait for something to be appended, wait for the
+          group commit window, then sync everything appended so far. */
+    void run_flusher ()
+      {
+      std::unique_lock<std::mutex> l (lock);
+      while (running)
+        {
+        if (tail == flushed)
+          {
+          work.wait (l);
+          continue;
+          }
+        l.unlock();
+        std::this_thread::sleep_for (window);
+        l.lock();
+
+        // Work out what to sync. Segments before the current one are
+        //   complete, and can be synced up to their last record
+        uint64_t target = tail;
+        std::vector<std::pair<Segment*, std::pair<size_t, size_t>>> ranges;
+        for (std::map<uint32_t, Segment*>::iterator i = segments.begin();
+            i != segments.end(); ++i)
+          {
+          Segment *s = i->second;
+          uint64_t start = position (s->number, 0);
+          uint64_t end = position (s->number, s->used);
+          if (end <= flushed) continue;
+          size_t from = flushed > start ? flushed - start : 0;
+          ranges.push_back (std::make_pair (s, std::make_pair (from,
+            s->used)));
+          }
+        l.unlock();
+
+        // Segments are only unmapped by this thread, so it's safe to
+        //   sync them without the lock
+        long page = sysconf (_SC_PAGESIZE);
+        for (size_t i = 0; i < ranges.size(); i++)
+          {
+          Segment *s = ranges[i].first;
+          size_t from = ranges[i].second.first & ~(size_t)(page - 1);
+          size_t to = ranges[i].second.second;
+          if (msync (s->base + from, to - from, MS_SYNC) != 0)
+            perror ("msync");
+          }
+        fsyncs++;
+
+        l.lock();
+        flushed = target;
+        std::vector<std::function<void()>> done;
+        while (!waiters.empty() && waiters.begin()->first < flushed)
+          {
+          done.push_back (waiters.begin()->second);
+          waiters.erase (waiters.begin());
+          }
+        retire_segments();
+        l.unlock();
+        for (size_t i = 0; i < done.size(); i++)
+          done[i]();
+        l.lock();
+        if (checkpoint_bytes > 0 && since_checkpoint >= checkpoint_bytes)
+          write_checkpoint (l);
+        }
+      }
+
+  public:
+    // Counters, for reporting
+    std::atomic<long> appends;
+    std::atomic<long> fsyncs;
+    std::atomic<long> checkpoints;
+
+    /** Open (or create) a journal in the given directory. Nothing is
+          read until recover() is called. The segment size must be less
+          than 4GB, because an ID only has 32 bits for the offset. A
+          checkpoint is written after every checkpoint_bytes appended;
+          0 means never, in which case recovery reads every record. */
+    Journal (const std::string &dir, size_t segment_size,
+          std::chrono::microseconds window,
+          size_t checkpoint_bytes = 16 * 1024 * 1024)
+      {
+      this->dir = dir;
+      this->segment_size = segment_size;
+      this->window = window;
+      this->checkpoint_bytes = checkpoint_bytes;
+      this->current = 0;
+      this->tail = this->flushed = 0;
+      this->running = false;
+      this->since_checkpoint = 0;
+      this->recovery = RecoveryStats();
+      this->appends = 0;
+      this->fsyncs = 0;
+      this->checkpoints = 0;
+      mkdir (dir.c_str(), 0755);
+      }
+
+    ~Journal ()
+      {
+      stop();
+      for (std::map<uint32_t, Segment*>::iterator i = segments.begin();
+          i != segments.end(); ++i)
+        unmap_segment (i->second);
+      }
+
+    /** Read the existing segments, and call found() for each message
+          that has not been acked, in the order they were written. Then
+          start the sync thread. Appending starts in a new segment. */
+    void recover (RecoverFunc found)
+      {
+      std::lock_guard<std::mutex> l (lock);
+      std::vector<uint32_t> numbers;
+      DIR *d = opendir (dir.c_str());
+      if (d)
+        {
+        struct dirent *e;
+        unsigned n;
+        char extension[4];
+        while ((e = readdir (d)))
+          if (sscanf (e->d_name, "journal-%08u.%3s", &n, extension) == 2
+              && strcmp (extension, "seg") == 0)
+            numbers.push_back (n);
+        closedir (d);
+        }
+      std::sort (numbers.begin(), numbers.end());
+      for (size_t i = 0; i < numbers.size(); i++)
+        {
+        Segment *s = map_segment (numbers[i], 0, false);
+        segments[s->number] = s;
+        current = s;
+        }
+      recovery = RecoveryStats();
+      recovery.segments = segments.size();
+
+      // Load the indexes, if we can, and read whatever they don't cover
+      uint64_t start = checkpoint_bytes > 0 ? load_checkpoint() : 0;
+      if (start == 0)
+        {
+        for (std::map<uint32_t, Segment*>::iterator i = segments.begin();
+            i != segments.end(); ++i)
+          {
+          i->second->index.clear();
+          i->second->live = 0;
+          }
+        queue_names.clear();
+        queue_numbers.clear();
+        }
+      recovery.from_checkpoint = start != 0;
+      for (std::map<uint32_t, Segment*>::iterator i = segments.begin();
+          i != segments.end(); ++i)
+        {
+        if (i->first < (start >> 32)) continue;
+        madvise (i->second->base, i->second->size, MADV_SEQUENTIAL);
+        scan (i->second, i->first == (start >> 32) ? (uint32_t)start : 0);
+        }
+
+      // Hand back the messages that were not acked, checking each record,
+      //   since an index can refer to a record that was never synced
+      for (std::map<uint32_t, Segment*>::iterator i = segments.begin();
+          i != segments.end(); ++i)
+        {
+        Segment *s = i->second;
+        // Without this, each page fault reads ahead, and reading one
+        //   message in a hundred reads the whole segment
+        if (recovery.from_checkpoint)
+          madvise (s->base, s->size, MADV_RANDOM);
+        for (size_t j = 0; j < s->index.size(); j++)
+          {
+          IndexEntry &e = s->index[j];
+          if (e.acked) continue;
+          RecordHeader h;
+          const char *p = s->base + e.offset + sizeof (h);
+          bool ok = e.offset + sizeof (h) <= s->used;
+          if (ok)
+            {
+            memcpy (&h, s->base + e.offset, sizeof (h));
+            ok = h.magic == MAGIC && h.type == ENQUEUE
+              && e.offset + sizeof (h) + h.length <= s->used
+              && h.checksum == checksum (h, p, h.length);
+            }
+          if (!ok)
+            {
+            e.acked = 1;
+            s->live--;
+            continue;
+            }
+          uint16_t qlen;
+          memcpy (&qlen, p, 2);
+          found (position (s->number, e.offset), queue_names[e.queue],
+            p + 2 + qlen, h.length - 2 - qlen);
+          recovery.messages++;
+          }
+        madvise (s->base, s->size, MADV_NORMAL);
+        // The index files may be missing or out of date
+        s->index_dirty = true;
+        }
+
+      // Everything already on disk is durable. New records go into a
+      //   new segment, rather than after the last one recovered
+      if (current)
+        {
+        roll (segment_size);
+        flushed = tail;
+        }
+      retire_segments();
+
+      running = true;
+      flusher = std::thread (&Journal::run_flusher, this);
+      }
+
+    /** Stop the sync thread, after a final sync and checkpoint. */
+    void stop ()
+      {
+        {
+        std::lock_guard<std::mutex> l (lock);
+        if (!running) return;
+        running = false;
+        work.notify_one();
+        }
+      flusher.join();
+      std::unique_lock<std::mutex> l (lock);
+      for (std::map<uint32_t, Segment*>::iterator i = segments.begin();
+          i != segments.end(); ++i)
+        msync (i->second->base, i->second->used, MS_SYNC);
+      flushed = tail;
+      if (checkpoint_bytes > 0) write_checkpoint (l);
+      }
+
+    /** Append a message for a queue. Returns its ID. The message is not
+          durable until a wait_for() callback says so. */
+    uint64_t append (const std::string &queue, const char *data,
+          size_t length)
+      {
+      std::lock_guard<std::mutex> l (lock);
+      appends++;
+      return write_record (ENQUEUE, 0, queue,
+        { std::string_view (data, length) });
+      }
+
+    /** As above, for a message whose bytes are in several pieces, which
+          are written one after another, as if they were one block. */
+    uint64_t append (const std::string &queue,
+          const std::vector<std::string_view> &pieces)
+      {
+      std::lock_guard<std::mutex> l (lock);
+      appends++;
+      return write_record (ENQUEUE, 0, queue, pieces);
+      }
+
+    /** Record that a message has been consumed, and will not be needed
+          again after a restart. */
+    void ack (uint64_t id)
+      {
+      std::lock_guard<std::mutex> l (lock);
+      write_record (ACK, id, "", {});
+      index_ack (id);
+      }
+
+    /** Call done(), on the sync thread, once the message with this ID (and
+          everything before it) is durable. If it already is, done() is
+          called immediately, on this thread. done() must not call back
+          into the journal. */
+    void wait_for (uint64_t id, std::function<void()> done)
+      {
+        {
+        std::lock_guard<std::mutex> l (lock);
+        if (id >= flushed)
+          {
+          waiters.insert (std::make_pair (id, done));
+          return;
+          }
+        }
+      done();
+      }
+
+    /** Every message with an ID below this is durable. */
+    uint64_t durable ()
+      {
+      std::lock_guard<std::mutex> l (lock);
+      return flushed;
+      }
+
+    const RecoveryStats &last_recovery () const { return recovery; }
+  };
+
+#endif
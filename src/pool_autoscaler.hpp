@@ -0,0 +1,215 @@
+/*
+  pool_autoscaler.hpp
+
+  PoolAutoscaler decides how many containers -- and so connections -- a
+    ContainerPool should run, from what the containers have been doing,
+    and resizes the pool to match. It is meant to be called at a regular
+    interval, from a thread that isn't one of the pool's (main(), in
+    container_per_thread.cpp).
+
+  At each call it first reaps the containers that have finished on their
+    own (see container_pool.hpp), so that everything it decides is based
+    on the containers that are still running, and one that has gone is
+    replaced if the pool is then below its minimum, or behind. Then it
+    looks at what happened since the last call, for each connection:
+
+    the arrival rate     messages per second
+    the utilisation      the fraction of the time spent handling messages
+                         (the handler measures this around its work)
+    the credit drain     the fraction of messages that arrived when the
+                         receiver had no credit left -- that is, the
+                         broker had more messages than it was allowed to
+                         send; a consumer that keeps up gets its messages
+                         with credit to spare
+
+  The consumers are falling behind if the mean utilisation, or the credit
+    drain, is above its 'high' threshold; they have capacity to spare if
+    both are below their 'low' thresholds. The pool grows to as many
+    containers as the arrival rate and handling time say are needed, at
+    the target utilisation -- but by at least one, because a pool that
+    is falling behind only sees the rate at which it consumes, not the
+    rate at which messages arrive. It shrinks one container at a time,
+    and only if the others would not then be over the 'high' threshold.
+
+  To keep the pool from flapping between sizes, the thresholds are well
+    apart, the pool has to be behind (or idle) for several calls in a
+    row before anything is done, and after each change nothing more is
+    done for a few calls, while the change takes effect.
+*/
+
+#ifndef POOL_AUTOSCALER_HPP
+#define POOL_AUTOSCALER_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "container_pool.hpp"
+
+class PoolAutoscaler
+  {
+  public:
+    struct Settings
+      {
+      int min_containers;
+      int max_containers;
+      double high_utilisation; // Behind, above this
+      double low_utilisation; // Idle, below this
+      double target_utilisation; // What to size the pool for
+      double high_drain; // Behind, above this
+      double low_drain; // Idle, below this
+      int up_after; // Calls in a row behind before growing
+      int down_after; // Calls in a row idle before shrinking
+      int cooldown; // Calls to do nothing after a change
+
+      Settings ()
+        {
+        min_containers = 1;
+        max_containers = 32;
+        high_utilisation = 0.8;
+        low_utilisation = 0.3;
+        target_utilisation = 0.6;
+        high_drain = 0.5;
+        low_drain = 0.05;
+        up_after = 2;
+        down_after = 5;
+        cooldown = 3;
+        }
+      };
+
+    /** What was seen, and done, at one call. */
+    struct Decision
+      {
+      int containers; // Before any change
+      double rate; // Messages per second, for the whole pool
+      double rate_per_connection;
+      double utilisation; // Mean, over the containers
+      double drain;
+      int needed; // By the rate and handling time
+      int resized_to; // Or -1, if the pool wasn't resized
+      std::string reason;
+      };
+
+  protected:
+    ContainerPool &pool;
+    Settings settings;
+    std::map<int, ContainerPool::Stats> previous; // By container index
+    std::chrono::steady_clock::time_point last;
+    int behind_for;
+    int idle_for;
+    int cooling;
+
+  public:
+    PoolAutoscaler (ContainerPool &pool, const Settings &settings = Settings())
+        : pool (pool)
+      {
+      this->settings = settings;
+      this->last = std::chrono::steady_clock::now();
+      this->behind_for = 0;
+      this->idle_for = 0;
+      this->cooling = 0;
+      }
+
+    /** Look at what the pool did since the last call, and resize it if
+          need be. */
+    Decision tick ()
+      {
+      std::chrono::steady_clock::time_point now
+        = std::chrono::steady_clock::now();
+      double secs = std::chrono::duration<double> (now - last).count();
+      last = now;
+
+      pool.reap();
+      std::vector<ContainerPool::Stats> stats = pool.container_stats();
+      std::map<int, ContainerPool::Stats> current;
+      long messages = 0, busy_ns = 0, drained = 0;
+      int running = 0;
+      for (size_t i = 0; i < stats.size(); i++)
+        {
+        const ContainerPool::Stats &s = stats[i];
+        current[s.index] = s;
+        if (!s.containers) continue;
+        running++;
+        std::map<int, ContainerPool::Stats>::iterator p
+          = previous.find (s.index);
+        long m = s.messages, b = s.busy_ns, d = s.drained;
+        if (p != previous.end())
+          {
+          m -= p->second.messages;
+          b -= p->second.busy_ns;
+          d -= p->second.drained;
+          }
+        messages += m;
+        busy_ns += b;
+        drained += d;
+        }
+      previous.swap (current);
+
+      Decision decision;
+      decision.containers = running;
+      decision.rate = secs > 0 ? messages / secs : 0;
+      decision.rate_per_connection = running > 0
+        ? decision.rate / running : 0;
+      decision.utilisation = secs > 0 && running > 0
+        ? busy_ns / (secs * 1e9 * running) : 0;
+      decision.drain = messages > 0 ? (double)drained / messages : 0;
+      // Containers needed to handle this rate at the target utilisation
+      double service_secs = messages > 0 ? busy_ns / 1e9 / messages : 0;
+      decision.needed = (int)std::ceil (decision.rate * service_secs
+        / settings.target_utilisation);
+      decision.resized_to = -1;
+
+      bool behind = decision.utilisation > settings.high_utilisation
+        || decision.drain > settings.high_drain;
+      bool idle = decision.utilisation < settings.low_utilisation
+        && decision.drain < settings.low_drain;
+      behind_for = behind ? behind_for + 1 : 0;
+      idle_for = idle ? idle_for + 1 : 0;
+
+      int n = running;
+      if (cooling > 0)
+        {
+        // What happens while a change takes effect doesn't count
+        cooling--;
+        behind_for = idle_for = 0;
+        decision.reason = "cooling down";
+        return decision;
+        }
+
+      int to = n;
+      if (n < settings.min_containers)
+        {
+        to = settings.min_containers;
+        decision.reason = "below the minimum";
+        }
+      else if (behind_for >= settings.up_after && n < settings.max_containers)
+        {
+        to = std::max (n + 1, decision.needed);
+        if (to > settings.max_containers) to = settings.max_containers;
+        decision.reason = "falling behind";
+        }
+      else if (idle_for >= settings.down_after
+          && n > settings.min_containers
+          // Don't leave the others overloaded
+          && decision.utilisation * n / (n - 1)
+            < settings.high_utilisation)
+        {
+        to = n - 1;
+        decision.reason = "capacity to spare";
+        }
+
+      if (to != n)
+        {
+        pool.resize (to);
+        decision.resized_to = to;
+        behind_for = idle_for = 0;
+        cooling = settings.cooldown;
+        }
+      return decision;
+      }
+  };
+
+#endif
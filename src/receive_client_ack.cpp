@@ -12,6 +12,13 @@
   proton::delivery messages to change that outcome. If a message is
   rejected, the broker will usually not send it again, and it will end
   up on a dead-letter queue (but I imagine this behaviour is configurable).
+
+  Because this client reconnects after a failure, it may be sent messages
+  again that it has already processed, if the broker never saw the 
+  disposition. A DuplicateFilter (see duplicate_filter.hpp) remembers
+  the IDs of recent messages; a repeat is accepted again, but not
+  processed again. Of course, this only works if the sender sets 
+  message IDs.
 */ 
 
 #include <proton/connection.hpp>
@@ -23,8 +30,12 @@
 #include <proton/delivery.hpp>
 
 #include <iostream>
+#include <string_view>
 #include <unistd.h>
 
+#include "body_view.hpp"
+#include "duplicate_filter.hpp"
+
 #define BOLD_ON "\x1B[1m"
 #define BOLD_OFF "\x1B[0m"
 #define LOG_FUNC std::cout << BOLD_ON << __FUNCTION__ << BOLD_OFF << std::endl;
@@ -36,11 +47,14 @@ class MyHandler : public proton::messaging_handler
     std::string url;
     std::string user;
     std::string password;
+    DuplicateFilter duplicates;
 
   public:
     MyHandler(const std::string &_url, 
-          const std::string &_user, const std::string &_password) :
-        url (_url), user (_user), password (_password)
+          const std::string &_user, const std::string &_password,
+          size_t remember_ids) :
+        url (_url), user (_user), password (_password), 
+        duplicates (remember_ids)
       { LOG_FUNC; }
 
     /** on_container_start -- create a receiver (which also creates a
@@ -64,11 +78,26 @@ class MyHandler : public proton::messaging_handler
       LOG_FUNC;
       int delivery_count = msg.delivery_count(); 
       std::cout << "Delivery count is " << delivery_count << std::endl;
+      // A message that was redelivered after a reconnect, and that we 
+      //   have already handled, is accepted again without processing. 
+      //   Messages without an ID can't be checked.
+      if (!msg.id().empty() && duplicates.seen (msg.id()))
+        {
+        const DuplicateFilter::Stats &stats = duplicates.get_stats();
+        std::cout << "Duplicate message " << msg.id() << " accepted again ("
+          << stats.hits << " duplicates in " << stats.lookups 
+          << " messages, ~" << stats.expected_false_positives 
+          << " false positives)" << std::endl;
+        dlv.accept();
+        return;
+        }
       try
          {
-         // If we can't convert the incoming message to a string, an
-         //   exception will be raised.
-         std::string s = proton::get<std::string>(msg.body());
+         // If the incoming message body is not a string, an
+         //   exception will be raised. BodyView::text() behaves like 
+         //   proton::get<std::string>, but doesn't copy the body.
+         std::string_view s = BodyView (msg).text();
+         std::cout << "Message is " << s.size() << " characters" << std::endl;
          std::cout << "Accept message from " << url << std::endl;
          dlv.accept();
          }
@@ -91,10 +120,12 @@ int main (int argc, char **argv)
   std::string address = "127.0.0.1:5672/foo";
   std::string user = "admin";
   std::string password = "admin";
+  // Number of message IDs to remember, for spotting redeliveries
+  size_t remember_ids = 100000;
 
   try 
     {
-    MyHandler connect (address, user, password);
+    MyHandler connect (address, user, password, remember_ids);
     proton::container (connect).run();
     return 0;
     } 
@@ -0,0 +1,160 @@
+/*
+  receive_demux.cpp
+
+  This example demonstrates how to serve many subscriptions, each with
+  its own JMS selector, from a single unfiltered link. It's the
+  alternative to opening a filtered link per subscription (see
+  receive_selector.cpp), which makes the broker evaluate every selector
+  for every message, and can cost it a lot of links.
+
+  Every message is fetched once, and handed to each subscription whose
+  selector it matches; a message that nobody wants is simply accepted
+  and dropped. The matching is done by a SelectorIndex (see
+  selector_index.hpp), which only evaluates the selectors that could
+  possibly match, so the cost per message stays roughly flat as the
+  number of subscriptions grows. Here a subscription just counts its
+  messages; a real application would dispatch them to whatever owns it.
+
+  Note that this is topic-like: all the messages on the address come to
+  this program, so it should be the only consumer of a queue, or the
+  address should be a topic.
+
+  Settings are in main(), at the end.
+*/
+
+#include <proton/connection.hpp>
+#include <proton/connection_options.hpp>
+#include <proton/receiver_options.hpp>
+#include <proton/container.hpp>
+#include <proton/message.hpp>
+#include <proton/messaging_handler.hpp>
+#include <proton/delivery.hpp>
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+
+#include "selector_index.hpp"
+
+/*
+ * Subscription is one logical consumer of the messages, with the
+ *   selector it registered.
+ */
+struct Subscription
+  {
+  std::string name;
+  std::string selector;
+  long received;
+  };
+
+/*
+ * DemuxHandler receives from one link, and dispatches each message to the
+ *   subscriptions that it matches.
+ */
+class DemuxHandler : public proton::messaging_handler
+  {
+  protected:
+    std::string address;
+    std::string user;
+    std::string password;
+    std::vector<Subscription> &subscriptions;
+    SelectorIndex index;
+    std::vector<Subscription*> by_id;
+    std::vector<SelectorIndex::Id> matched; // Reused for every message
+    long received;
+    long unwanted;
+    long evaluated;
+    long number_to_receive;
+
+  public:
+    DemuxHandler (const std::string &address, const std::string &user,
+          const std::string &password,
+          std::vector<Subscription> &subscriptions, long number_to_receive)
+        : subscriptions (subscriptions)
+      {
+      this->address = address;
+      this->user = user;
+      this->password = password;
+      this->number_to_receive = number_to_receive;
+      this->received = this->unwanted = this->evaluated = 0;
+      }
+
+    /** Register the subscriptions, and open the one link. */
+    void on_container_start (proton::container &c) override
+      {
+      // Throws std::runtime_error, and so stops the container, if a
+      //   selector isn't valid
+      for (size_t i = 0; i < subscriptions.size(); i++)
+        {
+        SelectorIndex::Id id = index.add (subscriptions[i].selector);
+        if (id >= by_id.size()) by_id.resize (id + 1);
+        by_id[id] = &subscriptions[i];
+        }
+      std::cout << index.size() << " subscriptions, "
+        << index.unindexed_count() << " of them not indexed" << std::endl;
+
+      proton::connection_options conn_options;
+      conn_options.user (user);
+      conn_options.password (password);
+      conn_options.sasl_allowed_mechs ("PLAIN");
+      conn_options.sasl_allow_insecure_mechs (true);
+      c.open_receiver (address, proton::receiver_options(), conn_options);
+      }
+
+    void on_message (proton::delivery &d, proton::message &m) override
+      {
+      received++;
+      evaluated += index.match (m, matched);
+      if (matched.empty()) unwanted++;
+      for (size_t i = 0; i < matched.size(); i++)
+        by_id[matched[i]]->received++;
+      if (received == number_to_receive)
+        {
+        report();
+        d.connection().close();
+        }
+      }
+
+    void report ()
+      {
+      std::cout << "Received " << received << " messages; " << unwanted
+        << " matched no subscription" << std::endl;
+      std::cout << "Selectors evaluated per message: " << std::fixed
+        << std::setprecision (1) << (double)evaluated / received
+        << " of " << index.size() << std::endl;
+      for (size_t i = 0; i < subscriptions.size(); i++)
+        std::cout << std::setw (8) << subscriptions[i].received << "  "
+          << subscriptions[i].name << ": " << subscriptions[i].selector
+          << std::endl;
+      }
+  };
+
+int main (int argc, char **argv)
+  {
+  try
+    {
+    std::string address = "127.0.0.1:5672/foo";
+    std::string user = "admin";
+    std::string password = "admin";
+    long number_to_receive = 1000;
+    std::vector<Subscription> subscriptions =
+      {
+      { "bar", "foo = 'bar'", 0 },
+      { "eu-big", "region = 'eu' AND price > 100", 0 },
+      { "americas", "region IN ('us', 'latam')", 0 },
+      { "urgent", "urgent", 0 },
+      { "high-priority", "JMSPriority > 6", 0 } // Can't be indexed
+      };
+
+    DemuxHandler h (address, user, password, subscriptions,
+      number_to_receive);
+    proton::container container (h);
+    container.run();
+    }
+  catch (const std::exception& e)
+    {
+    std::cerr << e.what() << std::endl;
+    return 1;
+    }
+  return 0;
+  }
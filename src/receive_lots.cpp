@@ -7,6 +7,14 @@
 
   This program also demonstrates how to iterate properties and annotations.
 
+  Printing every message makes this program far too slow to say anything
+    about how fast a broker can deliver messages. Setting 'benchmark' to
+    true in main() switches to a measurement mode, in which on_message()
+    only counts. Once a second it prints the message and byte rates (the
+    bytes being those of the message bodies), the inter-arrival jitter,
+    and the time spent in on_message(), and when the program exits it
+    writes the whole time series, and a summary, to a JSON file.
+
   Broker settings are in main(), at the end.
 */ 
 
@@ -23,12 +31,203 @@
 #include <proton/tracker.hpp>
 #include <proton/types.hpp>
 #include <iostream>
+#include <fstream>
+#include <chrono>
+#include <cmath>
+#include <vector>
+
+#include "body_view.hpp"
 
 #define BOLD_ON "\x1B[1m"
 #define BOLD_OFF "\x1B[0m"
 
 #define LOG_FUNC std::cout << BOLD_ON << __FUNCTION__ << BOLD_OFF << std::endl;
 
+typedef std::chrono::steady_clock Clock;
+
+/*
+ * DrainStats accumulates the measurements made in benchmark mode. 
+ *   Everything is kept per one-second interval; a completed interval is
+ *   printed and appended to the time series, and also folded into the
+ *   totals for the final summary. Inter-arrival jitter is reported as the
+ *   standard deviation of the gaps between messages, computed with
+ *   Welford's method so no per-message data has to be stored.
+ */
+class DrainStats
+  {
+  protected:
+    struct Interval
+      {
+      double start; // Seconds since the first message
+      long msgs;
+      long bytes;
+      long gaps; // Number of inter-arrival gaps measured
+      double gap_mean_us;
+      double gap_m2; // Sum of squared deviations, for the std deviation
+      double callback_total_us;
+      double callback_max_us;
+      };
+
+    // Callback times are also binned into power-of-two buckets of
+    //   nanoseconds, so we can estimate percentiles in the summary
+    static const int BUCKETS = 48;
+    long callback_hist[BUCKETS];
+
+    std::vector<Interval> series;
+    Interval current;
+    Interval total;
+    Clock::time_point first;
+    Clock::time_point last;
+    bool started;
+
+    static void reset (Interval &i, double start)
+      {
+      i.start = start;
+      i.msgs = i.bytes = i.gaps = 0;
+      i.gap_mean_us = i.gap_m2 = 0;
+      i.callback_total_us = i.callback_max_us = 0;
+      }
+
+    static void add_gap (Interval &i, double gap_us)
+      {
+      i.gaps++;
+      double delta = gap_us - i.gap_mean_us;
+      i.gap_mean_us += delta / i.gaps;
+      i.gap_m2 += delta * (gap_us - i.gap_mean_us);
+      }
+
+    static double jitter_us (const Interval &i)
+      {
+      return i.gaps > 1 ? std::sqrt (i.gap_m2 / (i.gaps - 1)) : 0;
+      }
+
+    static double elapsed (Clock::time_point from, Clock::time_point to)
+      {
+      return std::chrono::duration<double> (to - from).count();
+      }
+
+    /** Close intervals, up to the one that contains 'now'. Intervals in 
+          which nothing arrived are still recorded, with zero counts. */
+    void roll (Clock::time_point now)
+      {
+      double t = elapsed (first, now);
+      while (t >= current.start + 1.0)
+        {
+        series.push_back (current);
+        print_interval (current);
+        reset (current, current.start + 1.0);
+        }
+      }
+
+    void print_interval (const Interval &i)
+      {
+      std::cout << "t=" << i.start << "s msgs/s=" << i.msgs 
+         << " bytes/s=" << i.bytes 
+         << " jitter_us=" << jitter_us (i)
+         << " callback_us=" << (i.msgs ? i.callback_total_us / i.msgs : 0)
+         << std::endl;
+      }
+
+    double callback_percentile_us (double p)
+      {
+      long target = (long)std::ceil (p * total.msgs);
+      long seen = 0;
+      for (int b = 0; b < BUCKETS; b++)
+        {
+        seen += callback_hist[b];
+        if (seen >= target && seen > 0) return (1L << b) / 1000.0;
+        }
+      return 0;
+      }
+
+  public:
+    DrainStats ()
+      {
+      started = false;
+      reset (current, 0);
+      reset (total, 0);
+      for (int b = 0; b < BUCKETS; b++) callback_hist[b] = 0;
+      }
+
+    /** Record the arrival of a message of 'bytes' bytes. */
+    void arrived (Clock::time_point now, size_t bytes)
+      {
+      if (!started)
+        {
+        started = true;
+        first = last = now;
+        }
+      else
+        {
+        roll (now);
+        double gap_us = elapsed (last, now) * 1e6;
+        add_gap (current, gap_us);
+        add_gap (total, gap_us);
+        last = now;
+        }
+      current.msgs++;
+      total.msgs++;
+      current.bytes += bytes;
+      total.bytes += bytes;
+      }
+
+    /** Record the time taken by one call to on_message(). */
+    void callback_done (Clock::time_point start, Clock::time_point end)
+      {
+      long ns = std::chrono::duration_cast<std::chrono::nanoseconds>
+        (end - start).count();
+      double us = ns / 1000.0;
+      current.callback_total_us += us;
+      total.callback_total_us += us;
+      if (us > current.callback_max_us) current.callback_max_us = us;
+      if (us > total.callback_max_us) total.callback_max_us = us;
+      int b = 0;
+      while (b < BUCKETS - 1 && (1L << b) < ns) b++;
+      callback_hist[b]++;
+      }
+
+    /** Called from a timer, so that intervals are printed even when 
+          no messages are arriving. */
+    void tick () { if (started) roll (Clock::now()); }
+
+    /** Write the time series and summary as JSON. Any partly-complete
+          interval is included in the series. */
+    void write_json (const std::string &filename)
+      {
+      if (started && current.msgs > 0) series.push_back (current);
+      double secs = started ? elapsed (first, last) : 0;
+      std::ofstream out (filename);
+      out << "{\n  \"series\": [\n";
+      for (size_t n = 0; n < series.size(); n++)
+        {
+        const Interval &i = series[n];
+        out << "    {\"t\": " << i.start << ", \"msgs\": " << i.msgs
+           << ", \"bytes\": " << i.bytes 
+           << ", \"jitter_us\": " << jitter_us (i)
+           << ", \"callback_mean_us\": " 
+           << (i.msgs ? i.callback_total_us / i.msgs : 0)
+           << ", \"callback_max_us\": " << i.callback_max_us << "}"
+           << (n + 1 < series.size() ? "," : "") << "\n";
+        }
+      out << "  ],\n  \"summary\": {\"msgs\": " << total.msgs
+         << ", \"bytes\": " << total.bytes
+         << ", \"seconds\": " << secs
+         << ", \"msgs_per_sec\": " << (secs > 0 ? total.msgs / secs : 0)
+         << ", \"bytes_per_sec\": " << (secs > 0 ? total.bytes / secs : 0)
+         << ", \"gap_mean_us\": " << total.gap_mean_us
+         << ", \"jitter_us\": " << jitter_us (total)
+         << ", \"callback_mean_us\": " 
+         << (total.msgs ? total.callback_total_us / total.msgs : 0)
+         << ", \"callback_p50_us\": " << callback_percentile_us (0.5)
+         << ", \"callback_p99_us\": " << callback_percentile_us (0.99)
+         << ", \"callback_max_us\": " << total.callback_max_us
+         << "}\n}\n";
+      std::cout << "Received " << total.msgs << " messages, " << total.bytes
+         << " bytes in " << secs << "s; statistics written to " 
+         << filename << std::endl;
+      }
+  };
+
 /* 
  * LoggingHandler is a subclass of proton::messaging_handler
  */
@@ -41,11 +240,12 @@ class LoggingHandler : public proton::messaging_handler
     int received;
     int number_to_receive;
     bool closed;
+    DrainStats *stats; // Non-null in benchmark mode
 
   public:
     LoggingHandler (const std::string &address, 
             const std::string &user,  const std::string &password, 
-            int number_to_receive)
+            int number_to_receive, DrainStats *stats = 0)
       {
       this->number_to_receive = number_to_receive;
       this->received = 0;
@@ -53,6 +253,7 @@ class LoggingHandler : public proton::messaging_handler
       this->address = address;
       this->user = user;
       this->password = password;
+      this->stats = stats;
       }
   protected:
     // Note: in principle, we should invoke the base class method in
@@ -95,6 +296,13 @@ class LoggingHandler : public proton::messaging_handler
       //   called in groups of 3. All this is only visible if we look at
       //   the wire protocol.
       recv_options.credit_window (0x3);
+      // ... but when measuring, we don't want the broker to be waiting
+      //   for credit all the time
+      if (stats)
+        {
+        recv_options.credit_window (1000);
+        schedule_tick (c);
+        }
       proton::connection_options conn_options;
       conn_options.user (user);
       conn_options.password (password);
@@ -111,9 +319,46 @@ class LoggingHandler : public proton::messaging_handler
       // If an exception is thrown here, the container will stop
       }
 
+    /** In benchmark mode, print the rates every second until the 
+          connection is closed. */
+    void schedule_tick (proton::container &c)
+      {
+      c.schedule (proton::duration::SECOND, [this, &c]() 
+        { 
+        if (closed) return;
+        stats->tick();
+        schedule_tick (c);
+        });
+      }
+
+    /** on_message_benchmark is what on_message does in benchmark mode:
+          count the message, and nothing else. */
+    void on_message_benchmark (proton::delivery &d, proton::message &m)
+      {
+      Clock::time_point start = Clock::now();
+      // The size of the body, read in place. Re-encoding the message
+      //   would give the size on the wire more nearly, but would cost
+      //   more than everything else here put together. Bodies that
+      //   can't be read in place (maps, numbers...) count as no bytes.
+      BodyView body (m);
+      stats->arrived (start, body.viewable() ? body.size() : 0);
+      received++;
+      if (received == number_to_receive)
+        {
+        closed = true;
+        d.connection().close();
+        }
+      stats->callback_done (start, Clock::now());
+      }
+
     /** on_message is called each time a new message is received. */
     void on_message (proton::delivery &d, proton::message &m) override 
       {
+      if (stats) 
+        {
+        on_message_benchmark (d, m);
+        return;
+        }
       LOG_FUNC;
       received++;
       std::cout << "Received: " << m.body() << std::endl;
@@ -160,10 +405,16 @@ int main(int argc, char **argv)
     std::string user = "admin";
     std::string password = "admin";
     int count = 10;
+    // Set benchmark to true to measure, rather than print, messages
+    bool benchmark = false;
+    std::string stats_file = "receive_lots_stats.json";
 
-    LoggingHandler h (address, user, password, count);
+    DrainStats stats;
+    LoggingHandler h (address, user, password, count, 
+      benchmark ? &stats : 0);
     proton::container container (h);
     container.run();
+    if (benchmark) stats.write_json (stats_file);
     } 
   catch (const std::exception& e) 
     {
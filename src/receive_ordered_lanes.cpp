@@ -0,0 +1,502 @@
+/*
+  receive_ordered_lanes.cpp
+
+  A receiver that processes messages in parallel, but without losing the
+    ordering of messages that belong to the same entity (customer, order,
+    device...). It starts from the same on_message() plumbing as
+    receive_lots.cpp, but on_message() does no processing itself: it just
+    hashes a key taken from the message, and hands the message to one of
+    a fixed number of 'lanes'. Each lane is a single worker thread fed by
+    a lock-free, single-producer, single-consumer ring buffer. Because all
+    messages with the same key go to the same lane, and each lane is
+    handled by only one thread, they are processed in the order they
+    arrived. Messages with different keys are processed concurrently.
+
+  The key is either the AMQP group-id (the default), or the value of some
+    application property -- see the settings in main().
+
+  Proton objects like proton::delivery must only be touched on the
+    container thread that owns the connection. So the worker threads never
+    see the delivery itself: on_message() stores it in a table, keyed by a
+    sequence number, and the worker reports the outcome for that sequence
+    number back on a second ring. The container thread is woken through
+    the connection's work_queue, and does the accept() or reject().
+
+  Link credit is issued manually, as deliveries are settled, rather than
+    using Proton's credit window. It is controlled by a ByteBudget (see
+    byte_budget.hpp), which only grants credit while the bytes waiting in
+    the lanes, plus the expected size of the messages already granted
+    credit, are under a limit. Message-count credit can't do this: a
+    window that suits small messages will exhaust memory when large ones
+    arrive. The budget also caps the number of messages in flight, which
+    in turn means that a lane ring should never overflow -- the container
+    thread must never block waiting for a worker. If a ring is full all
+    the same, the delivery is released, for the broker to send again.
+
+  Before the connection is closed -- or when the broker closes it -- the
+    lanes are stopped: each finishes the jobs already in its ring, the
+    outcomes are applied, and only then does the connection go. A lane
+    never wakes a connection that has gone.
+
+  Broker settings are in main(), at the end.
+*/
+
+#include <unistd.h>
+#include <proton/connection.hpp>
+#include <proton/connection_options.hpp>
+#include <proton/receiver_options.hpp>
+#include <proton/container.hpp>
+#include <proton/message.hpp>
+#include <proton/messaging_handler.hpp>
+#include <proton/delivery.hpp>
+#include <proton/work_queue.hpp>
+#include <proton/types.hpp>
+#include <iostream>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include <mutex>
+
+#include "byte_budget.hpp"
+
+#define BOLD_ON "\x1B[1m"
+#define BOLD_OFF "\x1B[0m"
+
+#define LOG_FUNC std::cout << BOLD_ON << __FUNCTION__ << BOLD_OFF << std::endl;
+
+// Assumed size of a cache line. Indices that are written by different
+//   threads are kept on different lines, so they don't bounce between cores
+#define CACHE_LINE 64
+
+/*
+ * SpscRing is a fixed-size, lock-free queue with exactly one producer
+ *   thread and exactly one consumer thread. The producer only ever writes
+ *   'tail', and the consumer only ever writes 'head', so no compare-and-swap
+ *   is needed -- just acquire/release ordering on the two indices. Each
+ *   side also keeps a private copy of the other side's index, and only
+ *   re-reads the shared one when the ring looks full (or empty).
+ */
+template <class T> class SpscRing
+  {
+  private:
+    std::vector<T> slots;
+    size_t mask;
+    alignas(CACHE_LINE) std::atomic<size_t> head; // Written by consumer
+    size_t cached_tail; // Consumer's view of tail
+    alignas(CACHE_LINE) std::atomic<size_t> tail; // Written by producer
+    size_t cached_head; // Producer's view of head
+
+  public:
+    /** The capacity is rounded up to a power of two, so that we can
+          use a mask rather than a division to find a slot. */
+    SpscRing (size_t capacity) : head (0), cached_tail (0),
+        tail (0), cached_head (0)
+      {
+      size_t size = 1;
+      while (size < capacity) size <<= 1;
+      slots.resize (size);
+      mask = size - 1;
+      }
+
+    /** push() returns false if the ring is full. Call only from the
+          producer thread. */
+    bool push (T &&item)
+      {
+      size_t t = tail.load (std::memory_order_relaxed);
+      if (t - cached_head == slots.size())
+        {
+        cached_head = head.load (std::memory_order_acquire);
+        if (t - cached_head == slots.size()) return false;
+        }
+      slots[t & mask] = std::move (item);
+      tail.store (t + 1, std::memory_order_release);
+      return true;
+      }
+
+    /** pop() returns false if the ring is empty. Call only from the
+          consumer thread. */
+    bool pop (T &item)
+      {
+      size_t h = head.load (std::memory_order_relaxed);
+      if (h == cached_tail)
+        {
+        cached_tail = tail.load (std::memory_order_acquire);
+        if (h == cached_tail) return false;
+        }
+      item = std::move (slots[h & mask]);
+      head.store (h + 1, std::memory_order_release);
+      return true;
+      }
+  };
+
+/* A unit of work passed from the container thread to a lane. */
+struct LaneJob
+  {
+  uint64_t seq;
+  size_t bytes;
+  proton::message msg;
+  };
+
+/* The outcome of a LaneJob, passed back to the container thread. */
+struct LaneResult
+  {
+  uint64_t seq;
+  size_t bytes;
+  bool ok;
+  };
+
+/** handle_message() is the application's processing step. It runs on a
+    lane thread, so it must not touch any Proton endpoint (connection,
+    link, delivery). The message itself belongs to the lane by this
+    point, so reading it is safe. Return true to accept, false to reject. */
+bool handle_message (int lane, const proton::message &m)
+  {
+  std::cout << "lane " << lane << " group " << m.group_id()
+     << ": " << m.body() << std::endl;
+  return true;
+  }
+
+/*
+ * Lane is a single worker thread with an inbound ring of jobs and an
+ *   outbound ring of results. The container thread is the only producer
+ *   of jobs and the only consumer of results, and the worker is the only
+ *   consumer of jobs and producer of results, so both rings are SPSC.
+ */
+class Lane
+  {
+  public:
+    SpscRing<LaneJob> jobs;
+    SpscRing<LaneResult> results;
+
+  private:
+    int number;
+    std::atomic<bool> running;
+    std::function<void()> notify; // Wakes the container thread
+    std::thread thread;
+
+    /** The worker loop. When there is nothing to do, spin briefly, then
+          yield, then sleep -- a lane that's busy reacts quickly, and an
+          idle one doesn't burn a core. When the lane is stopped, it
+          finishes the jobs in its ring before it exits. */
+    void run ()
+      {
+      LaneJob job;
+      int idle = 0;
+      while (true)
+        {
+        if (!jobs.pop (job))
+          {
+          if (!running.load (std::memory_order_acquire)) break;
+          if (++idle < 100) continue;
+          if (idle < 200) { std::this_thread::yield(); continue; }
+          usleep (100);
+          continue;
+          }
+        idle = 0;
+        bool ok = handle_message (number, job.msg);
+        // The results ring is as big as the jobs ring, and the budget
+        //   keeps the number in flight below that, so it shouldn't be
+        //   full; if it is, wait for the container thread to empty it
+        LaneResult result { job.seq, job.bytes, ok };
+        while (!results.push (std::move (result)))
+          {
+          notify();
+          usleep (100);
+          }
+        notify();
+        }
+      }
+
+  public:
+    Lane (int number, size_t capacity, std::function<void()> notify) :
+        jobs (capacity), results (capacity), number (number),
+        running (true), notify (notify)
+      {
+      thread = std::thread (&Lane::run, this);
+      }
+
+    /** Finish the jobs in the ring, and stop the worker. */
+    void stop ()
+      {
+      running.store (false, std::memory_order_release);
+      if (thread.joinable()) thread.join();
+      }
+
+    ~Lane ()
+      {
+      stop();
+      }
+  };
+
+/*
+ * OrderedDispatcher owns the lanes, and the table of deliveries that are
+ *   waiting for their outcome. All its methods except wake() must be
+ *   called on the container thread that owns the receiver. Once the
+ *   lanes are stopped, they can't be started again.
+ */
+class OrderedDispatcher
+  {
+  protected:
+    std::vector<Lane*> lanes;
+    std::unordered_map<uint64_t, proton::delivery> pending;
+    std::string key_property; // Empty means 'use the group-id'
+    std::mutex work_queue_lock; // Lanes use work_queue; guard it
+    proton::work_queue *work_queue; // Null once the lanes are stopped
+    std::atomic<bool> wake_pending;
+    uint64_t next_seq;
+    bool stopped;
+
+  public:
+    OrderedDispatcher (int num_lanes, size_t max_in_flight,
+          const std::string &key_property)
+      {
+      this->key_property = key_property;
+      this->work_queue = 0;
+      this->wake_pending = false;
+      this->next_seq = 0;
+      this->stopped = false;
+      for (int i = 0; i < num_lanes; i++)
+        lanes.push_back (new Lane (i, max_in_flight, [this]() { wake(); }));
+      }
+
+    ~OrderedDispatcher ()
+      {
+      for (size_t i = 0; i < lanes.size(); i++)
+        delete lanes[i];
+      }
+
+    /** Settlements are reported via the work_queue of the connection
+          that owns the receiver. */
+    void set_work_queue (proton::work_queue &wq)
+      {
+      std::lock_guard<std::mutex> l (work_queue_lock);
+      work_queue = &wq;
+      }
+
+    /** Let every lane finish the jobs it has, apply their outcomes, and
+          stop the lanes, so that none of them touches the connection
+          afterwards. */
+    void stop_lanes ()
+      {
+      if (stopped) return;
+      stopped = true;
+      for (size_t i = 0; i < lanes.size(); i++)
+        lanes[i]->stop();
+      std::unique_lock<std::mutex> l (work_queue_lock);
+      work_queue = 0;
+      l.unlock();
+      collect();
+      }
+
+    /** Extract the ordering key from the message. */
+    std::string key_of (proton::message &m)
+      {
+      if (key_property.empty()) return m.group_id();
+      proton::message::property_map &props = m.properties();
+      if (!props.exists (key_property)) return "";
+      return proton::to_string (props.get (key_property));
+      }
+
+    /** Hand a message to its lane. Messages without a key have no
+          ordering constraint, so they are spread across all lanes.
+          Returns false if the lane can't take it (its ring is full, or
+          the lanes are stopped); the caller still has the delivery. */
+    bool dispatch (proton::delivery &d, proton::message &m, size_t bytes)
+      {
+      if (stopped) return false;
+      uint64_t seq = next_seq++;
+      std::string key = key_of (m);
+      size_t lane = key.empty() ? seq % lanes.size()
+        : std::hash<std::string>()(key) % lanes.size();
+      // Proton decodes a fresh message for each delivery, so we can take
+      //   ownership of this one rather than copying it.
+      LaneJob job { seq, bytes, std::move (m) };
+      if (!lanes[lane]->jobs.push (std::move (job)))
+        {
+        m = std::move (job.msg);
+        return false;
+        }
+      pending[seq] = d;
+      return true;
+      }
+
+    /** Called on a lane thread. Schedules collect() on the container
+          thread, unless a call is already scheduled and not yet run. */
+    void wake ()
+      {
+      std::lock_guard<std::mutex> l (work_queue_lock);
+      if (work_queue && !wake_pending.exchange (true))
+        work_queue->add ([this]() { wake_pending = false; collect(); });
+      }
+
+    /** Apply the outcomes reported by the lanes, and return the number of
+          deliveries that were settled. */
+    int collect ()
+      {
+      int settled = 0;
+      uint64_t bytes = 0;
+      LaneResult r;
+      for (size_t i = 0; i < lanes.size(); i++)
+        {
+        while (lanes[i]->results.pop (r))
+          {
+          std::unordered_map<uint64_t, proton::delivery>::iterator it
+            = pending.find (r.seq);
+          // The delivery has gone if the connection has closed
+          if (it == pending.end()) continue;
+          if (r.ok)
+            it->second.accept();
+          else
+            it->second.reject();
+          pending.erase (it);
+          settled++;
+          bytes += r.bytes;
+          }
+        }
+      if (settled > 0) on_settled (settled, bytes);
+      return settled;
+      }
+
+    /** Subclasses hook this to issue credit as deliveries are settled. */
+    virtual void on_settled (int count, uint64_t bytes) { }
+  };
+
+/*
+ * OrderedReceiveHandler is a subclass of proton::messaging_handler, which
+ *   also acts as the dispatcher for the one receiver it opens.
+ */
+class OrderedReceiveHandler : public proton::messaging_handler,
+     public OrderedDispatcher
+  {
+  protected:
+    std::string address;
+    std::string user;
+    std::string password;
+    ByteBudget budget;
+    int settled;
+    int number_to_receive;
+    proton::receiver receiver;
+
+  public:
+    OrderedReceiveHandler (const std::string &address,
+            const std::string &user,  const std::string &password,
+            int number_to_receive, int num_lanes, uint64_t budget_bytes,
+            int max_in_flight, const std::string &key_property) :
+        OrderedDispatcher (num_lanes, max_in_flight, key_property),
+        budget (budget_bytes, 1024, max_in_flight)
+      {
+      this->number_to_receive = number_to_receive;
+      this->settled = 0;
+      this->address = address;
+      this->user = user;
+      this->password = password;
+      }
+
+  protected:
+    void on_receiver_close (proton::receiver &c) override { LOG_FUNC; }
+
+    /** Deliveries that never got an outcome die with the connection --
+          the broker will redeliver them. The lanes are stopped first, so
+          none of them is still working on one. */
+    void on_connection_close (proton::connection &c) override
+      {
+      LOG_FUNC;
+      stop_lanes();
+      pending.clear();
+      }
+
+    /** on_container_start: create a receiver with no automatic credit,
+          and no automatic acceptance. */
+    void on_container_start (proton::container &c) override
+      {
+      LOG_FUNC;
+      proton::receiver_options recv_options;
+      recv_options.credit_window (0);
+      recv_options.auto_accept (false);
+      proton::connection_options conn_options;
+      conn_options.user (user);
+      conn_options.password (password);
+      conn_options.sasl_allowed_mechs ("PLAIN");
+      // Need to allow insecure authentication if we will be sending
+      //   credentials over a non-TLS connection.
+      conn_options.sasl_allow_insecure_mechs (true);
+      c.open_receiver (address, recv_options, conn_options);
+      }
+
+    /** When the link is up, store the work_queue that the lanes will use
+          to report back, and issue the initial credit. */
+    void on_receiver_open (proton::receiver &r) override
+      {
+      LOG_FUNC;
+      receiver = r;
+      set_work_queue (r.connection().work_queue());
+      budget.top_up (r);
+      }
+
+    /** on_message just hands the delivery off -- no processing is
+          done on the container thread. */
+    void on_message (proton::delivery &d, proton::message &m) override
+      {
+      size_t bytes = ByteBudget::message_bytes (m);
+      budget.received (bytes);
+      if (dispatch (d, m, bytes)) return;
+      // No room in the lane: let the broker send it again later
+      d.release();
+      budget.processed (bytes, 1);
+      }
+
+    /** Settled messages no longer count against the budget, so there may
+          now be room for more credit. */
+    void on_settled (int count, uint64_t bytes) override
+      {
+      budget.processed (bytes, count);
+      settled += count;
+      // Once the lanes are stopped, we're closing: no more credit
+      if (stopped) return;
+      if (settled >= number_to_receive)
+        {
+        // Settle whatever the lanes are still working on, then close.
+        //   This will only shut down the container if there is only one
+        //   active connection (as there is in this example)
+        stop_lanes();
+        receiver.connection().close();
+        return;
+        }
+      budget.top_up (receiver);
+      }
+  };
+
+int main(int argc, char **argv)
+  {
+  try
+    {
+    std::string address = "127.0.0.1:5672/foo";
+    std::string user = "admin";
+    std::string password = "admin";
+    int count = 1000;
+    // Number of lanes (worker threads)
+    int lanes = 4;
+    // Limit on the bytes of messages that are prefetched, or waiting in
+    //   lanes. Credit is only issued while we're under this limit.
+    uint64_t budget_bytes = 64 * 1024 * 1024;
+    // Limit on the number of unsettled messages. Also the size of each ring.
+    int max_in_flight = 4096;
+    // Name of an application property to use as the ordering key. Leave
+    //   empty to order by the AMQP group-id
+    std::string key_property = "";
+
+    OrderedReceiveHandler h (address, user, password, count, lanes,
+      budget_bytes, max_in_flight, key_property);
+    proton::container container (h);
+    container.run();
+    }
+  catch (const std::exception& e)
+    {
+    std::cerr << e.what() << std::endl;
+    }
+
+  return 0;
+  }
+
@@ -16,6 +16,58 @@
   leave the problem of deciding what to do with the messages we aren't going
   to process. A filter is applied at the broker (hence 'source') before any
   messages are actually sent.
+
+  Not every broker supports filters, and one that doesn't will usually
+  just ignore the filter, rather than refuse the link. A broker that has
+  applied a filter says so by sending it back in the source of its own
+  attach; if it isn't there, this example applies the selector itself,
+  using a CompiledSelector (see selector.hpp), and accepts and discards
+  the messages that don't match. That's only what we want if nobody else
+  should get those messages -- if we are the only consumer, or if the
+  address is a topic. Set filter_locally in main() to skip the broker
+  altogether.
+
+  On a fast stream, filtering locally can instead be done a batch at a
+  time (set batch_size in main()): messages are held until there are
+  batch_size of them, or batch_ms has passed since the first, and then
+  a BatchSelector (see selector_batch.hpp) evaluates the selector for
+  all of them together, with SIMD instructions where it can. Only the
+  messages that match are passed on. Bear in mind that messages are
+  accepted as they arrive, so the ones in a batch that hasn't been
+  processed when the program stops are lost.
+
+  The selector can be changed while the program runs, with
+  change_selector(), without reconnecting. AMQP has no way to change the
+  filter of a link that is already attached, so this is make-before-
+  break: a new link, with the new filter, is attached on the same
+  session; once the broker has confirmed it, the old link is drained --
+  the broker sends what it can against the old link's credit, and
+  returns the rest -- and only then detached. So there's no moment with
+  no link at all, and nothing is left in flight on the old link when it
+  goes. Messages are accepted as they arrive, so there is nothing
+  unsettled for the broker to redeliver, either; and if the old link is
+  closed without a drain, because the broker never answers one, the
+  broker releases what it had sent but we hadn't received. On a topic
+  (set topic in main()), both links get a copy of a message that matches
+  both selectors while they overlap, so during a change the ID of every
+  message is kept, and a message whose ID has been seen already is
+  dropped. The IDs are kept exactly, not hashed, so a message is never
+  dropped by mistake, and only until the change is over, so there are
+  never many of them. On a queue, each message goes to one link or the
+  other, so there is nothing to check. The program
+  reports how long a change took, and the longest gap between deliveries
+  while it was happening. Set new_selector in main() to try it.
+
+  Link credit is managed here, not by Proton's credit window, so that
+  the old link's credit can be left to run down.
+
+  Finally, one subscription can be split into several receivers, each
+  on its own connection and container thread, to consume one queue in
+  parallel (set shards in main()). Each receiver's selector is ours,
+  ANDed with a clause that picks out its share of the messages, by an
+  integer property or by the message ID, so that every message goes to
+  exactly one of them. See selector_shard.hpp for how, and
+  bench_selector_sharding.cpp for how it scales.
 */ 
 
 #include <unistd.h>
@@ -30,13 +82,28 @@
 #include <proton/messaging_handler.hpp>
 #include <proton/delivery.hpp>
 #include <proton/tracker.hpp>
+#include <proton/session.hpp>
 #include <iostream>
+#include <memory>
+#include <vector>
+#include <chrono>
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <unordered_set>
+
+#include "selector.hpp"
+#include "selector_batch.hpp"
+#include "selector_shard.hpp"
+#include "filter_cache.hpp"
 
 #define BOLD_ON "\x1B[1m"
 #define BOLD_OFF "\x1B[0m"
 
 #define LOG_FUNC std::cout << BOLD_ON << __FUNCTION__ << BOLD_OFF << std::endl;
 
+typedef std::chrono::steady_clock Clock;
+
 /* 
  * LoggingHandler is a subclass of proton::messaging_handler
  */
@@ -50,19 +117,110 @@ class LoggingHandler : public proton::messaging_handler
     int received;
     int number_to_receive;
     bool closed;
+    bool filter_locally;
+    std::unique_ptr<CompiledSelector> local_selector; // If filtering here
+    int discarded;
+    // Filtering a batch at a time, if batch_size > 1
+    size_t batch_size;
+    int batch_ms;
+    std::unique_ptr<BatchSelector> batch_selector;
+    std::vector<proton::message> batch;
+    size_t batched;
+    bool flush_scheduled;
+    proton::connection connection;
+    int credit;
+    // The link we receive on; and, while changing the selector, the one
+    //   that will replace it
+    proton::receiver current;
+    proton::receiver next;
+    bool changing;
+    int changes; // Started, so that a late timer can tell it is stale
+    std::string next_selector;
+    int drain_timeout_ms;
+    // The address is a topic, so both links may get the same message
+    bool topic;
+    // The IDs of the messages received during a change, on a topic
+    std::unordered_set<std::string> seen_ids;
+    long duplicates_dropped;
+    // For measuring a change
+    Clock::time_point change_started;
+    Clock::time_point last_delivery;
+    double longest_gap_ms;
+    double first_new_ms; // Until the first message on the new link
+    // Change the selector to this after change_after messages, if set
+    std::string new_selector;
+    int change_after;
+    FilterCache filters;
 
   public:
     LoggingHandler (const std::string &address, 
             const std::string &user,  const std::string &password, 
-            int number_to_receive, const std::string &selector)
+            int number_to_receive, const std::string &selector,
+            bool filter_locally, size_t batch_size, int batch_ms,
+            int credit, const std::string &new_selector, int change_after,
+            int drain_timeout_ms, bool topic)
+        : filters ("my_selector")
       {
       this->number_to_receive = number_to_receive;
+      this->filter_locally = filter_locally;
+      this->discarded = 0;
+      this->batch_size = batch_size > BatchSelector::BATCH
+        ? BatchSelector::BATCH : batch_size;
+      this->batch_ms = batch_ms;
+      this->batched = 0;
+      this->flush_scheduled = false;
       this->received = 0;
       this->closed = false;
       this->address = address;
       this->user = user;
       this->password = password;
       this->selector = selector;
+      this->credit = credit;
+      this->new_selector = new_selector;
+      this->change_after = change_after;
+      this->drain_timeout_ms = drain_timeout_ms;
+      this->topic = topic;
+      this->changing = false;
+      this->changes = 0;
+      this->duplicates_dropped = 0;
+      this->longest_gap_ms = this->first_new_ms = 0;
+      }
+
+    /** Replace the selector, without reconnecting. Call on the
+          container's thread. Returns false if a change is already under
+          way. Throws std::runtime_error if the selector isn't valid and
+          we are applying it ourselves; a broker that doesn't like it
+          will refuse the new link, and the old one stays. */
+    bool change_selector (const std::string &expression)
+      {
+      if (changing) return false;
+      if (local_selector)
+        {
+        // The link isn't filtered, so there's nothing to change on it
+        std::unique_ptr<CompiledSelector> program
+          (new CompiledSelector (expression));
+        if (batch_selector)
+          {
+          flush();
+          batch_selector.reset (new BatchSelector (expression));
+          }
+        local_selector = std::move (program);
+        selector = expression;
+        std::cout << "now filtering locally with: " << selector << std::endl;
+        return true;
+        }
+      changing = true;
+      changes++;
+      next_selector = expression;
+      change_started = Clock::now();
+      longest_gap_ms = first_new_ms = 0;
+      seen_ids.clear();
+      duplicates_dropped = 0;
+      proton::source_options source_opts;
+      set_filter_on_source_opts (source_opts, expression);
+      next = current.session().open_receiver (current.source().address(),
+        proton::receiver_options().source (source_opts).credit_window (0));
+      return true;
       }
   protected:
     // Note: in principle, we should invoke the base class method in
@@ -76,8 +234,95 @@ class LoggingHandler : public proton::messaging_handler
     void on_sender_open (proton::sender &s) override { LOG_FUNC; }
     void on_sender_close (proton::sender &s) override { LOG_FUNC; }
     void on_sender_detach (proton::sender &s) override { LOG_FUNC; }
-    void on_receiver_open (proton::receiver &r) override { LOG_FUNC; }
-    void on_receiver_close (proton::receiver &c) override { LOG_FUNC; }
+
+    /** If the broker didn't send our filter back, it isn't applying it,
+          so we must. */
+    void on_receiver_open (proton::receiver &r) override
+      {
+      LOG_FUNC;
+      r.add_credit (credit);
+      if (changing && r == next)
+        {
+        if (r.source().filters().empty())
+          {
+          // Refused, or the broker won't filter it; keep the old link
+          r.close();
+          return;
+          }
+        // The new link is in place; let the old one run down
+        current.drain();
+        int change = changes;
+        r.container().schedule (proton::duration::MILLISECOND
+          * drain_timeout_ms, [this, change]()
+          {
+          if (!changing || change != changes || !current.active()) return;
+          std::cout << "drain not answered; detaching anyway" << std::endl;
+          current.close();
+          });
+        return;
+        }
+      current = r;
+      if (local_selector || !r.source().filters().empty()) return;
+      std::cout << "broker ignored the selector; filtering locally"
+        << std::endl;
+      filter_here();
+      }
+
+    /** A message ID as a key for seen_ids. The type is included, so that
+          (say) the integer 1 and the string "1" are different IDs. */
+    static std::string id_key (const proton::message_id &id)
+      {
+      return std::to_string ((int)id.type()) + ":" + proton::to_string (id);
+      }
+
+    /** Set up to apply the selector here. Throws std::runtime_error if
+          it isn't valid. */
+    void filter_here ()
+      {
+      local_selector.reset (new CompiledSelector (selector));
+      if (batch_size <= 1) return;
+      batch_selector.reset (new BatchSelector (selector));
+      batch.resize (batch_size);
+      std::cout << "filtering in batches of " << batch_size << ", with "
+        << BatchSelector::kernels_name (batch_selector->kernels_used())
+        << " instructions" << std::endl;
+      }
+
+    /** The old link has delivered all it's going to. */
+    void on_receiver_drain_finish (proton::receiver &r) override
+      {
+      LOG_FUNC;
+      if (changing && r == current) r.close();
+      }
+
+    void on_receiver_close (proton::receiver &r) override
+      {
+      LOG_FUNC;
+      if (changing && r == next)
+        {
+        // The broker refused the new selector; carry on with the old one
+        std::cout << "selector not changed: " << (r.error().empty()
+          ? "the broker didn't apply it" : r.error().what()) << std::endl;
+        changing = false;
+        next = proton::receiver();
+        seen_ids.clear();
+        return;
+        }
+      if (!changing || !(r == current)) return;
+      changing = false;
+      // Nothing more can arrive on the old link to duplicate anything
+      seen_ids.clear();
+      current = next;
+      next = proton::receiver();
+      selector = next_selector;
+      double ms = std::chrono::duration<double, std::milli>
+        (Clock::now() - change_started).count();
+      std::cout << "selector changed to: " << selector << std::endl
+        << "  in " << ms << " ms; first message on the new link after "
+        << first_new_ms << " ms; longest gap between messages "
+        << longest_gap_ms << " ms; " << duplicates_dropped
+        << " duplicates dropped" << std::endl;
+      }
     void on_delivery_settle (proton::delivery &d) override { LOG_FUNC; }
     void on_connection_open (proton::connection &c) override { LOG_FUNC; }
     void on_connection_close (proton::connection &c) override { LOG_FUNC; }
@@ -89,34 +334,15 @@ class LoggingHandler : public proton::messaging_handler
          -- which might be broker-specific, and a source_options object.
          Note that setting the 'source options' on a receiver amounts to making
          requests on what the sender (the broker, here) should do.
-         That is, the 'source' is this receiver's source of messages. */
+         That is, the 'source' is this receiver's source of messages.
+         The filter has to be encoded as an AMQP described type (see
+         FilterCache::encode() in filter_cache.hpp for how); the cache
+         does that once for each expression, so that re-attaching, or
+         changing back to an earlier selector, costs only a copy. */
     void set_filter_on_source_opts (proton::source_options &opts, 
         const std::string& selector_str) 
       {
-      // A filter_map is a map from aN arbitrary key to a filter expression. 
-      // I guess it has to be a map, because multiple filters can be applied. 
-      proton::source::filter_map map;
-      proton::symbol filter_key ("my_selector"); // Arbitrary name
-
-      // The value stored along with the key is a filter expression as an
-      //   AMQP 'described type'. This is a primitive value annotated with
-      //   a specific descriptor, making it a kind of custom type. We need
-      //   to use proton::codec to write the described type in the 
-      //   appropriate format. Although AMQP provides a way for the 
-      //   attach performative to specify the filter as a described type,
-      //   AMQP says nothing about what the filter expression should
-      //   actually be. There is some loose consensus, but no specification.
-      proton::value filter_value;
-      proton::codec::encoder enc (filter_value);
-      enc << proton::codec::start::described()
-	      << proton::symbol("apache.org:selector-filter:string")
-	      << selector_str
-	      << proton::codec::finish();
-
-      // Put the filter spec (arbirary name and expression) into the map
-      map.put (filter_key, filter_value);
-      // Apply the filters in the map to the source options
-      opts.filters (map);
+      opts = filters.source_options (selector_str);
       }
 
     /** on_container_start: create a receiver. Set the receiver's
@@ -125,9 +351,19 @@ class LoggingHandler : public proton::messaging_handler
       {
       LOG_FUNC;
       proton::receiver_options recv_options;
-      proton::source_options source_opts;
-      set_filter_on_source_opts (source_opts, selector);
-      recv_options.source (source_opts);
+      recv_options.credit_window (0);
+      if (filter_locally)
+        {
+        // Throws std::runtime_error, and so stops the container, if the
+        //   selector isn't valid
+        filter_here();
+        }
+      else
+        {
+        proton::source_options source_opts;
+        set_filter_on_source_opts (source_opts, selector);
+        recv_options.source (source_opts);
+        }
       proton::connection_options conn_options;
       conn_options.user (user);
       conn_options.password (password);
@@ -144,20 +380,157 @@ class LoggingHandler : public proton::messaging_handler
       // If an exception is thrown here, the container will stop
       }
 
-    void on_message (proton::delivery &d, proton::message &m) override 
+    /** Pass on a message that we want. */
+    void process (proton::message &m)
       {
-      LOG_FUNC;
+      if (received == number_to_receive) return; // Closing
       received++;
       std::cout << "Received: " << m.body() << std::endl;
+      if (received == change_after && !new_selector.empty())
+        change_selector (new_selector);
       if (received == number_to_receive)
         {
+        if (local_selector)
+          std::cout << "Discarded " << discarded
+            << " messages that didn't match" << std::endl;
         // This will only shut down the container if there is only one
         //   active connection (as there is in this example)
-        d.connection().close();
+        connection.close();
+        }
+      }
+
+    /** Filter the messages held, and pass on the ones that match. */
+    void flush ()
+      {
+      size_t n = batched;
+      if (n == 0) return;
+      // process() may change the selector, which flushes again
+      batched = 0;
+      BatchSelector::Mask matched;
+      batch_selector->match (batch.data(), n, matched);
+      for (size_t i = 0; i < n; i++)
+        {
+        if (matched.test (i))
+          process (batch[i]);
+        else
+          discarded++;
         }
       }
+
+    void on_message (proton::delivery &d, proton::message &m) override 
+      {
+      LOG_FUNC;
+      connection = d.connection();
+      proton::receiver r = d.receiver();
+      // Top up the credit of the link we are keeping, but not of one
+      //   that is being drained
+      if (r == (changing ? next : current) && r.credit() <= credit / 2)
+        r.add_credit (credit - r.credit());
+      if (changing)
+        {
+        Clock::time_point now = Clock::now();
+        double gap = std::chrono::duration<double, std::milli>
+          (now - std::max (last_delivery, change_started)).count();
+        if (gap > longest_gap_ms) longest_gap_ms = gap;
+        if (r == next && first_new_ms == 0)
+          first_new_ms = std::chrono::duration<double, std::milli>
+            (now - change_started).count();
+        last_delivery = now;
+        // On a topic, drop a message that came on the other link too. A
+        //   message without an ID can't be checked
+        if (topic && !m.id().empty()
+            && !seen_ids.insert (id_key (m.id())).second)
+          {
+          duplicates_dropped++;
+          return;
+          }
+        }
+      else
+        last_delivery = Clock::now();
+      if (batch_selector)
+        {
+        // Take the message, and leave Proton an old one to decode into
+        swap (batch[batched++], m);
+        if (batched == batch_size)
+          flush();
+        else if (!flush_scheduled)
+          {
+          // Don't hold a message for more than batch_ms
+          flush_scheduled = true;
+          d.container().schedule (proton::duration::MILLISECOND * batch_ms,
+            [this]()
+            {
+            flush_scheduled = false;
+            flush();
+            });
+          }
+        return;
+        }
+      if (local_selector && !local_selector->matches (m))
+        {
+        // Accepted automatically, and so gone
+        discarded++;
+        return;
+        }
+      process (m);
+      }
   };
 
+/** Receive 'number_to_receive' messages from 'address', split 'shards'
+    ways, on as many threads. */
+void run_sharded (const std::string &address, const std::string &user,
+      const std::string &password, const std::string &selector,
+      int shards, const std::string &shard_property, int credit,
+      long number_to_receive)
+  {
+  // The shards connect for themselves, so they need the host and port,
+  //   and the address within the broker, separately
+  size_t slash = address.find ('/');
+  std::string url = address.substr (0, slash);
+  std::string queue = slash == std::string::npos ? ""
+    : address.substr (slash + 1);
+  ShardedSubscription::By by = shard_property.empty()
+    ? ShardedSubscription::MESSAGE_ID : ShardedSubscription::PROPERTY;
+
+  std::mutex output_lock;
+  std::atomic<long> received (0);
+  ShardedSubscription *subscription = 0;
+  ShardedSubscription s (url, queue, selector, shards, by, shard_property,
+    [&](int shard, proton::delivery &d, proton::message &m)
+    {
+    long n = ++received;
+    if (n > number_to_receive)
+      {
+      // Prefetched after we had enough -- give it back to the broker
+      d.release();
+      return;
+      }
+      {
+      std::lock_guard<std::mutex> l (output_lock);
+      std::cout << "Shard " << shard << " received: " << m.body()
+        << std::endl;
+      }
+    d.accept();
+    if (n == number_to_receive) subscription->stop();
+    }, credit, false);
+  subscription = &s;
+  for (int i = 0; i < shards; i++)
+    std::cout << "shard " << i << ": " << ShardedSubscription::selector_for
+      (selector, i, shards, by, shard_property) << std::endl;
+
+  proton::container container;
+  proton::connection_options conn_options;
+  conn_options.user (user);
+  conn_options.password (password);
+  conn_options.sasl_allowed_mechs ("PLAIN");
+  conn_options.sasl_allow_insecure_mechs (true);
+  s.start (container, conn_options);
+  container.run (shards);
+  for (int i = 0; i < shards; i++)
+    std::cout << "shard " << i << " received " << s.received (i)
+      << " messages" << std::endl;
+  }
+
 int main(int argc, char **argv) 
   {
   try 
@@ -166,8 +539,39 @@ int main(int argc, char **argv)
     std::string user = "admin";
     std::string password = "admin";
     std::string selector = "foo='bar'";
+    // Apply the selector here, rather than asking the broker to
+    bool filter_locally = false;
+    // When filtering here, evaluate the selector for up to this many
+    //   messages at once (at most 256); 1 for one at a time
+    size_t batch_size = 1;
+    // The longest that a message waits for the rest of its batch
+    int batch_ms = 5;
+    // Link credit: the most messages the broker may send ahead of us
+    int credit = 10;
+    // If set, change the selector to this after change_after messages
+    std::string new_selector = "";
+    int change_after = 5;
+    // How long to wait for the broker to drain the old link
+    int drain_timeout_ms = 2000;
+    // The address is a topic, on which both links get a copy of a
+    //   message while the selector is being changed
+    bool topic = false;
+    // Split the subscription this many ways, each with its own
+    //   connection and thread; by this integer property, or by the
+    //   message ID if it's empty
+    int shards = 1;
+    std::string shard_property = "";
+
+    if (shards > 1)
+      {
+      run_sharded (address, user, password, selector, shards,
+        shard_property, credit, 10);
+      return 0;
+      }
 
-    LoggingHandler h (address, user, password, 10, selector);
+    LoggingHandler h (address, user, password, 10, selector,
+      filter_locally, batch_size, batch_ms, credit, new_selector,
+      change_after, drain_timeout_ms, topic);
     proton::container container (h);
     container.run();
     } 
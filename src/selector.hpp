@@ -0,0 +1,1443 @@
+/*
+  selector.hpp
+
+  Selector parses a JMS message selector -- the expression that a client
+    such as receive_selector.cpp sends in an 'apache.org:selector-filter:
+    string' source filter -- and decides whether a message matches it.
+
+  The grammar is the one in the JMS specification: comparisons (=, <>, <,
+    <=, >, >=), arithmetic (+, -, *, /), AND, OR, NOT, BETWEEN, LIKE (with
+    ESCAPE), IN, IS NULL, and literals that are strings in single quotes,
+    integers (decimal, hex or octal), floating-point numbers, TRUE and
+    FALSE. Keywords are case-insensitive; identifiers are not. An
+    identifier names an application property of the message, except for
+    the JMS header names, which are mapped onto the AMQP header and
+    properties sections the way Qpid JMS maps them:
+
+      JMSMessageID      message-id (as a string)
+      JMSCorrelationID  correlation-id (as a string)
+      JMSType           subject
+      JMSPriority       priority
+      JMSDeliveryMode   'PERSISTENT' if durable, else 'NON_PERSISTENT'
+      JMSTimestamp      creation-time, in milliseconds
+      JMSExpiration     absolute-expiry-time, in milliseconds
+
+  Evaluation follows the SQL rules that JMS adopts: a property that is
+    missing, or has a type that makes no sense in the expression (a
+    string compared with a number, say), is 'unknown', and unknown
+    propagates -- NOT unknown is unknown, unknown AND false is false,
+    unknown OR true is true. A message matches only if the whole
+    expression is true.
+
+  The expression is parsed once, into a tree, when the Selector is
+    created, and the parts of it that don't depend on the message are
+    worked out there and then; a syntax error throws std::runtime_error,
+    giving the position. matches() only reads the tree, so one Selector
+    can be used from several threads at once, as long as each message is
+    only looked at by one thread at a time (Proton decodes message
+    properties lazily).
+
+  Walking the tree is simple, but every property it looks at is copied
+    out of the message -- each string into a new std::string -- and every
+    step returns a Value by copy. CompiledSelector does the same job
+    faster: the tree is compiled into a short program for a stack
+    machine, with constants in a pool, and short-circuit jumps for AND
+    and OR. To run it, one pass over the message's properties (read in
+    place, with the same decoder trick as BodyView) picks out the ones
+    the program uses, into an array on the stack, and the program works
+    on views of them. Evaluation allocates nothing, except that the JMS
+    headers that are strings -- JMSMessageID, JMSCorrelationID and
+    JMSType -- are only available from the C++ API as copies.
+*/
+
+#ifndef SELECTOR_HPP
+#define SELECTOR_HPP
+
+#include <proton/message.hpp>
+#include <proton/scalar.hpp>
+#include <proton/types.hpp>
+#include <proton/value.hpp>
+#include <proton/codec/decoder.hpp>
+#include <proton/codec.h>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <stdexcept>
+#include <cstdint>
+#include <cstdlib>
+#include <cerrno>
+#include <cctype>
+#include <cstring>
+#include <deque>
+#include <ostream>
+
+class Selector
+  {
+  public:
+    /*
+     * Value is the result of evaluating part of an expression.
+     */
+    struct Value
+      {
+      enum Type { UNKNOWN, BOOLEAN, LONG, DOUBLE, STRING };
+      Type type;
+      bool b;
+      int64_t l;
+      double d;
+      std::string s;
+
+      Value () : type (UNKNOWN), b (false), l (0), d (0) {}
+      static Value boolean (bool b)
+        { Value v; v.type = BOOLEAN; v.b = b; return v; }
+      static Value integer (int64_t l)
+        { Value v; v.type = LONG; v.l = l; return v; }
+      static Value real (double d)
+        { Value v; v.type = DOUBLE; v.d = d; return v; }
+      static Value string (const std::string &s)
+        { Value v; v.type = STRING; v.s = s; return v; }
+
+      bool numeric () const { return type == LONG || type == DOUBLE; }
+      double as_double () const { return type == LONG ? (double)l : d; }
+      bool is_true () const { return type == BOOLEAN && b; }
+      bool is_false () const { return type == BOOLEAN && !b; }
+      };
+
+    /*
+     * Node is one node of the parsed expression.
+     */
+    struct Node
+      {
+      enum Op
+        {
+        LITERAL, PROPERTY, HEADER,
+        AND, OR, NOT,
+        EQ, NE, LT, LE, GT, GE,
+        ADD, SUB, MUL, DIV, NEG,
+        BETWEEN, LIKE, IN, IS_NULL
+        };
+      // The JMS headers, for HEADER nodes
+      enum Header
+        {
+        MESSAGE_ID, CORRELATION_ID, TYPE, PRIORITY, DELIVERY_MODE,
+        TIMESTAMP, EXPIRATION
+        };
+
+      Op op;
+      bool negated; // NOT BETWEEN, NOT LIKE, NOT IN, IS NOT NULL
+      Value value; // LITERAL
+      std::string name; // PROPERTY, or the pattern for LIKE
+      Header header;
+      char escape; // LIKE; 0 for none
+      std::vector<std::string> list; // IN
+      std::vector<std::unique_ptr<Node>> args;
+
+      Node (Op op) : op (op), negated (false), header (MESSAGE_ID),
+        escape (0) {}
+      };
+
+  protected:
+    /*
+     * Parser is a recursive-descent parser, with one token of lookahead.
+     */
+    class Parser
+      {
+      protected:
+        enum Token { END, IDENT, STRING, INTEGER, REAL, SYMBOL };
+
+        const std::string &text;
+        size_t pos;
+        Token token;
+        size_t token_start;
+        std::string token_text; // Identifier, string, or symbol
+
+        [[noreturn]] void error (const std::string &what)
+          {
+          throw std::runtime_error ("Selector syntax error at position "
+            + std::to_string (token_start + 1) + ": " + what);
+          }
+
+        /** The current token, as written. */
+        std::string current () const
+          {
+          return text.substr (token_start, pos - token_start);
+          }
+
+        static bool ident_start (char c)
+          {
+          return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_'
+            || c == '$' || (unsigned char)c >= 0x80;
+          }
+
+        static bool ident_part (char c)
+          {
+          return ident_start (c) || (c >= '0' && c <= '9');
+          }
+
+        void next ()
+          {
+          while (pos < text.size() && isspace ((unsigned char)text[pos]))
+            pos++;
+          token_start = pos;
+          token_text.clear();
+          if (pos == text.size())
+            {
+            token = END;
+            return;
+            }
+          char c = text[pos];
+          if (ident_start (c))
+            {
+            while (pos < text.size() && ident_part (text[pos])) pos++;
+            token = IDENT;
+            token_text = text.substr (token_start, pos - token_start);
+            }
+          else if (c == '\'')
+            {
+            // '' inside a string is a quote
+            pos++;
+            for (;;)
+              {
+              if (pos == text.size()) error ("unterminated string");
+              if (text[pos] == '\'')
+                {
+                if (pos + 1 < text.size() && text[pos + 1] == '\'')
+                  pos++;
+                else
+                  break;
+                }
+              token_text += text[pos++];
+              }
+            pos++;
+            token = STRING;
+            }
+          else if ((c >= '0' && c <= '9') || (c == '.' && pos + 1 < text.size()
+              && text[pos + 1] >= '0' && text[pos + 1] <= '9'))
+            {
+            number();
+            }
+          else
+            {
+            static const char *two[] = { "<>", "<=", ">=" };
+            token = SYMBOL;
+            for (size_t i = 0; i < 3; i++)
+              if (text.compare (pos, 2, two[i]) == 0)
+                {
+                token_text = two[i];
+                pos += 2;
+                return;
+                }
+            if (std::string ("=<>+-*/(),").find (c) == std::string::npos)
+              error (std::string ("unexpected '") + c + "'");
+            token_text = c;
+            pos++;
+            }
+          }
+
+        /** A numeric literal, which sets 'literal'. */
+        void number ()
+          {
+          const char *start = text.c_str() + pos;
+          char *end;
+          bool real = false;
+          errno = 0;
+          if (start[0] == '0' && (start[1] == 'x' || start[1] == 'X'))
+            literal = Value::integer (strtoll (start, &end, 16));
+          else
+            {
+            size_t i = pos;
+            while (i < text.size() && (isdigit ((unsigned char)text[i])
+                || text[i] == '.' || text[i] == 'e' || text[i] == 'E'
+                || ((text[i] == '+' || text[i] == '-')
+                  && (text[i - 1] == 'e' || text[i - 1] == 'E'))))
+              {
+              if (!isdigit ((unsigned char)text[i])) real = true;
+              i++;
+              }
+            if (real)
+              literal = Value::real (strtod (start, &end));
+            else
+              literal = Value::integer (strtoll (start, &end,
+                start[0] == '0' ? 8 : 10));
+            }
+          if (errno == ERANGE) error ("number out of range");
+          pos += end - start;
+          // Java-style suffixes
+          if (pos < text.size())
+            {
+            char s = text[pos];
+            if (s == 'l' || s == 'L')
+              pos++;
+            else if (s == 'f' || s == 'F' || s == 'd' || s == 'D')
+              {
+              if (literal.type == Value::LONG)
+                literal = Value::real ((double)literal.l);
+              pos++;
+              }
+            }
+          if (pos < text.size() && ident_part (text[pos]))
+            error ("malformed number");
+          token = literal.type == Value::LONG ? INTEGER : REAL;
+          }
+
+        bool is_keyword (const char *word) const
+          {
+          if (token != IDENT || token_text.size() != strlen (word))
+            return false;
+          for (size_t i = 0; i < token_text.size(); i++)
+            if (toupper ((unsigned char)token_text[i]) != word[i])
+              return false;
+          return true;
+          }
+
+        bool accept_keyword (const char *word)
+          {
+          if (!is_keyword (word)) return false;
+          next();
+          return true;
+          }
+
+        bool accept_symbol (const char *symbol)
+          {
+          if (token != SYMBOL || token_text != symbol) return false;
+          next();
+          return true;
+          }
+
+        void expect_symbol (const char *symbol)
+          {
+          if (!accept_symbol (symbol))
+            error (std::string ("expected '") + symbol + "'");
+          }
+
+        std::string expect_string ()
+          {
+          if (token != STRING) error ("expected a string");
+          std::string s = token_text;
+          next();
+          return s;
+          }
+
+        static std::unique_ptr<Node> binary (Node::Op op,
+              std::unique_ptr<Node> &&left, std::unique_ptr<Node> &&right)
+          {
+          std::unique_ptr<Node> n (new Node (op));
+          n->args.push_back (std::move (left));
+          n->args.push_back (std::move (right));
+          return n;
+          }
+
+        std::unique_ptr<Node> or_expr ()
+          {
+          std::unique_ptr<Node> left = and_expr();
+          while (accept_keyword ("OR"))
+            left = binary (Node::OR, std::move (left), and_expr());
+          return left;
+          }
+
+        std::unique_ptr<Node> and_expr ()
+          {
+          std::unique_ptr<Node> left = not_expr();
+          while (accept_keyword ("AND"))
+            left = binary (Node::AND, std::move (left), not_expr());
+          return left;
+          }
+
+        std::unique_ptr<Node> not_expr ()
+          {
+          if (!accept_keyword ("NOT")) return comparison();
+          std::unique_ptr<Node> n (new Node (Node::NOT));
+          n->args.push_back (not_expr());
+          return n;
+          }
+
+        std::unique_ptr<Node> comparison ()
+          {
+          std::unique_ptr<Node> left = sum();
+          static const struct { const char *symbol; Node::Op op; } ops[] =
+            {
+              { "=", Node::EQ }, { "<>", Node::NE }, { "<", Node::LT },
+              { "<=", Node::LE }, { ">", Node::GT }, { ">=", Node::GE }
+            };
+          for (size_t i = 0; i < sizeof (ops) / sizeof (ops[0]); i++)
+            if (accept_symbol (ops[i].symbol))
+              return binary (ops[i].op, std::move (left), sum());
+          if (accept_keyword ("IS"))
+            {
+            std::unique_ptr<Node> n (new Node (Node::IS_NULL));
+            n->negated = accept_keyword ("NOT");
+            if (!accept_keyword ("NULL")) error ("expected NULL");
+            n->args.push_back (std::move (left));
+            return n;
+            }
+          bool negated = accept_keyword ("NOT");
+          std::unique_ptr<Node> n;
+          if (accept_keyword ("BETWEEN"))
+            {
+            n.reset (new Node (Node::BETWEEN));
+            n->args.push_back (std::move (left));
+            n->args.push_back (sum());
+            if (!accept_keyword ("AND")) error ("expected AND");
+            n->args.push_back (sum());
+            }
+          else if (accept_keyword ("LIKE"))
+            {
+            n.reset (new Node (Node::LIKE));
+            n->args.push_back (std::move (left));
+            n->name = expect_string();
+            if (accept_keyword ("ESCAPE"))
+              {
+              std::string e = expect_string();
+              if (e.size() != 1) error ("ESCAPE must be one character");
+              n->escape = e[0];
+              }
+            }
+          else if (accept_keyword ("IN"))
+            {
+            n.reset (new Node (Node::IN));
+            n->args.push_back (std::move (left));
+            expect_symbol ("(");
+            do
+              n->list.push_back (expect_string());
+            while (accept_symbol (","));
+            expect_symbol (")");
+            }
+          else if (negated)
+            error ("expected BETWEEN, LIKE or IN");
+          else
+            return left;
+          n->negated = negated;
+          return n;
+          }
+
+        std::unique_ptr<Node> sum ()
+          {
+          std::unique_ptr<Node> left = product();
+          for (;;)
+            {
+            if (accept_symbol ("+"))
+              left = binary (Node::ADD, std::move (left), product());
+            else if (accept_symbol ("-"))
+              left = binary (Node::SUB, std::move (left), product());
+            else
+              return left;
+            }
+          }
+
+        std::unique_ptr<Node> product ()
+          {
+          std::unique_ptr<Node> left = unary();
+          for (;;)
+            {
+            if (accept_symbol ("*"))
+              left = binary (Node::MUL, std::move (left), unary());
+            else if (accept_symbol ("/"))
+              left = binary (Node::DIV, std::move (left), unary());
+            else
+              return left;
+            }
+          }
+
+        std::unique_ptr<Node> unary ()
+          {
+          if (accept_symbol ("+")) return unary();
+          if (accept_symbol ("-"))
+            {
+            std::unique_ptr<Node> n (new Node (Node::NEG));
+            n->args.push_back (unary());
+            return n;
+            }
+          return primary();
+          }
+
+        std::unique_ptr<Node> primary ()
+          {
+          std::unique_ptr<Node> n;
+          if (accept_symbol ("("))
+            {
+            n = or_expr();
+            expect_symbol (")");
+            return n;
+            }
+          switch (token)
+            {
+            case STRING:
+              n.reset (new Node (Node::LITERAL));
+              n->value = Value::string (token_text);
+              break;
+            case INTEGER:
+            case REAL:
+              n.reset (new Node (Node::LITERAL));
+              n->value = literal;
+              break;
+            case IDENT:
+              if (is_keyword ("TRUE") || is_keyword ("FALSE"))
+                {
+                n.reset (new Node (Node::LITERAL));
+                n->value = Value::boolean (is_keyword ("TRUE"));
+                }
+              else if (is_keyword ("NULL"))
+                n.reset (new Node (Node::LITERAL)); // Unknown
+              else if (is_reserved())
+                error ("unexpected " + token_text);
+              else
+                n = identifier (token_text);
+              break;
+            default:
+              error (token == END ? "unexpected end"
+                : "unexpected '" + current() + "'");
+            }
+          next();
+          return n;
+          }
+
+        bool is_reserved () const
+          {
+          static const char *words[] = { "AND", "OR", "NOT", "BETWEEN",
+            "LIKE", "IN", "IS", "ESCAPE" };
+          for (size_t i = 0; i < sizeof (words) / sizeof (words[0]); i++)
+            if (is_keyword (words[i])) return true;
+          return false;
+          }
+
+        static std::unique_ptr<Node> identifier (const std::string &name)
+          {
+          static const struct { const char *name; Node::Header header; }
+            headers[] =
+            {
+              { "JMSMessageID", Node::MESSAGE_ID },
+              { "JMSCorrelationID", Node::CORRELATION_ID },
+              { "JMSType", Node::TYPE },
+              { "JMSPriority", Node::PRIORITY },
+              { "JMSDeliveryMode", Node::DELIVERY_MODE },
+              { "JMSTimestamp", Node::TIMESTAMP },
+              { "JMSExpiration", Node::EXPIRATION }
+            };
+          for (size_t i = 0; i < sizeof (headers) / sizeof (headers[0]); i++)
+            if (name == headers[i].name)
+              {
+              std::unique_ptr<Node> n (new Node (Node::HEADER));
+              n->header = headers[i].header;
+              n->name = name;
+              return n;
+              }
+          std::unique_ptr<Node> n (new Node (Node::PROPERTY));
+          n->name = name;
+          return n;
+          }
+
+      public:
+        Value literal;
+
+        Parser (const std::string &text) : text (text), pos (0)
+          {
+          next();
+          }
+
+        std::unique_ptr<Node> parse ()
+          {
+          std::unique_ptr<Node> n = or_expr();
+          if (token != END) error ("unexpected '" + current() + "'");
+          return n;
+          }
+      };
+
+    std::string text;
+    std::unique_ptr<Node> root;
+
+    static Value from_scalar (const proton::scalar &s)
+      {
+      switch (s.type())
+        {
+        case proton::BOOLEAN: return Value::boolean (proton::get<bool> (s));
+        case proton::UBYTE: case proton::BYTE: case proton::USHORT:
+        case proton::SHORT: case proton::UINT: case proton::INT:
+        case proton::LONG:
+          return Value::integer (proton::coerce<int64_t> (s));
+        case proton::ULONG:
+          return Value::integer ((int64_t)proton::get<uint64_t> (s));
+        case proton::FLOAT: case proton::DOUBLE:
+          return Value::real (proton::coerce<double> (s));
+        case proton::STRING:
+          return Value::string (proton::get<std::string> (s));
+        case proton::SYMBOL:
+          return Value::string (proton::get<proton::symbol> (s));
+        default:
+          return Value();
+        }
+      }
+
+    static Value header (const proton::message &m, Node::Header h)
+      {
+      switch (h)
+        {
+        case Node::MESSAGE_ID:
+          if (m.id().empty()) return Value();
+          return Value::string (proton::to_string (m.id()));
+        case Node::CORRELATION_ID:
+          if (m.correlation_id().empty()) return Value();
+          return Value::string (proton::to_string (m.correlation_id()));
+        case Node::TYPE:
+          if (m.subject().empty()) return Value();
+          return Value::string (m.subject());
+        case Node::PRIORITY:
+          return Value::integer (m.priority());
+        case Node::DELIVERY_MODE:
+          return Value::string (m.durable() ? "PERSISTENT" : "NON_PERSISTENT");
+        case Node::TIMESTAMP:
+          return Value::integer (m.creation_time().milliseconds());
+        case Node::EXPIRATION:
+          return Value::integer (m.expiry_time().milliseconds());
+        }
+      return Value();
+      }
+
+    /** Compare two values. Returns -1, 0 or 1, or 2 if they can't be
+          compared. Only numbers are ordered; strings and booleans can
+          only be equal or not. */
+    static int compare (const Value &a, const Value &b, bool ordered)
+      {
+      if (a.numeric() && b.numeric())
+        {
+        if (a.type == Value::LONG && b.type == Value::LONG)
+          return a.l < b.l ? -1 : a.l > b.l ? 1 : 0;
+        double x = a.as_double(), y = b.as_double();
+        return x < y ? -1 : x > y ? 1 : x == y ? 0 : 2; // NaN
+        }
+      if (ordered || a.type != b.type) return 2;
+      if (a.type == Value::STRING) return a.s == b.s ? 0 : 1;
+      if (a.type == Value::BOOLEAN) return a.b == b.b ? 0 : 1;
+      return 2;
+      }
+
+    static Value arithmetic (Node::Op op, const Value &a, const Value &b)
+      {
+      if (!a.numeric() || !b.numeric()) return Value();
+      if (a.type == Value::LONG && b.type == Value::LONG)
+        {
+        switch (op)
+          {
+          case Node::ADD: return Value::integer (a.l + b.l);
+          case Node::SUB: return Value::integer (a.l - b.l);
+          case Node::MUL: return Value::integer (a.l * b.l);
+          default:
+            if (b.l == 0) return Value();
+            return Value::integer (a.l / b.l);
+          }
+        }
+      double x = a.as_double(), y = b.as_double();
+      switch (op)
+        {
+        case Node::ADD: return Value::real (x + y);
+        case Node::SUB: return Value::real (x - y);
+        case Node::MUL: return Value::real (x * y);
+        default: return Value::real (x / y);
+        }
+      }
+
+    static Value logical_not (const Value &v)
+      {
+      if (v.type != Value::BOOLEAN) return Value();
+      return Value::boolean (!v.b);
+      }
+
+  public:
+    /** Does s match a LIKE pattern? '%' matches any number of characters,
+          '_' exactly one; the escape character, if not 0, makes the
+          character after it literal. */
+    static bool like (std::string_view s, std::string_view pattern,
+          char escape)
+      {
+      // Backtrack only to the most recent '%', which is enough
+      size_t si = 0, pi = 0;
+      size_t star_p = std::string_view::npos, star_s = 0;
+      while (si < s.size())
+        {
+        if (pi < pattern.size())
+          {
+          char p = pattern[pi];
+          if (escape && p == escape && pi + 1 < pattern.size())
+            {
+            if (s[si] == pattern[pi + 1])
+              {
+              si++;
+              pi += 2;
+              continue;
+              }
+            }
+          else if (p == '%')
+            {
+            star_p = ++pi;
+            star_s = si;
+            continue;
+            }
+          else if (p == '_' || p == s[si])
+            {
+            si++;
+            pi++;
+            continue;
+            }
+          }
+        if (star_p == std::string_view::npos) return false;
+        pi = star_p;
+        si = ++star_s;
+        }
+      while (pi < pattern.size() && pattern[pi] == '%') pi++;
+      return pi == pattern.size();
+      }
+
+    /** Parse the expression. Throws std::runtime_error if it isn't
+          valid. */
+    explicit Selector (const std::string &expression) : text (expression)
+      {
+      Parser p (text);
+      root = p.parse();
+      fold (root);
+      }
+
+    const std::string &expression () const { return text; }
+
+    /** The parsed expression, after constant folding. */
+    const Node &tree () const { return *root; }
+
+    /** Fold the constant parts of a tree: a node whose arguments are all
+          literals becomes a literal, and so does an AND with a false
+          argument, or an OR with a true one, whatever the other argument
+          turns out to be. */
+    static void fold (std::unique_ptr<Node> &n)
+      {
+      bool constant = true;
+      for (size_t i = 0; i < n->args.size(); i++)
+        {
+        fold (n->args[i]);
+        if (n->args[i]->op != Node::LITERAL) constant = false;
+        }
+      if (n->op == Node::LITERAL || n->op == Node::PROPERTY
+          || n->op == Node::HEADER)
+        return;
+      if (constant)
+        {
+        // A constant expression never looks at the message
+        static const proton::message none;
+        std::unique_ptr<Node> literal (new Node (Node::LITERAL));
+        literal->value = evaluate (*n, none);
+        n = std::move (literal);
+        return;
+        }
+      if (n->op != Node::AND && n->op != Node::OR) return;
+      bool absorbing = n->op == Node::OR;
+      for (size_t i = 0; i < 2; i++)
+        {
+        const Value &v = n->args[i]->value;
+        if (n->args[i]->op != Node::LITERAL || v.type != Value::BOOLEAN)
+          continue;
+        // TRUE AND x is x, and FALSE OR x is x, as long as x can only be
+        //   true, false or unknown -- not, say, a string property
+        std::unique_ptr<Node> &other = n->args[1 - i];
+        if (v.b != absorbing && !predicate (other->op)) continue;
+        std::unique_ptr<Node> keep = std::move (v.b == absorbing
+          ? n->args[i] : other);
+        n = std::move (keep);
+        return;
+        }
+      }
+
+    /** Does a node of this kind always give true, false or unknown? */
+    static bool predicate (Node::Op op)
+      {
+      return op != Node::LITERAL && op != Node::PROPERTY
+        && op != Node::HEADER && (op < Node::ADD || op > Node::NEG);
+      }
+
+    /** Evaluate a node against a message. */
+    static Value evaluate (const Node &n, const proton::message &m)
+      {
+      switch (n.op)
+        {
+        case Node::LITERAL:
+          return n.value;
+        case Node::PROPERTY:
+          return from_scalar (m.properties().get (n.name));
+        case Node::HEADER:
+          return header (m, n.header);
+        case Node::AND:
+          {
+          Value a = evaluate (*n.args[0], m);
+          if (a.is_false()) return a;
+          Value b = evaluate (*n.args[1], m);
+          if (b.is_false()) return b;
+          if (a.is_true() && b.is_true()) return a;
+          return Value();
+          }
+        case Node::OR:
+          {
+          Value a = evaluate (*n.args[0], m);
+          if (a.is_true()) return a;
+          Value b = evaluate (*n.args[1], m);
+          if (b.is_true()) return b;
+          if (a.is_false() && b.is_false()) return a;
+          return Value();
+          }
+        case Node::NOT:
+          return logical_not (evaluate (*n.args[0], m));
+        case Node::EQ: case Node::NE:
+        case Node::LT: case Node::LE: case Node::GT: case Node::GE:
+          {
+          int c = compare (evaluate (*n.args[0], m),
+            evaluate (*n.args[1], m), n.op != Node::EQ && n.op != Node::NE);
+          if (c == 2) return Value();
+          switch (n.op)
+            {
+            case Node::EQ: return Value::boolean (c == 0);
+            case Node::NE: return Value::boolean (c != 0);
+            case Node::LT: return Value::boolean (c < 0);
+            case Node::LE: return Value::boolean (c <= 0);
+            case Node::GT: return Value::boolean (c > 0);
+            default: return Value::boolean (c >= 0);
+            }
+          }
+        case Node::ADD: case Node::SUB: case Node::MUL: case Node::DIV:
+          return arithmetic (n.op, evaluate (*n.args[0], m),
+            evaluate (*n.args[1], m));
+        case Node::NEG:
+          {
+          Value v = evaluate (*n.args[0], m);
+          if (v.type == Value::LONG) return Value::integer (-v.l);
+          if (v.type == Value::DOUBLE) return Value::real (-v.d);
+          return Value();
+          }
+        case Node::BETWEEN:
+          {
+          Value v = evaluate (*n.args[0], m);
+          int lo = compare (v, evaluate (*n.args[1], m), true);
+          int hi = compare (v, evaluate (*n.args[2], m), true);
+          if (lo == 2 || hi == 2) return Value();
+          bool in = lo >= 0 && hi <= 0;
+          return Value::boolean (in != n.negated);
+          }
+        case Node::LIKE:
+          {
+          Value v = evaluate (*n.args[0], m);
+          if (v.type != Value::STRING) return Value();
+          return Value::boolean (like (v.s, n.name, n.escape) != n.negated);
+          }
+        case Node::IN:
+          {
+          Value v = evaluate (*n.args[0], m);
+          if (v.type != Value::STRING) return Value();
+          bool in = false;
+          for (size_t i = 0; i < n.list.size() && !in; i++)
+            in = v.s == n.list[i];
+          return Value::boolean (in != n.negated);
+          }
+        case Node::IS_NULL:
+          {
+          bool null = evaluate (*n.args[0], m).type == Value::UNKNOWN;
+          return Value::boolean (null != n.negated);
+          }
+        }
+      return Value();
+      }
+
+    /** Does the message match? Unknown counts as no. */
+    bool matches (const proton::message &m) const
+      {
+      return evaluate (*root, m).is_true();
+      }
+  };
+
+/*
+ * PropertyScanner reads a message's application properties where Proton
+ *   keeps them, without copying them into proton::scalars. Like BodyView,
+ *   it is a decoder, for the sake of the pn_data_t that decoders can see.
+ *   The views it hands out are valid for as long as the message is alive
+ *   and unmodified.
+ */
+class PropertyScanner : protected proton::codec::decoder
+  {
+  public:
+    explicit PropertyScanner (const proton::message &m) :
+        proton::codec::decoder (m.properties().value())
+      {}
+
+    /** Call f (name, data) for each property, with data positioned on its
+          value, until f returns false. */
+    template <class F> void scan (F f)
+      {
+      pn_data_t *data = pn_object();
+      if (!data) return;
+      pn_data_rewind (data);
+      if (!pn_data_next (data) || pn_data_type (data) != PN_MAP) return;
+      pn_data_enter (data);
+      while (pn_data_next (data))
+        {
+        pn_type_t type = pn_data_type (data);
+        pn_bytes_t key = { 0, 0 };
+        if (type == PN_STRING) key = pn_data_get_string (data);
+        else if (type == PN_SYMBOL) key = pn_data_get_symbol (data);
+        if (!pn_data_next (data)) break;
+        if (!f (std::string_view (key.start, key.size), data)) break;
+        }
+      pn_data_exit (data);
+      }
+  };
+
+/*
+ * CompiledSelector is a Selector compiled for a stack machine (see the
+ *   top of this file). Each instruction is 8 bytes. AND and OR jump over
+ *   their right-hand side when the left-hand side settles the answer,
+ *   leaving it on the stack. An expression can use up to MAX_PROPERTIES
+ *   different properties, and nest up to MAX_DEPTH deep, so that the
+ *   machine's working space fits on the C stack; anything bigger is
+ *   refused when it is compiled.
+ */
+class CompiledSelector
+  {
+  public:
+    static const size_t MAX_DEPTH = 32;
+    static const size_t MAX_PROPERTIES = 32;
+
+    enum Opcode
+      {
+      PUSH, // Constant a
+      LOAD, // Property a
+      HEADER, // JMS header a
+      AND_JUMP, // Jump to b if the top of the stack is false
+      OR_JUMP, // Jump to b if the top of the stack is true
+      AND, OR, NOT,
+      EQ, NE, LT, LE, GT, GE,
+      ADD, SUB, MUL, DIV, NEG,
+      BETWEEN,
+      LIKE, // Pattern is constant a, escape character is b
+      IN, // The list is b constants from a
+      IS_NULL
+      };
+
+    struct Instruction
+      {
+      uint8_t op;
+      uint8_t negated;
+      uint16_t a;
+      uint32_t b;
+      };
+
+    /*
+     * Operand is a value on the machine's stack. Strings are views of the
+     *   constant pool, or of the message.
+     */
+    struct Operand
+      {
+      Selector::Value::Type type;
+      union
+        {
+        bool b;
+        int64_t l;
+        double d;
+        };
+      std::string_view s;
+
+      bool numeric () const
+        {
+        return type == Selector::Value::LONG || type == Selector::Value::DOUBLE;
+        }
+      double as_double () const
+        {
+        return type == Selector::Value::LONG ? (double)l : d;
+        }
+      };
+
+  protected:
+    typedef Selector::Node Node;
+    typedef Selector::Value Value;
+
+    std::string text;
+    std::vector<Instruction> code;
+    std::vector<Operand> constants;
+    std::deque<std::string> strings; // Constant strings; they never move
+    std::vector<std::string> properties; // Names, by slot
+    size_t depth; // While compiling
+    size_t max_depth;
+
+    static Operand unknown ()
+      {
+      Operand o;
+      o.type = Value::UNKNOWN;
+      o.l = 0;
+      return o;
+      }
+
+    static Operand boolean (bool b)
+      {
+      Operand o;
+      o.type = Value::BOOLEAN;
+      o.l = 0;
+      o.b = b;
+      return o;
+      }
+
+    uint16_t constant (const Value &v)
+      {
+      if (constants.size() > 0xffff)
+        throw std::runtime_error ("Selector has too many constants");
+      Operand o = unknown();
+      o.type = v.type;
+      switch (v.type)
+        {
+        case Value::BOOLEAN: o.b = v.b; break;
+        case Value::LONG: o.l = v.l; break;
+        case Value::DOUBLE: o.d = v.d; break;
+        case Value::STRING:
+          strings.push_back (v.s);
+          o.s = strings.back();
+          break;
+        default: break;
+        }
+      constants.push_back (o);
+      return constants.size() - 1;
+      }
+
+    uint16_t property (const std::string &name)
+      {
+      for (size_t i = 0; i < properties.size(); i++)
+        if (properties[i] == name) return i;
+      if (properties.size() == MAX_PROPERTIES)
+        throw std::runtime_error ("Selector uses too many properties");
+      properties.push_back (name);
+      return properties.size() - 1;
+      }
+
+    /** Add an instruction that takes 'pops' values off the stack and
+          pushes 'pushes'. Returns its address. */
+    size_t emit (Opcode op, int pops, int pushes, uint16_t a = 0,
+          uint32_t b = 0, bool negated = false)
+      {
+      Instruction i;
+      i.op = op;
+      i.negated = negated;
+      i.a = a;
+      i.b = b;
+      code.push_back (i);
+      depth = depth - pops + pushes;
+      if (depth > max_depth) max_depth = depth;
+      if (max_depth > MAX_DEPTH)
+        throw std::runtime_error ("Selector is nested too deeply");
+      return code.size() - 1;
+      }
+
+    void compile (const Node &n)
+      {
+      // Indexed by Node::Op, for the ones that are simple binary ops
+      static const Opcode binary[] =
+        {
+        PUSH, PUSH, PUSH, AND, OR, NOT, EQ, NE, LT, LE, GT, GE,
+        ADD, SUB, MUL, DIV
+        };
+      switch (n.op)
+        {
+        case Node::LITERAL:
+          emit (PUSH, 0, 1, constant (n.value));
+          break;
+        case Node::PROPERTY:
+          emit (LOAD, 0, 1, property (n.name));
+          break;
+        case Node::HEADER:
+          emit (HEADER, 0, 1, n.header);
+          break;
+        case Node::AND:
+        case Node::OR:
+          {
+          compile (*n.args[0]);
+          size_t jump = emit (n.op == Node::AND ? AND_JUMP : OR_JUMP, 0, 0);
+          compile (*n.args[1]);
+          emit (binary[n.op], 2, 1);
+          code[jump].b = code.size();
+          break;
+          }
+        case Node::NOT:
+          compile (*n.args[0]);
+          emit (NOT, 1, 1);
+          break;
+        case Node::NEG:
+          compile (*n.args[0]);
+          emit (NEG, 1, 1);
+          break;
+        case Node::BETWEEN:
+          compile (*n.args[0]);
+          compile (*n.args[1]);
+          compile (*n.args[2]);
+          emit (BETWEEN, 3, 1, 0, 0, n.negated);
+          break;
+        case Node::LIKE:
+          compile (*n.args[0]);
+          emit (LIKE, 1, 1, constant (Value::string (n.name)),
+            (unsigned char)n.escape, n.negated);
+          break;
+        case Node::IN:
+          {
+          compile (*n.args[0]);
+          uint16_t first = constants.size();
+          for (size_t i = 0; i < n.list.size(); i++)
+            constant (Value::string (n.list[i]));
+          emit (IN, 1, 1, first, n.list.size(), n.negated);
+          break;
+          }
+        case Node::IS_NULL:
+          compile (*n.args[0]);
+          emit (IS_NULL, 1, 1, 0, 0, n.negated);
+          break;
+        default:
+          compile (*n.args[0]);
+          compile (*n.args[1]);
+          emit (binary[n.op], 2, 1);
+          break;
+        }
+      }
+
+    /** Fill slots with the properties the program uses. */
+    void load_properties (const proton::message &m, Operand *slots) const
+      {
+      size_t n = properties.size();
+      for (size_t i = 0; i < n; i++)
+        slots[i] = unknown();
+      if (n == 0) return;
+      size_t found = 0;
+      PropertyScanner scanner (m);
+      scanner.scan ([&](std::string_view name, pn_data_t *data)
+        {
+        for (size_t i = 0; i < n; i++)
+          if (slots[i].type == Value::UNKNOWN && name == properties[i])
+            {
+            slots[i] = from_data (data);
+            // A property of a type we can't use stays unknown
+            found++;
+            break;
+            }
+        return found < n;
+        });
+      }
+
+    /** A JMS header. String headers are copied into 'text', as the C++
+          API only gives copies of them. */
+    static Operand header (const proton::message &m, Node::Header h,
+          std::string &text)
+      {
+      Operand o = unknown();
+      switch (h)
+        {
+        case Node::MESSAGE_ID:
+          if (m.id().empty()) return o;
+          text = proton::to_string (m.id());
+          break;
+        case Node::CORRELATION_ID:
+          if (m.correlation_id().empty()) return o;
+          text = proton::to_string (m.correlation_id());
+          break;
+        case Node::TYPE:
+          text = m.subject();
+          if (text.empty()) return o;
+          break;
+        case Node::PRIORITY:
+          o.type = Value::LONG;
+          o.l = m.priority();
+          return o;
+        case Node::DELIVERY_MODE:
+          o.type = Value::STRING;
+          o.s = m.durable() ? "PERSISTENT" : "NON_PERSISTENT";
+          return o;
+        case Node::TIMESTAMP:
+          o.type = Value::LONG;
+          o.l = m.creation_time().milliseconds();
+          return o;
+        case Node::EXPIRATION:
+          o.type = Value::LONG;
+          o.l = m.expiry_time().milliseconds();
+          return o;
+        }
+      o.type = Value::STRING;
+      o.s = text;
+      return o;
+      }
+
+    /** As Selector::compare: -1, 0 or 1, or 2 if a and b can't be
+          compared. */
+    static int compare (const Operand &a, const Operand &b, bool ordered)
+      {
+      if (a.numeric() && b.numeric())
+        {
+        if (a.type == Value::LONG && b.type == Value::LONG)
+          return a.l < b.l ? -1 : a.l > b.l ? 1 : 0;
+        double x = a.as_double(), y = b.as_double();
+        return x < y ? -1 : x > y ? 1 : x == y ? 0 : 2;
+        }
+      if (ordered || a.type != b.type) return 2;
+      if (a.type == Value::STRING) return a.s == b.s ? 0 : 1;
+      if (a.type == Value::BOOLEAN) return a.b == b.b ? 0 : 1;
+      return 2;
+      }
+
+    static Operand arithmetic (uint8_t op, const Operand &a,
+          const Operand &b)
+      {
+      Operand o = unknown();
+      if (!a.numeric() || !b.numeric()) return o;
+      if (a.type == Value::LONG && b.type == Value::LONG)
+        {
+        o.type = Value::LONG;
+        switch (op)
+          {
+          case ADD: o.l = a.l + b.l; break;
+          case SUB: o.l = a.l - b.l; break;
+          case MUL: o.l = a.l * b.l; break;
+          default:
+            if (b.l == 0) return unknown();
+            o.l = a.l / b.l;
+            break;
+          }
+        return o;
+        }
+      double x = a.as_double(), y = b.as_double();
+      o.type = Value::DOUBLE;
+      switch (op)
+        {
+        case ADD: o.d = x + y; break;
+        case SUB: o.d = x - y; break;
+        case MUL: o.d = x * y; break;
+        default: o.d = x / y; break;
+        }
+      return o;
+      }
+
+  public:
+    /** Parse and compile an expression. Throws std::runtime_error if it
+          isn't valid, or is too big. */
+    explicit CompiledSelector (const std::string &expression)
+      {
+      Selector tree (expression);
+      text = expression;
+      depth = max_depth = 0;
+      compile (tree.tree());
+      }
+
+    /** Compile an expression that has already been parsed. */
+    explicit CompiledSelector (const Selector &tree)
+      {
+      text = tree.expression();
+      depth = max_depth = 0;
+      compile (tree.tree());
+      }
+
+    /** The value that data is positioned on, as an operand. Types that
+          selectors can't use are unknown. */
+    static Operand from_data (pn_data_t *data)
+      {
+      Operand o = unknown();
+      switch (pn_data_type (data))
+        {
+        case PN_BOOL: o.type = Value::BOOLEAN; o.b = pn_data_get_bool (data);
+          break;
+        case PN_UBYTE: o.type = Value::LONG; o.l = pn_data_get_ubyte (data);
+          break;
+        case PN_BYTE: o.type = Value::LONG; o.l = pn_data_get_byte (data);
+          break;
+        case PN_USHORT: o.type = Value::LONG; o.l = pn_data_get_ushort (data);
+          break;
+        case PN_SHORT: o.type = Value::LONG; o.l = pn_data_get_short (data);
+          break;
+        case PN_UINT: o.type = Value::LONG; o.l = pn_data_get_uint (data);
+          break;
+        case PN_INT: o.type = Value::LONG; o.l = pn_data_get_int (data);
+          break;
+        case PN_ULONG: o.type = Value::LONG; o.l = pn_data_get_ulong (data);
+          break;
+        case PN_LONG: o.type = Value::LONG; o.l = pn_data_get_long (data);
+          break;
+        case PN_FLOAT: o.type = Value::DOUBLE; o.d = pn_data_get_float (data);
+          break;
+        case PN_DOUBLE:
+          o.type = Value::DOUBLE;
+          o.d = pn_data_get_double (data);
+          break;
+        case PN_STRING:
+          {
+          pn_bytes_t b = pn_data_get_string (data);
+          o.type = Value::STRING;
+          o.s = std::string_view (b.start, b.size);
+          break;
+          }
+        case PN_SYMBOL:
+          {
+          pn_bytes_t b = pn_data_get_symbol (data);
+          o.type = Value::STRING;
+          o.s = std::string_view (b.start, b.size);
+          break;
+          }
+        default:
+          break;
+        }
+      return o;
+      }
+
+    CompiledSelector (const CompiledSelector &) = delete;
+    CompiledSelector &operator= (const CompiledSelector &) = delete;
+
+    const std::string &expression () const { return text; }
+
+    /** The number of instructions. */
+    size_t size () const { return code.size(); }
+
+    /** Does the message match? Unknown counts as no. */
+    bool matches (const proton::message &m) const
+      {
+      Operand slots[MAX_PROPERTIES];
+      Operand stack[MAX_DEPTH];
+      // For the string headers, which come first in Node::Header
+      std::string header_text[Node::TYPE + 1];
+      load_properties (m, slots);
+      size_t sp = 0; // Next free
+      for (size_t pc = 0; pc < code.size(); pc++)
+        {
+        const Instruction &i = code[pc];
+        switch (i.op)
+          {
+          case PUSH:
+            stack[sp++] = constants[i.a];
+            break;
+          case LOAD:
+            stack[sp++] = slots[i.a];
+            break;
+          case HEADER:
+            stack[sp++] = header (m, (Node::Header)i.a,
+              header_text[i.a <= Node::TYPE ? i.a : 0]);
+            break;
+          case AND_JUMP:
+            if (stack[sp - 1].type == Value::BOOLEAN && !stack[sp - 1].b)
+              pc = i.b - 1;
+            break;
+          case OR_JUMP:
+            if (stack[sp - 1].type == Value::BOOLEAN && stack[sp - 1].b)
+              pc = i.b - 1;
+            break;
+          case AND:
+          case OR:
+            {
+            Operand &a = stack[sp - 2], &b = stack[sp - 1];
+            bool absorbing = i.op == OR;
+            if (b.type == Value::BOOLEAN && b.b == absorbing)
+              a = b;
+            else if (a.type != Value::BOOLEAN || b.type != Value::BOOLEAN)
+              a = unknown();
+            sp--;
+            break;
+            }
+          case NOT:
+            if (stack[sp - 1].type == Value::BOOLEAN)
+              stack[sp - 1].b = !stack[sp - 1].b;
+            else
+              stack[sp - 1] = unknown();
+            break;
+          case EQ: case NE: case LT: case LE: case GT: case GE:
+            {
+            int c = compare (stack[sp - 2], stack[sp - 1],
+              i.op != EQ && i.op != NE);
+            sp--;
+            bool r;
+            switch (i.op)
+              {
+              case EQ: r = c == 0; break;
+              case NE: r = c != 0; break;
+              case LT: r = c < 0; break;
+              case LE: r = c <= 0; break;
+              case GT: r = c > 0; break;
+              default: r = c >= 0; break;
+              }
+            stack[sp - 1] = c == 2 ? unknown() : boolean (r);
+            break;
+            }
+          case ADD: case SUB: case MUL: case DIV:
+            stack[sp - 2] = arithmetic (i.op, stack[sp - 2], stack[sp - 1]);
+            sp--;
+            break;
+          case NEG:
+            {
+            Operand &a = stack[sp - 1];
+            if (a.type == Value::LONG) a.l = -a.l;
+            else if (a.type == Value::DOUBLE) a.d = -a.d;
+            else a = unknown();
+            break;
+            }
+          case BETWEEN:
+            {
+            int lo = compare (stack[sp - 3], stack[sp - 2], true);
+            int hi = compare (stack[sp - 3], stack[sp - 1], true);
+            sp -= 2;
+            stack[sp - 1] = lo == 2 || hi == 2 ? unknown()
+              : boolean ((lo >= 0 && hi <= 0) != (bool)i.negated);
+            break;
+            }
+          case LIKE:
+            {
+            Operand &a = stack[sp - 1];
+            if (a.type != Value::STRING)
+              a = unknown();
+            else
+              a = boolean (Selector::like (a.s, constants[i.a].s, i.b)
+                != (bool)i.negated);
+            break;
+            }
+          case IN:
+            {
+            Operand &a = stack[sp - 1];
+            if (a.type != Value::STRING)
+              {
+              a = unknown();
+              break;
+              }
+            bool in = false;
+            for (size_t j = i.a; j < i.a + i.b && !in; j++)
+              in = a.s == constants[j].s;
+            a = boolean (in != (bool)i.negated);
+            break;
+            }
+          case IS_NULL:
+            stack[sp - 1] = boolean ((stack[sp - 1].type == Value::UNKNOWN)
+              != (bool)i.negated);
+            break;
+          }
+        }
+      return stack[0].type == Value::BOOLEAN && stack[0].b;
+      }
+
+    /** Write the program, one instruction per line, for debugging. */
+    void dump (std::ostream &out) const
+      {
+      static const char *names[] =
+        {
+        "push", "load", "header", "and_jump", "or_jump", "and", "or", "not",
+        "eq", "ne", "lt", "le", "gt", "ge", "add", "sub", "mul", "div",
+        "neg", "between", "like", "in", "is_null"
+        };
+      for (size_t pc = 0; pc < code.size(); pc++)
+        {
+        const Instruction &i = code[pc];
+        out << pc << ": " << (i.negated ? "not_" : "") << names[i.op];
+        if (i.op == LOAD) out << " " << properties[i.a];
+        else if (i.op == AND_JUMP || i.op == OR_JUMP) out << " " << i.b;
+        else if (i.op == PUSH || i.op == LIKE || i.op == IN)
+          {
+          const Operand &c = constants[i.a];
+          switch (c.type)
+            {
+            case Value::BOOLEAN: out << (c.b ? " TRUE" : " FALSE"); break;
+            case Value::LONG: out << " " << c.l; break;
+            case Value::DOUBLE: out << " " << c.d; break;
+            case Value::STRING: out << " '" << c.s << "'"; break;
+            default: out << " NULL"; break;
+            }
+          if (i.op == IN && i.b > 1) out << " (+" << i.b - 1 << ")";
+          }
+        out << std::endl;
+        }
+      }
+  };
+
+#endif
@@ -0,0 +1,669 @@
+/*
+  selector_batch.hpp
+
+  BatchSelector evaluates a JMS selector (see selector.hpp) for a batch of
+    up to 256 messages at a time, rather than one message at a time. It's
+    for a receiver on a fast stream that filters locally, and can afford
+    to hold messages for a moment before it hands them on.
+
+  The properties and headers that the selector uses are first copied out
+    of the batch into columns -- one array of values per property, with a
+    bit mask per type saying which messages have a value of that type.
+    Then each node of the expression is evaluated for the whole batch at
+    once, giving two masks: the messages for which the node is true, and
+    those for which it is false (a message in neither is 'unknown', as in
+    SQL). AND, OR and NOT are just bitwise operations on the masks.
+
+  A comparison of a property with a constant -- '=', '<>', '<', '<=',
+    '>', '>=', BETWEEN, IN -- compares a whole column with the constant,
+    with SIMD instructions where the processor has them: AVX2 compares
+    four values per instruction, SSE4.2 two. Which to use is decided when
+    the program starts, and there is always a plain C++ fallback (also
+    used on other architectures). Strings are compared by their first
+    eight bytes and their length, as integers, and only the strings
+    longer than that which pass are compared in full. Anything else -- a
+    comparison of two properties, arithmetic, the string JMS headers --
+    is evaluated message by message, by walking the tree (Selector), so
+    every expression gives the same results as Selector does.
+
+  A BatchSelector keeps its columns between batches, so it allocates
+    nothing after it's created, but it isn't thread-safe: use one per
+    thread. The views of strings in the columns are of the messages, which
+    must stay alive and unmodified during match().
+*/
+
+#ifndef SELECTOR_BATCH_HPP
+#define SELECTOR_BATCH_HPP
+
+#include <proton/message.hpp>
+#include <unordered_map>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SELECTOR_BATCH_X86
+#endif
+
+#include "selector.hpp"
+
+class BatchSelector
+  {
+  public:
+    static const size_t BATCH = 256;
+    static const size_t WORDS = BATCH / 64;
+
+    /*
+     * Mask has a bit for each message in a batch.
+     */
+    struct Mask
+      {
+      uint64_t w[WORDS];
+
+      void clear () { for (size_t i = 0; i < WORDS; i++) w[i] = 0; }
+      bool test (size_t i) const { return (w[i / 64] >> (i % 64)) & 1; }
+      void set (size_t i) { w[i / 64] |= (uint64_t)1 << (i % 64); }
+      size_t count () const
+        {
+        size_t n = 0;
+        for (size_t i = 0; i < WORDS; i++) n += __builtin_popcountll (w[i]);
+        return n;
+        }
+      };
+
+    // The instructions the column comparisons use
+    enum Kernels { SCALAR, SSE42, AVX2 };
+
+    /** The best kernels this processor can run. */
+    static Kernels best_kernels ()
+      {
+#ifdef SELECTOR_BATCH_X86
+      __builtin_cpu_init();
+      if (__builtin_cpu_supports ("avx2")) return AVX2;
+      if (__builtin_cpu_supports ("sse4.2")) return SSE42;
+#endif
+      return SCALAR;
+      }
+
+    static const char *kernels_name (Kernels k)
+      {
+      return k == AVX2 ? "AVX2" : k == SSE42 ? "SSE4.2" : "scalar";
+      }
+
+  protected:
+    typedef Selector::Node Node;
+    typedef Selector::Value Value;
+    typedef CompiledSelector::Operand Operand;
+
+    enum Compare { EQUAL, LESS, GREATER };
+
+    /*
+     * Truth is the result of a node for the batch. A message is in at
+     *   most one of the masks; in neither, the result is unknown.
+     */
+    struct Truth
+      {
+      Mask t, f;
+      };
+
+    /*
+     * Column holds the values of one property, or header, for the batch.
+     *   The masks say which messages have a value, and of which type.
+     */
+    struct Column
+      {
+      bool header;
+      Node::Header which; // If header
+      std::string name; // If not
+      Mask longs, doubles, nans, strings, booleans, present;
+      int64_t l[BATCH]; // LONG values; string lengths; booleans as 0 or 1
+      double d[BATCH]; // LONG and DOUBLE values, as doubles
+      int64_t prefix[BATCH]; // The first 8 bytes of strings, 0-padded
+      std::string_view s[BATCH];
+      };
+
+    typedef uint64_t (*IntKernel) (const int64_t *x, int64_t k);
+    typedef uint64_t (*DoubleKernel) (const double *x, double k);
+
+    Selector selector;
+    std::vector<std::unique_ptr<Column>> columns;
+    size_t property_columns; // The first columns; the rest are headers
+    std::unordered_map<const Node*, Column*> column_of;
+    Kernels kernels;
+    IntKernel int_kernels[3];
+    DoubleKernel double_kernels[3];
+    // The batch being matched
+    const proton::message *messages;
+    size_t rows;
+    size_t words;
+    Mask all;
+
+    // Each kernel compares 64 values with k, and returns a bit for each
+
+    template <int C> static uint64_t scalar_int (const int64_t *x, int64_t k)
+      {
+      uint64_t bits = 0;
+      for (size_t j = 0; j < 64; j++)
+        bits |= (uint64_t)(C == EQUAL ? x[j] == k
+          : C == LESS ? x[j] < k : x[j] > k) << j;
+      return bits;
+      }
+
+    template <int C> static uint64_t scalar_double (const double *x, double k)
+      {
+      uint64_t bits = 0;
+      for (size_t j = 0; j < 64; j++)
+        bits |= (uint64_t)(C == EQUAL ? x[j] == k
+          : C == LESS ? x[j] < k : x[j] > k) << j;
+      return bits;
+      }
+
+#ifdef SELECTOR_BATCH_X86
+    template <int C> __attribute__ ((target ("avx2")))
+    static uint64_t avx2_int (const int64_t *x, int64_t k)
+      {
+      __m256i kk = _mm256_set1_epi64x (k);
+      uint64_t bits = 0;
+      for (size_t j = 0; j < 64; j += 4)
+        {
+        __m256i v = _mm256_loadu_si256 ((const __m256i *)(x + j));
+        __m256i r = C == EQUAL ? _mm256_cmpeq_epi64 (v, kk)
+          : C == LESS ? _mm256_cmpgt_epi64 (kk, v) : _mm256_cmpgt_epi64 (v, kk);
+        bits |= (uint64_t)_mm256_movemask_pd (_mm256_castsi256_pd (r)) << j;
+        }
+      return bits;
+      }
+
+    template <int C> __attribute__ ((target ("avx2")))
+    static uint64_t avx2_double (const double *x, double k)
+      {
+      __m256d kk = _mm256_set1_pd (k);
+      uint64_t bits = 0;
+      for (size_t j = 0; j < 64; j += 4)
+        {
+        __m256d v = _mm256_loadu_pd (x + j);
+        __m256d r = C == EQUAL ? _mm256_cmp_pd (v, kk, _CMP_EQ_OQ)
+          : C == LESS ? _mm256_cmp_pd (v, kk, _CMP_LT_OQ)
+          : _mm256_cmp_pd (v, kk, _CMP_GT_OQ);
+        bits |= (uint64_t)_mm256_movemask_pd (r) << j;
+        }
+      return bits;
+      }
+
+    template <int C> __attribute__ ((target ("sse4.2")))
+    static uint64_t sse42_int (const int64_t *x, int64_t k)
+      {
+      __m128i kk = _mm_set1_epi64x (k);
+      uint64_t bits = 0;
+      for (size_t j = 0; j < 64; j += 2)
+        {
+        __m128i v = _mm_loadu_si128 ((const __m128i *)(x + j));
+        __m128i r = C == EQUAL ? _mm_cmpeq_epi64 (v, kk)
+          : C == LESS ? _mm_cmpgt_epi64 (kk, v) : _mm_cmpgt_epi64 (v, kk);
+        bits |= (uint64_t)_mm_movemask_pd (_mm_castsi128_pd (r)) << j;
+        }
+      return bits;
+      }
+
+    template <int C> __attribute__ ((target ("sse4.2")))
+    static uint64_t sse42_double (const double *x, double k)
+      {
+      __m128d kk = _mm_set1_pd (k);
+      uint64_t bits = 0;
+      for (size_t j = 0; j < 64; j += 2)
+        {
+        __m128d v = _mm_loadu_pd (x + j);
+        __m128d r = C == EQUAL ? _mm_cmpeq_pd (v, kk)
+          : C == LESS ? _mm_cmplt_pd (v, kk) : _mm_cmpgt_pd (v, kk);
+        bits |= (uint64_t)_mm_movemask_pd (r) << j;
+        }
+      return bits;
+      }
+#endif
+
+    /** Compare a column with k, by one of the basic comparisons. */
+    void basic (const int64_t *x, int64_t k, Compare c, Mask &out) const
+      {
+      for (size_t w = 0; w < words; w++)
+        out.w[w] = int_kernels[c] (x + w * 64, k);
+      }
+
+    void basic (const double *x, double k, Compare c, Mask &out) const
+      {
+      for (size_t w = 0; w < words; w++)
+        out.w[w] = double_kernels[c] (x + w * 64, k);
+      }
+
+    /** Compare a column with k, by any comparison operator. */
+    template <class T>
+    void relation (const T *x, T k, Node::Op op, Mask &out) const
+      {
+      bool invert = op == Node::NE || op == Node::LE || op == Node::GE;
+      Compare c = op == Node::EQ || op == Node::NE ? EQUAL
+        : op == Node::LT || op == Node::GE ? LESS : GREATER;
+      basic (x, k, c, out);
+      if (invert)
+        for (size_t w = 0; w < words; w++) out.w[w] = ~out.w[w];
+      }
+
+    static int64_t prefix_of (std::string_view s)
+      {
+      int64_t p = 0;
+      memcpy (&p, s.data(), s.size() < 8 ? s.size() : 8);
+      return p;
+      }
+
+    /** The messages whose value is the string s. */
+    void string_equal (const Column &c, std::string_view s, Mask &out) const
+      {
+      Mask lengths;
+      basic (c.prefix, prefix_of (s), EQUAL, out);
+      basic (c.l, (int64_t)s.size(), EQUAL, lengths);
+      for (size_t w = 0; w < words; w++)
+        {
+        uint64_t bits = out.w[w] & lengths.w[w] & c.strings.w[w];
+        if (s.size() > 8)
+          for (uint64_t rest = bits; rest; rest &= rest - 1)
+            {
+            size_t i = w * 64 + __builtin_ctzll (rest);
+            if (memcmp (c.s[i].data() + 8, s.data() + 8, s.size() - 8))
+              bits &= ~((uint64_t)1 << (i % 64));
+            }
+        out.w[w] = bits;
+        }
+      }
+
+    /** Set the result of a comparison, given the messages for which it
+          can be decided, and those for which it holds. */
+    void decided (const Mask &known, const Mask &holds, Truth &r) const
+      {
+      for (size_t w = 0; w < words; w++)
+        {
+        r.t.w[w] = known.w[w] & holds.w[w];
+        r.f.w[w] = known.w[w] & ~holds.w[w];
+        }
+      }
+
+    /** column op literal, by the rules of Selector::compare(). */
+    Truth compare (const Column &c, Node::Op op, const Value &v) const
+      {
+      Truth r;
+      r.t.clear();
+      r.f.clear();
+      Mask known, holds, part;
+      known.clear();
+      holds.clear();
+      bool ordered = op != Node::EQ && op != Node::NE;
+      if (v.numeric())
+        {
+        // Nothing is equal to, or more or less than, NaN
+        if (std::isnan (v.as_double())) return r;
+        if (v.type == Value::LONG)
+          {
+          relation (c.l, v.l, op, holds);
+          relation (c.d, (double)v.l, op, part);
+          for (size_t w = 0; w < words; w++)
+            holds.w[w] = (holds.w[w] & c.longs.w[w])
+              | (part.w[w] & c.doubles.w[w]);
+          }
+        else
+          relation (c.d, v.d, op, holds);
+        for (size_t w = 0; w < words; w++)
+          known.w[w] = c.longs.w[w] | c.doubles.w[w];
+        }
+      else if (!ordered && v.type == Value::STRING)
+        {
+        string_equal (c, v.s, holds);
+        if (op == Node::NE)
+          for (size_t w = 0; w < words; w++) holds.w[w] = ~holds.w[w];
+        known = c.strings;
+        }
+      else if (!ordered && v.type == Value::BOOLEAN)
+        {
+        relation (c.l, (int64_t)v.b, op, holds);
+        known = c.booleans;
+        }
+      decided (known, holds, r);
+      return r;
+      }
+
+    /** The column for a node, if it has one. */
+    Column *column (const Node &n) const
+      {
+      std::unordered_map<const Node*, Column*>::const_iterator i
+        = column_of.find (&n);
+      return i == column_of.end() ? 0 : i->second;
+      }
+
+    /** Make columns for the properties and headers the tree uses. */
+    void plan (const Node &n)
+      {
+      for (size_t i = 0; i < n.args.size(); i++)
+        plan (*n.args[i]);
+      bool header = n.op == Node::HEADER;
+      if (n.op != Node::PROPERTY && !header) return;
+      // Only the headers that can be read without a copy
+      if (header && n.header != Node::PRIORITY && n.header != Node::TIMESTAMP
+          && n.header != Node::EXPIRATION && n.header != Node::DELIVERY_MODE)
+        return;
+      for (size_t i = 0; i < columns.size(); i++)
+        if (columns[i]->header == header && (header
+            ? columns[i]->which == n.header : columns[i]->name == n.name))
+          {
+          column_of[&n] = columns[i].get();
+          return;
+          }
+      std::unique_ptr<Column> c (new Column());
+      c->header = header;
+      c->which = n.header;
+      c->name = n.name;
+      column_of[&n] = c.get();
+      // Keep the properties first, so that loading can stop at them
+      if (header)
+        columns.push_back (std::move (c));
+      else
+        {
+        columns.insert (columns.begin() + property_columns, std::move (c));
+        property_columns++;
+        }
+      }
+
+    static void put (Column &c, size_t i, const Operand &o)
+      {
+      switch (o.type)
+        {
+        case Value::BOOLEAN:
+          c.booleans.set (i);
+          c.l[i] = o.b;
+          break;
+        case Value::LONG:
+          c.longs.set (i);
+          c.l[i] = o.l;
+          c.d[i] = (double)o.l;
+          break;
+        case Value::DOUBLE:
+          if (std::isnan (o.d))
+            c.nans.set (i);
+          else
+            c.doubles.set (i);
+          c.d[i] = o.d;
+          break;
+        case Value::STRING:
+          c.strings.set (i);
+          c.s[i] = o.s;
+          c.l[i] = o.s.size();
+          c.prefix[i] = prefix_of (o.s);
+          break;
+        default:
+          // A property of a type selectors can't use is null
+          return;
+        }
+      c.present.set (i);
+      }
+
+    /** Fill the columns from the batch. */
+    void load ()
+      {
+      for (size_t i = 0; i < columns.size(); i++)
+        {
+        Column &c = *columns[i];
+        c.longs.clear();
+        c.doubles.clear();
+        c.nans.clear();
+        c.strings.clear();
+        c.booleans.clear();
+        c.present.clear();
+        }
+      for (size_t i = 0; i < rows; i++)
+        {
+        const proton::message &m = messages[i];
+        if (property_columns)
+          {
+          PropertyScanner scanner (m);
+          size_t found = 0;
+          scanner.scan ([&](std::string_view name, pn_data_t *data)
+            {
+            for (size_t j = 0; j < property_columns; j++)
+              {
+              Column &c = *columns[j];
+              // The first of duplicate properties wins, as in Selector
+              if (!c.present.test (i) && name == c.name)
+                {
+                put (c, i, CompiledSelector::from_data (data));
+                found++;
+                break;
+                }
+              }
+            return found < property_columns;
+            });
+          }
+        for (size_t j = property_columns; j < columns.size(); j++)
+          {
+          Column &c = *columns[j];
+          Operand o;
+          o.type = Value::LONG;
+          switch (c.which)
+            {
+            case Node::PRIORITY: o.l = m.priority(); break;
+            case Node::TIMESTAMP: o.l = m.creation_time().milliseconds();
+              break;
+            case Node::EXPIRATION: o.l = m.expiry_time().milliseconds();
+              break;
+            default:
+              o.type = Value::STRING;
+              o.s = m.durable() ? "PERSISTENT" : "NON_PERSISTENT";
+              break;
+            }
+          put (c, i, o);
+          }
+        }
+      }
+
+    /** Evaluate a node for the batch, one message at a time. */
+    Truth one_by_one (const Node &n) const
+      {
+      Truth r;
+      r.t.clear();
+      r.f.clear();
+      for (size_t i = 0; i < rows; i++)
+        {
+        Value v = Selector::evaluate (n, messages[i]);
+        if (v.is_true()) r.t.set (i);
+        if (v.is_false()) r.f.set (i);
+        }
+      return r;
+      }
+
+    static bool literal (const Node &n) { return n.op == Node::LITERAL; }
+
+    /** Evaluate a node for the whole batch. */
+    Truth evaluate (const Node &n) const
+      {
+      Truth r;
+      r.t.clear();
+      r.f.clear();
+      Column *c = n.args.empty() ? 0 : column (*n.args[0]);
+      switch (n.op)
+        {
+        case Node::LITERAL:
+          if (n.value.type == Value::BOOLEAN)
+            (n.value.b ? r.t : r.f) = all;
+          return r;
+        case Node::PROPERTY:
+          {
+          // A property is true or false only if it's a boolean
+          Column *p = column (n);
+          Mask ones;
+          basic (p->l, 1, EQUAL, ones);
+          decided (p->booleans, ones, r);
+          return r;
+          }
+        case Node::AND: case Node::OR:
+          {
+          Truth a = evaluate (*n.args[0]), b = evaluate (*n.args[1]);
+          bool and_ = n.op == Node::AND;
+          for (size_t w = 0; w < words; w++)
+            {
+            r.t.w[w] = and_ ? a.t.w[w] & b.t.w[w] : a.t.w[w] | b.t.w[w];
+            r.f.w[w] = and_ ? a.f.w[w] | b.f.w[w] : a.f.w[w] & b.f.w[w];
+            }
+          return r;
+          }
+        case Node::NOT:
+          {
+          Truth a = evaluate (*n.args[0]);
+          r.t = a.f;
+          r.f = a.t;
+          return r;
+          }
+        case Node::EQ: case Node::NE:
+        case Node::LT: case Node::LE: case Node::GT: case Node::GE:
+          {
+          if (c && literal (*n.args[1]))
+            return compare (*c, n.op, n.args[1]->value);
+          Column *right = column (*n.args[1]);
+          if (!right || !literal (*n.args[0])) break;
+          // Turn 'literal op column' round
+          static const Node::Op flipped[] = { Node::EQ, Node::NE,
+            Node::GT, Node::GE, Node::LT, Node::LE };
+          return compare (*right, flipped[n.op - Node::EQ],
+            n.args[0]->value);
+          }
+        case Node::BETWEEN:
+          {
+          if (!c || !literal (*n.args[1]) || !literal (*n.args[2])) break;
+          Truth lo = compare (*c, Node::GE, n.args[1]->value);
+          Truth hi = compare (*c, Node::LE, n.args[2]->value);
+          Mask known, in;
+          for (size_t w = 0; w < words; w++)
+            {
+            known.w[w] = (lo.t.w[w] | lo.f.w[w]) & (hi.t.w[w] | hi.f.w[w]);
+            in.w[w] = lo.t.w[w] & hi.t.w[w];
+            if (n.negated) in.w[w] = ~in.w[w];
+            }
+          decided (known, in, r);
+          return r;
+          }
+        case Node::IN:
+          {
+          if (!c) break;
+          Mask in, one;
+          in.clear();
+          for (size_t i = 0; i < n.list.size(); i++)
+            {
+            string_equal (*c, n.list[i], one);
+            for (size_t w = 0; w < words; w++) in.w[w] |= one.w[w];
+            }
+          if (n.negated)
+            for (size_t w = 0; w < words; w++) in.w[w] = ~in.w[w];
+          decided (c->strings, in, r);
+          return r;
+          }
+        case Node::LIKE:
+          {
+          if (!c) break;
+          for (size_t i = 0; i < rows; i++)
+            if (c->strings.test (i))
+              {
+              if (Selector::like (c->s[i], n.name, n.escape) != n.negated)
+                r.t.set (i);
+              else
+                r.f.set (i);
+              }
+          return r;
+          }
+        case Node::IS_NULL:
+          {
+          if (!c) break;
+          Mask null;
+          for (size_t w = 0; w < words; w++)
+            null.w[w] = all.w[w] & ~c->present.w[w];
+          decided (all, n.negated ? c->present : null, r);
+          return r;
+          }
+        default:
+          // Headers, and arithmetic, are never true or false
+          return r;
+        }
+      return one_by_one (n);
+      }
+
+  public:
+    /** Parse the expression. Throws std::runtime_error if it isn't
+          valid. */
+    explicit BatchSelector (const std::string &expression,
+          Kernels kernels = best_kernels())
+        : selector (expression)
+      {
+      this->property_columns = 0;
+      this->messages = 0;
+      this->rows = this->words = 0;
+      plan (selector.tree());
+      use (kernels);
+      }
+
+    BatchSelector (const BatchSelector &) = delete;
+    BatchSelector &operator= (const BatchSelector &) = delete;
+
+    const std::string &expression () const { return selector.expression(); }
+
+    Kernels kernels_used () const { return kernels; }
+
+    /** Use other kernels -- to compare them. Ones that this processor
+          can't run are replaced by the best that it can. */
+    void use (Kernels k)
+      {
+      if (k > best_kernels()) k = best_kernels();
+      kernels = k;
+      int_kernels[EQUAL] = scalar_int<EQUAL>;
+      int_kernels[LESS] = scalar_int<LESS>;
+      int_kernels[GREATER] = scalar_int<GREATER>;
+      double_kernels[EQUAL] = scalar_double<EQUAL>;
+      double_kernels[LESS] = scalar_double<LESS>;
+      double_kernels[GREATER] = scalar_double<GREATER>;
+#ifdef SELECTOR_BATCH_X86
+      if (k == AVX2)
+        {
+        int_kernels[EQUAL] = avx2_int<EQUAL>;
+        int_kernels[LESS] = avx2_int<LESS>;
+        int_kernels[GREATER] = avx2_int<GREATER>;
+        double_kernels[EQUAL] = avx2_double<EQUAL>;
+        double_kernels[LESS] = avx2_double<LESS>;
+        double_kernels[GREATER] = avx2_double<GREATER>;
+        }
+      else if (k == SSE42)
+        {
+        int_kernels[EQUAL] = sse42_int<EQUAL>;
+        int_kernels[LESS] = sse42_int<LESS>;
+        int_kernels[GREATER] = sse42_int<GREATER>;
+        double_kernels[EQUAL] = sse42_double<EQUAL>;
+        double_kernels[LESS] = sse42_double<LESS>;
+        double_kernels[GREATER] = sse42_double<GREATER>;
+        }
+#endif
+      }
+
+    /** Set a bit in 'matched' for each of messages[0] to messages[n - 1]
+          that matches; n must be no more than BATCH. Unknown counts as
+          no. */
+    void match (const proton::message *messages, size_t n, Mask &matched)
+      {
+      if (n > BATCH) throw std::runtime_error ("Batch is too big");
+      this->messages = messages;
+      this->rows = n;
+      this->words = (n + 63) / 64;
+      all.clear();
+      for (size_t i = 0; i < n; i++) all.set (i);
+      load();
+      matched = evaluate (selector.tree()).t;
+      for (size_t w = 0; w < WORDS; w++) matched.w[w] &= all.w[w];
+      this->messages = 0;
+      }
+  };
+
+#endif
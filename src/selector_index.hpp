@@ -0,0 +1,362 @@
+/*
+  selector_index.hpp
+
+  SelectorIndex holds a large number of JMS selectors -- one per logical
+    subscription -- and finds the ones that a message matches, without
+    evaluating all of them. It's for an application that takes every
+    message from one unfiltered link, and hands each message to the
+    subscriptions that want it (see receive_demux.cpp), rather than
+    opening a filtered link per subscription, which puts the load on the
+    broker.
+
+  Most real selectors test some property for equality with a constant
+    ("region = 'eu' AND price > 100", "type IN ('a', 'b')"). When a
+    selector is added, the index looks among the conditions that are
+    ANDed together at its top level for one like that: property = literal,
+    property IN (...), or just a boolean property on its own. The selector
+    goes into a hash bucket keyed by the property and the value (or
+    values) that would satisfy the condition. A selector with no such
+    condition goes on a list that is checked for every message.
+
+  To match a message, the index makes one pass over its properties. For
+    each property that some bucket is keyed on, it looks up the message's
+    value, and the selectors in that bucket are the candidates; only
+    these, and the unindexed ones, are evaluated in full. With selectors
+    spread across the values of a few properties, the cost per message
+    depends on the number of candidates, not on the number of selectors.
+
+  Selectors are compiled (see CompiledSelector in selector.hpp), and the
+    work space for matching is kept between calls, so matching allocates
+    nothing once the index has warmed up. SelectorIndex is not
+    thread-safe -- use it on one thread, usually the link's.
+*/
+
+#ifndef SELECTOR_INDEX_HPP
+#define SELECTOR_INDEX_HPP
+
+#include <proton/message.hpp>
+#include <unordered_map>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <algorithm>
+#include <cmath>
+
+#include "selector.hpp"
+
+class SelectorIndex
+  {
+  public:
+    typedef size_t Id;
+
+  protected:
+    typedef Selector::Node Node;
+    typedef Selector::Value Value;
+    typedef CompiledSelector::Operand Operand;
+
+    /*
+     * Buckets holds the selectors that need one property to have a
+     *   particular value, by that value.
+     */
+    struct Buckets
+      {
+      std::unordered_map<std::string_view, std::vector<Id>> strings;
+      std::unordered_map<int64_t, std::vector<Id>> integers;
+      std::vector<Id> booleans[2];
+      };
+
+    /*
+     * Entry is one selector, and where it has been indexed, so that it
+     *   can be removed.
+     */
+    struct Entry
+      {
+      std::unique_ptr<CompiledSelector> program; // Null if removed
+      Buckets *buckets; // Null if not indexed
+      std::vector<Value> keys;
+      };
+
+    std::vector<Entry> entries; // By Id
+    std::vector<Id> free_ids;
+    std::unordered_map<std::string_view, std::unique_ptr<Buckets>> by_property;
+    std::vector<Id> unindexed;
+    // Bucket keys point into these, so they must never move
+    std::deque<std::string> names;
+    size_t count;
+    std::vector<Id> candidates; // Work space for match()
+
+    /** Keep a copy of s that will outlive the index's use of it. */
+    std::string_view intern (const std::string &s)
+      {
+      names.push_back (s);
+      return names.back();
+      }
+
+    /** The key under which a numeric value is filed, if it has one. Only
+          whole numbers are, so that 2 and 2.0 land in the same place. */
+    static bool integer_key (Value::Type type, int64_t l, double d,
+          int64_t &key)
+      {
+      if (type == Value::LONG)
+        {
+        key = l;
+        return true;
+        }
+      if (type != Value::DOUBLE || d != std::floor (d) || std::fabs (d) > 9e18)
+        return false;
+      key = (int64_t)d;
+      return true;
+      }
+
+    static bool integer_key (const Value &v, int64_t &key)
+      {
+      return integer_key (v.type, v.l, v.d, key);
+      }
+
+    static bool indexable (const Value &v)
+      {
+      int64_t key;
+      return v.type == Value::STRING || v.type == Value::BOOLEAN
+        || integer_key (v, key);
+      }
+
+    static void conjuncts (const Node &n, std::vector<const Node*> &out)
+      {
+      if (n.op == Node::AND)
+        {
+        conjuncts (*n.args[0], out);
+        conjuncts (*n.args[1], out);
+        }
+      else
+        out.push_back (&n);
+      }
+
+    /** If the condition can only be true when one property has one of a
+          few values, set the property's name and the values. */
+    static bool equality (const Node &c, std::string &property,
+          std::vector<Value> &values)
+      {
+      values.clear();
+      if (c.op == Node::PROPERTY)
+        {
+        property = c.name;
+        values.push_back (Value::boolean (true));
+        return true;
+        }
+      if (c.op == Node::EQ)
+        {
+        for (size_t i = 0; i < 2; i++)
+          {
+          const Node &p = *c.args[i], &l = *c.args[1 - i];
+          if (p.op == Node::PROPERTY && l.op == Node::LITERAL
+              && indexable (l.value))
+            {
+            property = p.name;
+            values.push_back (l.value);
+            return true;
+            }
+          }
+        }
+      if (c.op == Node::IN && !c.negated && c.args[0]->op == Node::PROPERTY)
+        {
+        property = c.args[0]->name;
+        for (size_t i = 0; i < c.list.size(); i++)
+          if (std::find (c.list.begin(), c.list.begin() + i, c.list[i])
+              == c.list.begin() + i)
+            values.push_back (Value::string (c.list[i]));
+        return true;
+        }
+      return false;
+      }
+
+    /** The bucket for a value. If there isn't one, it is created, or
+          null returned, according to 'create'. */
+    std::vector<Id> *bucket (Buckets &b, const Value &v, bool create)
+      {
+      int64_t key;
+      if (v.type == Value::BOOLEAN) return &b.booleans[v.b];
+      if (v.type == Value::STRING)
+        {
+        std::unordered_map<std::string_view, std::vector<Id>>::iterator i
+          = b.strings.find (v.s);
+        if (i == b.strings.end())
+          {
+          if (!create) return 0;
+          i = b.strings.emplace (intern (v.s), std::vector<Id>()).first;
+          }
+        return &i->second;
+        }
+      if (!integer_key (v, key)) return 0;
+      std::unordered_map<int64_t, std::vector<Id>>::iterator i
+        = b.integers.find (key);
+      if (i == b.integers.end())
+        {
+        if (!create) return 0;
+        i = b.integers.emplace (key, std::vector<Id>()).first;
+        }
+      return &i->second;
+      }
+
+    /** Add the candidates for a message property's value. */
+    void candidates_for (const Buckets &b, const Operand &o)
+      {
+      const std::vector<Id> *ids = 0;
+      switch (o.type)
+        {
+        case Value::BOOLEAN:
+          ids = &b.booleans[o.b];
+          break;
+        case Value::STRING:
+          {
+          std::unordered_map<std::string_view, std::vector<Id>>::
+            const_iterator i = b.strings.find (o.s);
+          if (i != b.strings.end()) ids = &i->second;
+          break;
+          }
+        case Value::LONG:
+        case Value::DOUBLE:
+          {
+          int64_t key;
+          if (!integer_key (o.type, o.type == Value::LONG ? o.l : 0,
+              o.type == Value::DOUBLE ? o.d : 0, key))
+            break;
+          std::unordered_map<int64_t, std::vector<Id>>::const_iterator i
+            = b.integers.find (key);
+          if (i != b.integers.end()) ids = &i->second;
+          break;
+          }
+        default:
+          break;
+        }
+      if (ids) candidates.insert (candidates.end(), ids->begin(), ids->end());
+      }
+
+  public:
+    SelectorIndex () : count (0) {}
+
+    /** Add a selector, and return its ID. Throws std::runtime_error if
+          the selector isn't valid. */
+    Id add (const std::string &expression)
+      {
+      Selector tree (expression);
+      Entry e;
+      e.program.reset (new CompiledSelector (tree));
+      e.buckets = 0;
+
+      // Choose the condition to index on. A property that is already
+      //   indexed is better, as the index looks up fewer properties
+      std::vector<const Node*> cs;
+      conjuncts (tree.tree(), cs);
+      std::string property, p;
+      std::vector<Value> values, v;
+      bool found = false;
+      for (size_t i = 0; i < cs.size(); i++)
+        {
+        if (!equality (*cs[i], p, v)) continue;
+        bool known = by_property.find (p) != by_property.end();
+        if (!found || known)
+          {
+          property = p;
+          values = v;
+          found = true;
+          }
+        if (known) break;
+        }
+
+      Id id;
+      if (free_ids.empty())
+        {
+        id = entries.size();
+        entries.push_back (Entry());
+        }
+      else
+        {
+        id = free_ids.back();
+        free_ids.pop_back();
+        }
+      if (!found)
+        unindexed.push_back (id);
+      else
+        {
+        std::unordered_map<std::string_view, std::unique_ptr<Buckets>>::
+          iterator i = by_property.find (property);
+        if (i == by_property.end())
+          i = by_property.emplace (intern (property),
+            std::unique_ptr<Buckets> (new Buckets)).first;
+        e.buckets = i->second.get();
+        for (size_t j = 0; j < values.size(); j++)
+          {
+          bucket (*e.buckets, values[j], true)->push_back (id);
+          }
+        e.keys = values;
+        }
+      entries[id] = std::move (e);
+      count++;
+      return id;
+      }
+
+    /** Remove a selector. Its ID may be reused. */
+    void remove (Id id)
+      {
+      if (id >= entries.size() || !entries[id].program) return;
+      Entry &e = entries[id];
+      if (!e.buckets)
+        unindexed.erase (std::find (unindexed.begin(), unindexed.end(), id));
+      else
+        {
+        // Empty buckets, and their interned keys, are kept for reuse
+        for (size_t i = 0; i < e.keys.size(); i++)
+          {
+          std::vector<Id> *ids = bucket (*e.buckets, e.keys[i], false);
+          if (ids) ids->erase (std::find (ids->begin(), ids->end(), id));
+          }
+        }
+      e.program.reset();
+      e.buckets = 0;
+      e.keys.clear();
+      free_ids.push_back (id);
+      count--;
+      }
+
+    size_t size () const { return count; }
+
+    /** The number of selectors that can't be indexed, and are evaluated
+          for every message. */
+    size_t unindexed_count () const { return unindexed.size(); }
+
+    const CompiledSelector &selector (Id id) const
+      {
+      return *entries[id].program;
+      }
+
+    /** Find the selectors that the message matches, in no particular
+          order. Returns the number that had to be evaluated. */
+    size_t match (const proton::message &m, std::vector<Id> &out)
+      {
+      out.clear();
+      candidates.clear();
+      if (!by_property.empty())
+        {
+        PropertyScanner scanner (m);
+        scanner.scan ([this](std::string_view name, pn_data_t *data)
+          {
+          std::unordered_map<std::string_view, std::unique_ptr<Buckets>>::
+            const_iterator i = by_property.find (name);
+          if (i != by_property.end())
+            candidates_for (*i->second, CompiledSelector::from_data (data));
+          return true;
+          });
+        }
+      for (size_t i = 0; i < candidates.size(); i++)
+        if (entries[candidates[i]].program->matches (m))
+          out.push_back (candidates[i]);
+      for (size_t i = 0; i < unindexed.size(); i++)
+        if (entries[unindexed[i]].program->matches (m))
+          out.push_back (unindexed[i]);
+      return candidates.size() + unindexed.size();
+      }
+  };
+
+#endif
@@ -0,0 +1,267 @@
+/*
+  selector_shard.hpp
+
+  ShardedSubscription splits one logical subscription -- an address and a
+    JMS selector -- into N receivers, each on its own connection, so that
+    one queue can be consumed by N container threads in parallel. Each
+    receiver's selector is the user's selector ANDed with a partition
+    clause, and the clauses are written so that, for any message, exactly
+    one of them is true: no message goes to two shards, and none is left
+    on the queue because no shard will take it.
+
+  JMS selectors have no hash function, and no MOD operator, so the
+    partition has to be made from what they do have. Two ways are
+    offered:
+
+    PROPERTY   an integer property, such as a sequence number or a hash
+               that the producer has set: shard i takes the messages for
+               which the property modulo N is i. The modulo is written as
+               'p - p / N * N', which relies on integer division; as in
+               C++, the result is negative for a negative p, so the
+               clause checks for both i and i - N.
+
+    MESSAGE_ID the last character of the message ID. Shard i takes the
+               IDs that end in the hex digits d (either case) for which
+               d % N is i. This suits UUIDs and random hex IDs; sequential
+               IDs are spread evenly, too. Since it only uses 16
+               characters, more than 16 shards are pointless.
+
+  In both, shard 0 is the complement of the others -- it takes anything
+    that no other shard would, including messages without the property,
+    or with an ID that doesn't end in a hex digit. The one thing no shard
+    takes, with PROPERTY, is a message whose property is a string, since
+    arithmetic on a string is 'unknown' in a selector, and so is its
+    negation.
+
+  All of this needs a broker that applies selectors. If a broker ignores
+    the filter, every shard would get every message, so a shard whose
+    filter isn't echoed back by the broker closes its connection.
+
+  The receivers are spread over the container's threads only in the sense
+    that each has its own connection, and Proton never runs two events
+    for one connection at once; run the container with at least N threads
+    to get N-way parallelism. The callback runs on the shard's connection
+    thread, so it must be thread-safe. The delivery is accepted when it
+    returns, unless the subscription is made with auto_accept off, in
+    which case the callback must settle it -- for example, to release
+    messages that arrive after it has had all it wants, rather than
+    consuming them.
+*/
+
+#ifndef SELECTOR_SHARD_HPP
+#define SELECTOR_SHARD_HPP
+
+#include <proton/connection.hpp>
+#include <proton/connection_options.hpp>
+#include <proton/container.hpp>
+#include <proton/delivery.hpp>
+#include <proton/message.hpp>
+#include <proton/messaging_handler.hpp>
+#include <proton/receiver.hpp>
+#include <proton/receiver_options.hpp>
+#include <proton/source.hpp>
+#include <proton/source_options.hpp>
+#include <proton/transport.hpp>
+#include <proton/work_queue.hpp>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "filter_cache.hpp"
+
+class ShardedSubscription
+  {
+  public:
+    enum By { PROPERTY, MESSAGE_ID };
+
+    typedef std::function<void (int shard, proton::delivery &d,
+      proton::message &m)> Callback;
+
+    /** The clause that shard i of n takes, on its own; or an empty
+          string if there is only one shard. */
+    static std::string clause (int shard, int shards, By by,
+          const std::string &property)
+      {
+      if (shards <= 1) return "";
+      if (shard == 0)
+        {
+        // Everything that no other shard takes
+        std::string others;
+        for (int i = 1; i < shards; i++)
+          others += (i > 1 ? " OR " : "") + clause (i, shards, by, property);
+        std::string subject = by == PROPERTY ? property : "JMSMessageID";
+        return "(NOT (" + others + ") OR " + subject + " IS NULL)";
+        }
+      std::string c;
+      if (by == PROPERTY)
+        {
+        std::string n = std::to_string (shards);
+        std::string mod = "(" + property + " - " + property + " / " + n
+          + " * " + n + ")";
+        return "(" + mod + " = " + std::to_string (shard) + " OR " + mod
+          + " = " + std::to_string (shard - shards) + ")";
+        }
+      static const char digits[] = "0123456789abcdef";
+      for (int d = shard; d < 16; d += shards)
+        {
+        std::string chars (1, digits[d]);
+        if (d >= 10) chars += (char)(digits[d] - 'a' + 'A');
+        for (size_t j = 0; j < chars.size(); j++)
+          c += (c.empty() ? "" : " OR ") + std::string ("JMSMessageID LIKE '%")
+            + chars[j] + "'";
+        }
+      // Shards beyond the sixteenth take nothing
+      return c.empty() ? "FALSE" : "(" + c + ")";
+      }
+
+    /** The whole selector for shard i of n. */
+    static std::string selector_for (const std::string &selector,
+          int shard, int shards, By by, const std::string &property)
+      {
+      std::string c = clause (shard, shards, by, property);
+      if (c.empty()) return selector;
+      if (selector.empty()) return c;
+      return "(" + selector + ") AND " + c;
+      }
+
+  protected:
+    /*
+     * Shard is the handler for one shard's connection.
+     */
+    class Shard : public proton::messaging_handler
+      {
+      protected:
+        ShardedSubscription &owner;
+        int index;
+        std::string selector;
+        std::mutex lock; // Guards the members below
+        proton::work_queue *work_queue; // Null until connected
+        proton::connection connection;
+        bool stopping;
+
+      public:
+        std::atomic<long> received;
+
+        Shard (ShardedSubscription &owner, int index,
+              const std::string &selector) : owner (owner)
+          {
+          this->index = index;
+          this->selector = selector;
+          this->work_queue = 0;
+          this->stopping = false;
+          this->received = 0;
+          }
+
+        /** Close the connection. Safe to call from any thread. */
+        void stop ()
+          {
+          std::lock_guard<std::mutex> l (lock);
+          stopping = true;
+          if (work_queue)
+            work_queue->add ([this]() { connection.close(); });
+          }
+
+        void on_connection_open (proton::connection &c) override
+          {
+            {
+            std::lock_guard<std::mutex> l (lock);
+            connection = c;
+            work_queue = &c.work_queue();
+            if (stopping)
+              {
+              c.close();
+              return;
+              }
+            }
+          // Encoded once, however often the shard reconnects
+          c.open_receiver (owner.address, proton::receiver_options()
+            .source (owner.filters.source_options (selector))
+            .credit_window (owner.credit)
+            .auto_accept (owner.auto_accept));
+          }
+
+        void on_receiver_open (proton::receiver &r) override
+          {
+          if (!r.source().filters().empty()) return;
+          std::cerr << "shard " << index << ": the broker didn't apply "
+            << "the selector, so the shards would overlap" << std::endl;
+          r.connection().close();
+          }
+
+        void on_message (proton::delivery &d, proton::message &m) override
+          {
+          received++;
+          owner.callback (index, d, m);
+          }
+
+        void on_transport_close (proton::transport &t) override
+          {
+          // The work_queue goes with the connection
+          std::lock_guard<std::mutex> l (lock);
+          work_queue = 0;
+          }
+
+        void on_error (const proton::error_condition &e) override
+          {
+          std::cerr << "shard " << index << ": " << e.what() << std::endl;
+          }
+      };
+
+    std::string url;
+    std::string address;
+    int credit;
+    bool auto_accept;
+    Callback callback;
+    FilterCache filters;
+    std::vector<std::unique_ptr<Shard>> shards;
+
+  public:
+    /** A subscription to 'address' at 'url' (host and port), with
+          'selector' split 'n' ways. If auto_accept is false, the callback
+          must settle each delivery itself. */
+    ShardedSubscription (const std::string &url, const std::string &address,
+          const std::string &selector, int n, By by,
+          const std::string &property, Callback callback, int credit = 10,
+          bool auto_accept = true)
+      {
+      this->url = url;
+      this->address = address;
+      this->credit = credit;
+      this->auto_accept = auto_accept;
+      this->callback = callback;
+      for (int i = 0; i < n; i++)
+        shards.emplace_back (new Shard (*this, i,
+          selector_for (selector, i, n, by, property)));
+      }
+
+    /** Open the shards' connections, with the given options (for
+          credentials, and so on). The subscription must outlive the
+          container's run(). */
+    void start (proton::container &c,
+          const proton::connection_options &options
+            = proton::connection_options())
+      {
+      for (size_t i = 0; i < shards.size(); i++)
+        c.connect (url, proton::connection_options (options)
+          .handler (*shards[i]));
+      }
+
+    /** Close all the shards' connections. Safe to call from any thread,
+          including from the callback. */
+    void stop ()
+      {
+      for (size_t i = 0; i < shards.size(); i++)
+        shards[i]->stop();
+      }
+
+    int size () const { return shards.size(); }
+
+    /** The number of messages shard i has received so far. */
+    long received (int shard) const { return shards[shard]->received; }
+  };
+
+#endif
@@ -29,6 +29,11 @@
   the sender and the receiver need to have the same link credit settings,
   or one will swamp the other. The receiver's link credit is set in
   this program, but the sender's link credit will depend on the broker. 
+
+  During a failover, messages whose dispositions were lost will be 
+  delivered again. The sender numbers its messages (using the message ID),
+  and the receiver uses a DuplicateFilter (see duplicate_filter.hpp) to
+  count how many of the messages it receives are redeliveries.
  */
 
 #include <proton/connection.hpp>
@@ -43,6 +48,8 @@
 #include <unistd.h>
 #include <iostream>
 
+#include "duplicate_filter.hpp"
+
 #define BOLD_ON "\x1B[1m"
 #define BOLD_OFF "\x1B[0m"
 #define LOG_FUNC std::cout << BOLD_ON << __FUNCTION__ << BOLD_OFF << std::endl;
@@ -56,12 +63,14 @@ class MyHandler : public proton::messaging_handler
     std::string backup;
     int sent;
     int received;
+    DuplicateFilter duplicates;
 
   public:
     MyHandler (const std::string &_address, const std::string &_backup, 
-          const std::string &_user, const std::string &_password) :
+          const std::string &_user, const std::string &_password,
+          size_t remember_ids) :
         address (_address), user (_user), password (_password), 
-        backup (_backup), sent (0), received (0)
+        backup (_backup), sent (0), received (0), duplicates (remember_ids)
       {}
 
     /** Just log that this method was called. */
@@ -119,9 +128,13 @@ class MyHandler : public proton::messaging_handler
     void on_message (proton::delivery& dlv, proton::message& msg) 
       {
       received++;
+      // Messages without an ID can't be checked
+      if (!msg.id().empty()) duplicates.seen (msg.id());
       if (received % 1000 == 0)
         {
-        std::cout << "Received " << received << " messages" << std::endl;
+        const DuplicateFilter::Stats &stats = duplicates.get_stats();
+        std::cout << "Received " << received << " messages, " 
+          << stats.hits << " duplicates" << std::endl;
         }
       }
 
@@ -130,6 +143,7 @@ class MyHandler : public proton::messaging_handler
       {
       //LOG_FUNC;
       proton::message msg ("Hello, world");
+      msg.id ((uint64_t)sent);
       s.send (msg);
       sent++;
       if (sent % 1000 == 0)
@@ -146,10 +160,12 @@ int main(int argc, char **argv)
   std::string backup = "127.0.0.1:5673";
   std::string user = "admin";
   std::string password = "admin";
+  // Number of message IDs to remember, for spotting redeliveries
+  size_t remember_ids = 100000;
 
   try 
     {
-    MyHandler connect (address, backup, user, password);
+    MyHandler connect (address, backup, user, password, remember_ids);
     proton::container(connect).run();
     return 0;
     } 
@@ -1,25 +1,111 @@
 /*
   server.cpp
 
-  A simple proton direct receiver with lots of logging. Running this with
-    the PNM_TRACE_FRAME environment variable set can yield some insight
-    into how Proton interacts with the AMQP wire protocol. 
+  A simple proton direct receiver with lots of logging, which has grown
+    into a small, in-memory, store-and-forward broker. It's good enough to
+    run all the client examples in this directory against, on one machine,
+    without installing a real message broker. Running this with the
+    PNM_TRACE_FRAME environment variable set can yield some insight
+    into how Proton interacts with the AMQP wire protocol.
 
   This example opens a listening connection on the port specified in
-    main(), at the end of the code. It expects connections to address
-    "foo" (see on_receiver_open). If the sender tries to attach to
-    any other address, or connect as a consumer, an error will be
-    raised, which should be communicated to the client. 
+    main(), at the end of the code. It has a fixed set of named queues,
+    also set in main() -- "foo" and "bar" by default. Clients can send
+    messages to a queue, and consume messages from it. There can also be
+    routes, with wildcards, from other addresses to the queues: for
+    example, messages sent to 'orders.uk.eu' can be routed to "foo". If a
+    client tries to attach to any other address, the link is refused:
+    the server attaches it and detaches it at once, with an error, which
+    the client sees, and the rest of the connection carries on.
+
+  Messages are stored in memory. Each message on a queue is delivered to
+    one consumer. When there is more than one consumer on a queue, they
+    take turns. A consumer only gets messages when it has link credit,
+    and the message stays 'in flight' until the consumer settles it. If
+    the consumer accepts or rejects it, it is removed (rejected messages
+    are just counted -- there is no dead-letter queue). If the consumer
+    releases or modifies it, or goes away without settling it, it is put
+    back at the head of the queue for redelivery. A consumer can set a JMS
+    selector (see selector.hpp), as receive_selector.cpp does, and then
+    gets only the messages that match it; the rest stay on the queue for
+    other consumers. The statistics report shows what the selectors cost.
+
+  There can also be topics (just "news", by default). Every message sent
+    to a topic goes to every client that is consuming from it at the
+    time, and messages sent when there are no consumers are discarded. A
+    message is encoded once when it arrives, and the same immutable,
+    reference-counted buffer is sent to every subscriber; it is freed when
+    the last subscriber settles it. A client that asks for the 'topic'
+    capability on an address that is a queue gets an error, as it would
+    from a real broker. A topic can't have the same name as a queue; the
+    server warns about it at start-up and leaves the topic out.
+
+  A topic subscriber that can't keep up -- that doesn't give the server
+    credit -- keeps a backlog of at most subscriber_backlog messages (set
+    in main()); while it is full, further messages for it are dropped,
+    and counted in the statistics report. Topic messages aren't durable
+    anyway, and this stops one slow client holding an ever-growing share
+    of the server's memory, which would also throttle every producer.
+
+  The server decides how much link credit each client that sends to it
+    gets (see CreditScheduler), rather than leaving it to Proton. Credit is
+    shared between producers by weight, and stops altogether when too many
+    bytes are waiting to be consumed, so one fast producer can't take all
+    of a thread's time, or all of the memory.
+
+  By default, messages are lost when the server stops. If a journal
+    directory is set in main(), every message is also written to a journal
+    (see journal.hpp), and the messages that had not been consumed are
+    put back on their queues when the server restarts. A message is not
+    accepted until it is on disk, so a client that has seen the accept
+    knows the message will survive a crash. Syncing the disk for every
+    message would be very slow, so the journal syncs in batches ('group
+    commit'): the statistics report shows how many messages are written
+    per second, and how many syncs that took. Messages sent to topics
+    are never journalled.
+
+  A message on a queue that is bigger than a threshold set in main() is
+    written to a temporary file (see spill_file.hpp) as soon as it
+    arrives, and sent to the consumer from that file a chunk at a time,
+    so a queue of large messages doesn't fill the memory. The file, and
+    the journal record, are written from the decoded body where it is
+    (see EncodedParts), rather than from an encoded copy. But Proton
+    still collects, and decodes, the whole of each incoming message
+    before handing it to the server, so receiving a large message
+    briefly needs memory for it twice over: the bytes received, and the
+    decoded message. Bodies that aren't strings or binary are encoded
+    into memory before being written, and a message recovered from the
+    journal at a restart is decoded from a copy of its record, so those
+    need about the same again.
+
+  The server is structured in the same way as the broker example that
+    comes with Proton. There is one handler object per connection
+    (ConnectionHandler), created by a listen_handler when the connection
+    is accepted. Each link gets its own handler too: a Producer for a link
+    on which a client sends, and a Consumer for a link on which a client
+    receives. The connection handler owns the link handlers, and cleans
+    them up when the connection goes away.
+
+  The container runs several threads: by default, one per core, or as
+    many as the first command-line argument says. Proton guarantees
+    that the events for any one connection are handled by one thread at a
+    time, so the connection and link handlers need no locking of their
+    own. The queues are shared between connections, and so between
+    threads; each queue has its own lock, and a consumer on one connection
+    is only ever woken by a producer on another through its connection's
+    work_queue -- the same technique as in send_across_threads.cpp.
 
   It's also interesting to see what happens if this server rejects an
     inbound message. JMS clients, in particular, are unused to this kind of
     behaviour, and will probably behave badly.
- */ 
+ */
 
 #include <unistd.h>
 #include <stdexcept>
 #include <proton/connection.hpp>
 #include <proton/connection_options.hpp>
+#include <proton/receiver_options.hpp>
+#include <proton/source_options.hpp>
 #include <proton/target_options.hpp>
 #include <proton/sender_options.hpp>
 #include <proton/container.hpp>
@@ -29,126 +115,2160 @@
 #include <proton/tracker.hpp>
 #include <proton/listener.hpp>
 #include <proton/delivery.hpp>
+#include <proton/source.hpp>
+#include <proton/target.hpp>
+#include <proton/work_queue.hpp>
+#include <proton/value.hpp>
+#include <proton/codec/decoder.hpp>
+#include <proton/link.h>
+#include <proton/delivery.h>
 #include <iostream>
+#include <deque>
+#include <map>
+#include <unordered_map>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+
+#include "journal.hpp"
+#include "byte_budget.hpp"
+#include "body_view.hpp"
+#include "spill_file.hpp"
+#include "selector.hpp"
 
 #define BOLD_ON "\x1B[1m"
 #define BOLD_OFF "\x1B[0m"
 
 #define LOG_FUNC std::cout << BOLD_ON << __FUNCTION__ << BOLD_OFF << std::endl;
 
-/* 
- * A basic message receiver, with lots of logging
+class Consumer;
+class Subscriber;
+class Producer;
+class ConnectionHandler;
+
+/*
+ * ProducerCounters are the statistics for one link on which a client
+ *   sends to us. Each message that arrives on the link refers to them, so
+ *   that the bytes it occupies are counted against the link until the
+ *   message is consumed -- which may be long after the link has gone.
+ */
+struct ProducerCounters
+  {
+  std::string address;
+  int weight;
+  std::atomic<long> credit_granted;
+  std::atomic<long> bytes_buffered;
+
+  ProducerCounters (const std::string &address, int weight)
+    {
+    this->address = address;
+    this->weight = weight;
+    this->credit_granted = 0;
+    this->bytes_buffered = 0;
+    }
+  };
+
+/*
+ * CreditScheduler decides how much link credit each producer gets. With
+ *   Proton's own credit window, every link gets the same fixed credit,
+ *   however many links there are, and however much memory is already
+ *   full of messages; a client that sends flat out gets as much of the
+ *   server as it can take.
+ *
+ * Instead, there is a pool of credit (a number of messages) which is
+ *   shared between the producer links in proportion to their weights: a
+ *   link with weight 2 gets twice the credit of a link with weight 1. A
+ *   link is topped up to its share when it has used half of it. Since the
+ *   server handles a link's messages as fast as they arrive, a producer's
+ *   throughput is limited by how much credit it has in flight, so
+ *   producers with equal weights get equal shares, however fast each of
+ *   them could go.
+ *
+ * The scheduler also counts the bytes of every message that is buffered
+ *   -- received, but not yet consumed. When that passes the high
+ *   watermark, no more credit is issued until consumers have brought it
+ *   below the low watermark; then every producer is woken to top up.
+ *   Credit that a producer already has can't be taken back, so the
+ *   buffered bytes can overshoot the high watermark by up to the pool's
+ *   worth of messages.
+ *
+ * The scheduler is shared by all the connection threads. The byte counts,
+ *   which change with every message, are atomics; the lock is only taken
+ *   when links come and go, or to wake the producers.
  */
-class ReceiveHandler : public proton::messaging_handler 
+class CreditScheduler
   {
   protected:
-    std::string address;
+    std::mutex lock; // Guards producers
+    std::map<Producer*, std::shared_ptr<Producer>> producers;
+    std::atomic<long> total_weight;
+    int pool;
+    int64_t high_watermark;
+    int64_t low_watermark;
+    std::atomic<int64_t> buffered;
+    std::atomic<bool> throttled;
+
+    /** Start issuing credit again, and wake every producer so it can
+          top up. */
+    void unthrottle ();
 
   public:
-    ReceiveHandler (const std::string &address)
+    std::atomic<long> throttle_count; // Times the high watermark was hit
+
+    CreditScheduler (int pool, int64_t high_watermark, int64_t low_watermark)
       {
-      this->address = address;
+      this->pool = pool;
+      this->high_watermark = high_watermark;
+      this->low_watermark = low_watermark;
+      this->total_weight = 0;
+      this->buffered = 0;
+      this->throttled = false;
+      this->throttle_count = 0;
+      }
+
+    void add (const std::shared_ptr<Producer> &p);
+
+    void remove (Producer *p);
+
+    /** How much credit to add to a link that currently has link_credit.
+          Returns 0 if the link doesn't need any yet. */
+    int credit_to_issue (const ProducerCounters &c, int link_credit)
+      {
+      if (throttled) return 0;
+      long weight = total_weight;
+      if (weight < c.weight) weight = c.weight;
+      int share = (int)((long)pool * c.weight / weight);
+      if (share < 1) share = 1;
+      if (link_credit > share / 2) return 0;
+      return share - link_credit;
+      }
+
+    /** A message of this many bytes has arrived. c is null for a message
+          that didn't come from a link (e.g., one recovered from the
+          journal). */
+    void received (ProducerCounters *c, size_t bytes)
+      {
+      if (c) c->bytes_buffered += bytes;
+      if ((buffered += bytes) > high_watermark && !throttled.exchange (true))
+        {
+        throttle_count++;
+        // A consumer might have brought the total down in the meantime,
+        //   and not known that it should unthrottle
+        if (buffered < low_watermark) unthrottle();
+        }
+      }
+
+    /** A message of this many bytes has been consumed, or dropped. */
+    void released (ProducerCounters *c, size_t bytes)
+      {
+      if (c) c->bytes_buffered -= bytes;
+      if ((buffered -= bytes) < low_watermark && throttled) unthrottle();
+      }
+
+    /** Print the totals, and one line per producer link. */
+    void report ();
+  };
+
+/*
+ * StoredMessage is a message on a queue, along with its ID in the
+ *   journal, which is needed to record that it has been consumed. The ID
+ *   is 0 if there is no journal. It also remembers its size, and the link
+ *   it came from (if any), for the CreditScheduler. A large message is
+ *   kept in a SpillFile instead of a proton::message.
+ */
+struct StoredMessage
+  {
+  proton::message msg;
+  uint64_t journal_id;
+  size_t bytes;
+  std::shared_ptr<ProducerCounters> origin;
+  // If not null, the encoded message is in this file, and msg has only
+  //   the headers and properties (for selectors)
+  std::shared_ptr<SpillFile> spill;
+
+  StoredMessage () : journal_id (0), bytes (0) {}
+  StoredMessage (proton::message &&msg, uint64_t journal_id = 0) :
+      msg (std::move (msg)), journal_id (journal_id), bytes (0)
+    {}
+  };
+
+/*
+ * EncodedParts is a message's encoding in two parts, so that a message
+ *   with a large body can be written to a file without first being
+ *   encoded into one buffer -- which, next to the decoded message, would
+ *   need twice the body's size in memory. 'head' is the encoding of
+ *   everything but the body, followed by the start of the body section;
+ *   'body' is a view of the decoded body's bytes, where they are (see
+ *   body_view.hpp). One after the other, they are what
+ *   message::encode() would give.
+ *
+ * Only string, symbol and binary bodies can be split like this. The view
+ *   is valid while the message is alive, and its body unchanged.
+ */
+struct EncodedParts
+  {
+  std::vector<char> head;
+  std::string_view body;
+
+  /** Split the message's encoding. Returns false if the body isn't a
+        string, symbol or binary. */
+  bool split (const proton::message &msg)
+    {
+    BodyView view (msg);
+    if (!view.viewable()) return false;
+    body = view.view();
+
+    // There's no way to encode all of a proton::message but its body,
+    //   and copying the message would copy the body, so the rest is
+    //   copied field by field
+    proton::message envelope;
+    envelope.id (msg.id());
+    envelope.user (msg.user());
+    envelope.to (msg.to());
+    envelope.subject (msg.subject());
+    envelope.reply_to (msg.reply_to());
+    envelope.correlation_id (msg.correlation_id());
+    envelope.content_type (msg.content_type());
+    envelope.content_encoding (msg.content_encoding());
+    envelope.expiry_time (msg.expiry_time());
+    envelope.creation_time (msg.creation_time());
+    envelope.group_id (msg.group_id());
+    envelope.group_sequence (msg.group_sequence());
+    envelope.reply_to_group_id (msg.reply_to_group_id());
+    envelope.durable (msg.durable());
+    envelope.ttl (msg.ttl());
+    envelope.priority (msg.priority());
+    envelope.first_acquirer (msg.first_acquirer());
+    envelope.delivery_count (msg.delivery_count());
+    envelope.properties() = msg.properties();
+    envelope.delivery_annotations() = msg.delivery_annotations();
+    envelope.message_annotations() = msg.message_annotations();
+    envelope.encode (head);
+
+    // The body section, as Proton encodes it: a binary body that arrived
+    //   as a 'data' section goes back as one, anything else is an
+    //   'amqp-value'. Then the body's type, in its short form if it fits
+    proton::type_id type = msg.body().type();
+    bool data = type == proton::BINARY && msg.inferred();
+    head.push_back (0x00);
+    head.push_back (0x53);
+    head.push_back (data ? 0x75 : 0x77);
+    unsigned char code = type == proton::STRING ? 0xa1
+      : type == proton::SYMBOL ? 0xa3 : 0xa0;
+    size_t size = body.size();
+    if (size < 256)
+      {
+      head.push_back (code);
+      head.push_back ((char)size);
+      }
+    else
+      {
+      head.push_back (code | 0x10);
+      for (int shift = 24; shift >= 0; shift -= 8)
+        head.push_back ((char)(size >> shift));
+      }
+    return true;
+    }
+
+  size_t size () const { return head.size() + body.size(); }
+
+  std::vector<std::string_view> pieces () const
+    {
+    return { std::string_view (head.data(), head.size()), body };
+    }
+  };
+
+/*
+ * RawSender sends a message that has already been encoded. The C++
+ *   sender::send() only takes a proton::message, which it encodes on
+ *   every call -- so publishing to a thousand subscribers would mean a
+ *   thousand encodings -- and which it must have in memory all at once.
+ *   The C API can send bytes, a piece at a time if need be, but the C++
+ *   API doesn't expose the pn_link_t that it needs. As with BodyView (see
+ *   body_view.hpp), a subclass can get at it, because the C++ object
+ *   makes it available to subclasses.
+ *
+ * Each delivery needs a tag that is unique on its link. The caller
+ *   supplies a counter, which also identifies the delivery when the client
+ *   settles it (see tag_of()). sender::send() has its own counter, which
+ *   starts from zero; to use both on one link, set the top bit of the
+ *   counter used here.
+ */
+class RawSender : public proton::sender
+  {
+  public:
+    static const uint64_t HIGH_TAG = 1ULL << 63;
+
+    RawSender (const proton::sender &s) : proton::sender (s) {}
+
+    /** The counter that was used as a tracker's tag, or 0 if it wasn't
+          sent by a RawSender. */
+    static uint64_t tag_of (const proton::tracker &t)
+      {
+      proton::binary tag = t.tag();
+      uint64_t n = 0;
+      if (tag.size() == sizeof (n)) memcpy (&n, tag.data(), sizeof (n));
+      return n;
+      }
+
+    /** Start a delivery. Its bytes are added with write(), and it is
+          sent, complete, with end(). */
+    pn_delivery_t *begin (uint64_t tag)
+      {
+      return pn_delivery (pn_object(),
+        pn_dtag ((const char *)&tag, sizeof (tag)));
+      }
+
+    /** Add bytes to the delivery started by begin(). Proton copies them,
+          and frames them as the transport has room. */
+    void write (const char *data, size_t size)
+      {
+      pn_link_send (pn_object(), data, size);
+      }
+
+    /** Bytes written to a delivery that the transport hasn't taken yet. */
+    static size_t unsent (pn_delivery_t *d) { return pn_delivery_pending (d); }
+
+    /** Finish the delivery. Returns true if the link is 'at most once',
+          in which case the delivery is settled already, and the client
+          will never settle it. */
+    bool end (pn_delivery_t *d)
+      {
+      pn_link_advance (pn_object());
+      if (pn_link_snd_settle_mode (pn_object()) != PN_SND_SETTLED)
+        return false;
+      pn_delivery_settle (d);
+      return true;
+      }
+
+    /** Send the bytes as one delivery. Returns true if it is settled
+          already, as for end(). */
+    bool send (uint64_t tag, const std::vector<char> &bytes)
+      {
+      pn_delivery_t *d = begin (tag);
+      write (bytes.data(), bytes.size());
+      return end (d);
       }
+  };
+
+/*
+ * SpillOptions say when messages are kept on disk rather than in memory.
+ *   A message whose encoded size is more than the threshold is written to
+ *   a SpillFile (see spill_file.hpp) in dir as soon as it arrives, and
+ *   sent to a consumer straight from the file, a chunk at a time.
+ */
+struct SpillOptions
+  {
+  std::string dir;
+  size_t threshold; // Bytes; 0 for never
+  size_t chunk; // Bytes handed to Proton at a time, when sending
+  };
 
+/*
+ * Queue is a named, in-memory queue of messages. Producers and consumers
+ *   on any of the container's threads may use it at the same time, so it
+ *   is protected by its own mutex -- there is no lock that is shared by
+ *   all the queues, so traffic on different queues doesn't contend.
+ *
+ * The queue doesn't push messages to consumers. Instead, a consumer pulls
+ *   as many messages as its link credit allows, on its own connection's
+ *   thread. If the queue runs dry before the consumer's credit does, the
+ *   consumer is put on the queue's 'hungry' list, and the next message to
+ *   arrive wakes the consumer at the front of that list. That gives
+ *   round-robin delivery between consumers, without the producer's thread
+ *   ever touching the consumer's Proton objects.
+ *
+ * A consumer with a selector only takes the messages that match it; the
+ *   others stay where they are, in order, for other consumers. A new
+ *   message wakes the first hungry consumer that would take it. Finding
+ *   a match means evaluating the selector against each message from the
+ *   head of the queue, under the queue's lock, so a selector that matches
+ *   only a few of a long queue's messages is expensive.
+ */
+class Queue
+  {
   protected:
-    void on_tracker_reject (proton::tracker &t) override 
-      { LOG_FUNC; proton::messaging_handler::on_tracker_reject (t); }
+    std::string name;
+    std::mutex lock;
+    std::deque<StoredMessage> messages;
+    std::deque<std::shared_ptr<Consumer>> hungry;
 
-    void on_tracker_settle (proton::tracker &t) override 
-      { LOG_FUNC; proton::messaging_handler::on_tracker_settle (t); }
+    void wake (std::vector<std::shared_ptr<Consumer>> &to_wake);
 
-    void on_tracker_accept (proton::tracker &t) override 
-      { LOG_FUNC; proton::messaging_handler::on_tracker_accept (t); }
+    /** Take the first hungry consumer that would take message m, if
+          any. Call with the lock held. */
+    void take_hungry (const StoredMessage &m,
+          std::vector<std::shared_ptr<Consumer>> &to_wake);
 
-    void on_transport_open (proton::transport &t) override 
-      { LOG_FUNC;  proton::messaging_handler::on_transport_open (t); }
+  public:
+    // Counters, for the statistics report. They're updated from
+    //   different threads, so they must be atomic
+    std::atomic<long> enqueued;
+    std::atomic<long> acknowledged;
+    std::atomic<long> rejected;
+    std::atomic<long> redelivered;
+    std::atomic<long> spilled;
+    // Selector evaluations while taking messages, how many matched, and
+    //   the time they took
+    std::atomic<long> selector_evals;
+    std::atomic<long> selector_matches;
+    std::atomic<long> selector_ns;
 
-    void on_session_open (proton::session &s) override 
-      { LOG_FUNC;  proton::messaging_handler::on_session_open (s); }
+    Queue (const std::string &name)
+      {
+      this->name = name;
+      this->enqueued = this->acknowledged = 0;
+      this->rejected = this->redelivered = 0;
+      this->spilled = 0;
+      this->selector_evals = this->selector_matches = this->selector_ns = 0;
+      }
 
-    void on_session_close (proton::session &s) override 
-      { LOG_FUNC;  proton::messaging_handler::on_session_close (s); }
+    const std::string &get_name () const { return name; }
 
-    void on_sender_open (proton::sender &s) override 
-      { 
-      LOG_FUNC;  
-      proton::messaging_handler::on_sender_open (s); 
-      //s.close (proton::error_condition ("Receiving not allowed")); // Fails
-      //s.connection().close (proton::error_condition ("Receiving not allowed")); 
+    size_t depth ()
+      {
+      std::lock_guard<std::mutex> l (lock);
+      return messages.size();
       }
 
-    void on_sender_close (proton::sender &s) override 
-      { LOG_FUNC;  proton::messaging_handler::on_sender_close (s); }
+    /** Take up to max messages from the head of the queue -- or, if the
+          consumer has a selector, the first max that match it. If there
+          are fewer than that, the consumer is marked as hungry. */
+    void pop (const std::shared_ptr<Consumer> &c, 
+          std::vector<StoredMessage> &out, size_t max);
 
-    void on_sender_detach (proton::sender &s) override 
-      { LOG_FUNC;  proton::messaging_handler::on_sender_detach (s); }
+    /** Remove a consumer from the hungry list, because it is going
+          away, or has given back its credit. */
+    void unsubscribe (Consumer *c);
 
-    void on_receiver_open (proton::receiver &r) override 
-      { 
-      LOG_FUNC;  
-      proton::messaging_handler::on_receiver_open (r);
-      std::string address = r.target().address();
-      std::cout << "target address: " << address << std::endl;
-      if (address != "foo")
+    /** Add a message, and wake a consumer that is waiting for one. */
+    void enqueue (StoredMessage &&m);
+
+    /** Put back messages that a consumer didn't settle. They go to the
+          head of the queue, so that they are the next to be delivered. */
+    void requeue (std::vector<StoredMessage> &ms);
+  };
+
+/*
+ * Consumer handles a link on which a client receives messages from a
+ *   queue. Messages that have been sent, but not yet settled by the
+ *   client, are kept, so they can be redelivered if necessary.
+ *
+ * All Proton operations happen on the connection's own thread. The only
+ *   thing another thread can do is wake() the consumer, which schedules a
+ *   pull() on the connection's work_queue. Consumers are reference-counted,
+ *   so a wake-up that is still pending when the connection goes away
+ *   doesn't refer to a deleted object. That means the last reference may
+ *   go on another thread, so detach() lets go of every Proton handle the
+ *   consumer holds while it is still on the connection's thread.
+ *
+ * When the client accepts or rejects a message, that is recorded in the
+ *   journal, if there is one, so the message is not recovered again.
+ *
+ * A spilled message is streamed from its file: a chunk is handed to Proton
+ *   whenever the transport has taken the last one, so only a chunk or two
+ *   of it is ever in memory. Proton can't interleave deliveries on a link,
+ *   so nothing else is sent on the link until the stream has finished.
+ *   The transport gives no event when it has taken the bytes, so the
+ *   consumer checks every millisecond.
+ */
+class Consumer : public proton::messaging_handler,
+    public std::enable_shared_from_this<Consumer>
+  {
+  protected:
+    ConnectionHandler *owner;
+    proton::sender sender;
+    Queue *queue;
+    Journal *journal; // Null if there isn't one
+    CreditScheduler *credit;
+    const SpillOptions *spill;
+    // Null if the client didn't set one
+    std::unique_ptr<CompiledSelector> selector;
+    proton::work_queue *work_queue;
+    std::mutex wake_lock; // Guards alive and wake_pending
+    bool alive;
+    bool wake_pending;
+    std::map<proton::tracker, StoredMessage> unsettled;
+    std::map<uint64_t, StoredMessage> streamed; // Unsettled, by tag
+    std::vector<StoredMessage> batch;
+    std::deque<StoredMessage> held; // Taken from the queue during a stream
+    // The spilled message being sent, if any
+    bool streaming;
+    StoredMessage stream;
+    pn_delivery_t *stream_delivery;
+    uint64_t stream_tag;
+    size_t stream_sent;
+    uint64_t next_tag;
+
+    /** Remove a message from the unsettled ones. Returns false if it
+          isn't there. */
+    bool take_unsettled (proton::tracker &t, StoredMessage &m)
+      {
+      uint64_t tag = RawSender::tag_of (t);
+      if (tag & RawSender::HIGH_TAG)
         {
-        //r.close (proton::error_condition ("Invalid address1")); // Fails
-        //r.session().close (proton::error_condition ("Invalid address")); // Fails 
-        r.connection().close (proton::error_condition ("Invalid address")); 
+        std::map<uint64_t, StoredMessage>::iterator i = streamed.find (tag);
+        if (i == streamed.end()) return false;
+        m = std::move (i->second);
+        streamed.erase (i);
+        return true;
         }
+      std::map<proton::tracker, StoredMessage>::iterator i
+        = unsettled.find (t);
+      if (i == unsettled.end()) return false;
+      m = std::move (i->second);
+      unsettled.erase (i);
+      return true;
       }
 
-    void on_receiver_close (proton::receiver &c) override 
-      { LOG_FUNC;  proton::messaging_handler::on_receiver_close (c); }
+    /** The client has finished with a message, for good. */
+    void finished (StoredMessage &m)
+      {
+      if (journal && m.journal_id) journal->ack (m.journal_id);
+      credit->released (m.origin.get(), m.bytes);
+      }
 
-    void on_delivery_settle (proton::delivery &d) override 
-      { LOG_FUNC;  proton::messaging_handler::on_delivery_settle (d); }
+    void settled (proton::tracker &t)
+      {
+      StoredMessage m;
+      if (take_unsettled (t, m)) finished (m);
+      }
 
-    void on_connection_open (proton::connection &c) override 
-     { LOG_FUNC;  proton::messaging_handler::on_connection_open (c); }
+    void start_stream (StoredMessage &&m)
+      {
+      RawSender raw (sender);
+      stream = std::move (m);
+      stream_tag = RawSender::HIGH_TAG | next_tag++;
+      stream_delivery = raw.begin (stream_tag);
+      stream_sent = 0;
+      streaming = true;
+      continue_stream();
+      }
 
-    void on_connection_close (proton::connection &c) override 
-      { LOG_FUNC; proton::messaging_handler::on_connection_close (c); }
+    /** Give Proton the next chunk of the stream, if it has taken the last
+          one, and finish the delivery when there's nothing left. */
+    void continue_stream ()
+      {
+      RawSender raw (sender);
+      std::string_view bytes = stream.spill->view();
+      while (stream_sent < bytes.size()
+          && RawSender::unsent (stream_delivery) < spill->chunk)
+        {
+        size_t n = std::min (spill->chunk, bytes.size() - stream_sent);
+        raw.write (bytes.data() + stream_sent, n);
+        stream_sent += n;
+        // Proton has its own copy of those bytes now
+        stream.spill->release_before (stream_sent);
+        }
+      if (stream_sent < bytes.size())
+        {
+        std::shared_ptr<Consumer> self = shared_from_this();
+        work_queue->schedule (proton::duration::MILLISECOND, [self]()
+          {
+            {
+            std::lock_guard<std::mutex> l (self->wake_lock);
+            if (!self->alive) return;
+            }
+          self->continue_stream();
+          });
+        return;
+        }
+      stream.spill->release();
+      streaming = false;
+      if (raw.end (stream_delivery))
+        finished (stream);
+      else
+        streamed[stream_tag] = std::move (stream);
+      stream = StoredMessage();
+      pull();
+      }
 
-    void on_sender_drain_start (proton::sender &s) override 
-      { LOG_FUNC;  proton::messaging_handler::on_sender_drain_start (s); }
+  public:
+    bool hungry; // Guarded by the queue's lock
 
-    void on_message (proton::delivery &d, proton::message &msg) override 
+    Consumer (ConnectionHandler *owner, proton::sender &sender,
+          Queue *queue, Journal *journal, CreditScheduler *credit,
+          const SpillOptions *spill,
+          std::unique_ptr<CompiledSelector> &&selector)
+        : selector (std::move (selector))
       {
-      LOG_FUNC;
-      std::cout << msg.body() << std::endl;
-      //d.reject(); // What happens if we reject? A JMS client, in particular,
-                  //    will probably behave badly
+      this->owner = owner;
+      this->sender = sender;
+      this->queue = queue;
+      this->journal = journal;
+      this->credit = credit;
+      this->spill = spill;
+      this->work_queue = &sender.work_queue();
+      this->alive = true;
+      this->wake_pending = false;
+      this->streaming = false;
+      this->stream_delivery = 0;
+      this->stream_tag = 0;
+      this->stream_sent = 0;
+      this->next_tag = 1;
+      this->hungry = false;
       }
 
-    /** If we're going to be experimenting with things like rejecting messages,
-          we need to override on_transport_error() so that bad behaviour of
-          the sending client doesn't lead to the connection (and thus container)
-          being shut down. */
-    void on_transport_error (proton::transport &t) override
+    /** The consumer's selector, or null. The queue uses it from other
+          threads, so it never changes. */
+    const CompiledSelector *get_selector () const { return selector.get(); }
+
+    /** Stop taking messages, and put any unsettled ones back on the
+          queue. Call on the connection's thread. */
+    void detach ()
       {
-      LOG_FUNC;
+        {
+        std::lock_guard<std::mutex> l (wake_lock);
+        if (!alive) return;
+        alive = false;
+        }
+      queue->unsubscribe (this);
+      std::vector<StoredMessage> ms;
+      for (std::map<proton::tracker, StoredMessage>::iterator
+          i = unsettled.begin(); i != unsettled.end(); ++i)
+        ms.push_back (std::move (i->second));
+      for (std::map<uint64_t, StoredMessage>::iterator
+          i = streamed.begin(); i != streamed.end(); ++i)
+        ms.push_back (std::move (i->second));
+      // Including the messages we haven't finished sending, or started
+      if (streaming) ms.push_back (std::move (stream));
+      for (size_t i = 0; i < held.size(); i++)
+        ms.push_back (std::move (held[i]));
+      unsettled.clear();
+      streamed.clear();
+      held.clear();
+      streaming = false;
+      queue->requeue (ms);
+      // The last reference to us may go on another thread
+      sender = proton::sender();
       }
 
-    /** In on_container_start, we just start the listener. */
-    void on_container_start (proton::container &c) override 
+    /** Ask for pull() to be called on the connection's thread. Safe to
+          call from any thread. */
+    void wake ()
       {
-      LOG_FUNC;
-      c.listen (address);
+      std::lock_guard<std::mutex> l (wake_lock);
+      if (!alive || wake_pending) return;
+      wake_pending = true;
+      std::shared_ptr<Consumer> self = shared_from_this();
+      work_queue->add ([self]()
+        {
+          {
+          std::lock_guard<std::mutex> l (self->wake_lock);
+          self->wake_pending = false;
+          if (!self->alive) return;
+          }
+        self->pull();
+        });
+      }
+
+    /** Send messages from the queue while we have link credit. */
+    void pull ()
+      {
+      if (!sender || !sender.active() || streaming) return;
+      size_t link_credit = sender.credit() > 0 ? sender.credit() : 0;
+      batch.clear();
+      while (batch.size() < link_credit && !held.empty())
+        {
+        batch.push_back (std::move (held.front()));
+        held.pop_front();
+        }
+      if (batch.size() < link_credit)
+        queue->pop (shared_from_this(), batch, link_credit - batch.size());
+      for (size_t i = 0; i < batch.size(); i++)
+        {
+        if (batch[i].spill)
+          {
+          // Anything after this has to wait until it has been sent
+          for (size_t j = i + 1; j < batch.size(); j++)
+            held.push_back (std::move (batch[j]));
+          start_stream (std::move (batch[i]));
+          break;
+          }
+        proton::tracker t = sender.send (batch[i].msg);
+        unsettled[t] = std::move (batch[i]);
+        }
+      batch.clear();
+      // If the client asked for it, give back the credit we can't use.
+      //   With no credit left, we're not hungry any more; pop() puts us
+      //   back on the list when the client gives us more
+      if (!streaming && sender.draining())
+        {
+        sender.return_credit();
+        queue->unsubscribe (this);
+        }
+      }
+
+    /** The client closed the link, but maybe not the connection. */
+    void on_sender_close (proton::sender &s) override;
+
+    /** The client has given us credit. */
+    void on_sendable (proton::sender &s) override { pull(); }
+
+    /** The client wants as many messages as its credit allows, now, and
+          the rest of the credit back. */
+    void on_sender_drain_start (proton::sender &s) override { pull(); }
+
+    void on_tracker_accept (proton::tracker &t) override
+      {
+      settled (t);
+      queue->acknowledged++;
+      }
+
+    void on_tracker_reject (proton::tracker &t) override
+      {
+      settled (t);
+      queue->rejected++;
+      }
+
+    /** Released or modified: the client doesn't want the message, but
+          another consumer might. */
+    void on_tracker_release (proton::tracker &t) override
+      {
+      std::vector<StoredMessage> ms (1);
+      if (!take_unsettled (t, ms[0])) return;
+      queue->requeue (ms);
       }
   };
 
+void Queue::wake (std::vector<std::shared_ptr<Consumer>> &to_wake)
+  {
+  for (size_t i = 0; i < to_wake.size(); i++)
+    to_wake[i]->wake();
+  }
 
-int main(int argc, char **argv) 
+void Queue::take_hungry (const StoredMessage &m,
+      std::vector<std::shared_ptr<Consumer>> &to_wake)
   {
-  try 
+  for (std::deque<std::shared_ptr<Consumer>>::iterator i = hungry.begin();
+      i != hungry.end(); ++i)
     {
-    std::string address ("0.0.0.0:5672");
+    const CompiledSelector *selector = (*i)->get_selector();
+    if (selector && !selector->matches (m.msg)) continue;
+    to_wake.push_back (*i);
+    (*i)->hungry = false;
+    hungry.erase (i);
+    return;
+    }
+  }
 
-    ReceiveHandler h (address);
-    proton::container container (h);
-    container.run();
-    } 
-  catch (const std::exception& e) 
+void Queue::pop (const std::shared_ptr<Consumer> &c,
+      std::vector<StoredMessage> &out, size_t max)
+  {
+  std::lock_guard<std::mutex> l (lock);
+  const CompiledSelector *selector = c->get_selector();
+  if (!selector)
+    {
+    while (out.size() < max && !messages.empty())
+      {
+      out.push_back (std::move (messages.front()));
+      messages.pop_front();
+      }
+    }
+  else
+    {
+    // Take the matches, and close up the messages that are left behind
+    //   them. Erasing the gap in one go moves the shorter side of the
+    //   deque, so it costs no more than the scan
+    std::chrono::steady_clock::time_point start
+      = std::chrono::steady_clock::now();
+    size_t kept = 0, scanned = 0;
+    for (; scanned < messages.size() && out.size() < max; scanned++)
+      {
+      if (selector->matches (messages[scanned].msg))
+        out.push_back (std::move (messages[scanned]));
+      else
+        {
+        if (kept != scanned)
+          messages[kept] = std::move (messages[scanned]);
+        kept++;
+        }
+      }
+    messages.erase (messages.begin() + kept, messages.begin() + scanned);
+    selector_ns += std::chrono::duration_cast<std::chrono::nanoseconds>
+      (std::chrono::steady_clock::now() - start).count();
+    selector_evals += scanned;
+    selector_matches += scanned - kept;
+    }
+  if (out.size() < max && !c->hungry)
+    {
+    c->hungry = true;
+    hungry.push_back (c);
+    }
+  }
+
+void Queue::unsubscribe (Consumer *c)
+  {
+  std::lock_guard<std::mutex> l (lock);
+  for (std::deque<std::shared_ptr<Consumer>>::iterator i = hungry.begin();
+      i != hungry.end(); ++i)
+    {
+    if (i->get() == c)
+      {
+      hungry.erase (i);
+      c->hungry = false;
+      break;
+      }
+    }
+  }
+
+void Queue::enqueue (StoredMessage &&m)
+  {
+  if (m.spill) spilled++;
+  std::vector<std::shared_ptr<Consumer>> to_wake;
+    {
+    std::lock_guard<std::mutex> l (lock);
+    messages.push_back (std::move (m));
+    take_hungry (messages.back(), to_wake);
+    }
+  enqueued++;
+  // Waking the consumer means taking its lock, so do it after we've
+  //   released ours
+  wake (to_wake);
+  }
+
+void Queue::requeue (std::vector<StoredMessage> &ms)
+  {
+  if (ms.empty()) return;
+  std::vector<std::shared_ptr<Consumer>> to_wake;
+    {
+    std::lock_guard<std::mutex> l (lock);
+    for (size_t i = ms.size(); i > 0; i--)
+      messages.push_front (std::move (ms[i - 1]));
+    for (size_t i = 0; i < ms.size() && !hungry.empty(); i++)
+      take_hungry (messages[i], to_wake);
+    }
+  redelivered += ms.size();
+  wake (to_wake);
+  }
+
+/*
+ * SharedMessage is a message published to a topic. It is encoded once,
+ *   when it arrives, and the bytes are never modified after that, so any
+ *   number of subscribers, on any threads, can send them at the same time.
+ *   The shared_ptr is the reference count: the buffer is freed when the
+ *   last subscriber's reference -- in its backlog, or waiting for the
+ *   client to settle -- goes away.
+ */
+typedef std::shared_ptr<const std::vector<char>> SharedMessage;
+
+/*
+ * Topic is a named address with any number of subscribers, each of which
+ *   gets every message published to the topic while it is subscribed.
+ *
+ * Publishing doesn't take the topic's lock while it hands out the message.
+ *   The list of subscribers is copied (and the copy replaced) whenever
+ *   someone subscribes or unsubscribes; a publisher just takes a reference
+ *   to the current list, so subscribers coming and going, which is rare,
+ *   never holds up publishing, which is not.
+ */
+class Topic
+  {
+  protected:
+    typedef std::vector<std::shared_ptr<Subscriber>> SubscriberList;
+
+    std::string name;
+    std::mutex lock; // Guards the pointer, not the list
+    std::shared_ptr<const SubscriberList> subscribers;
+
+  public:
+    std::atomic<long> published;
+    std::atomic<long> delivered; // To a subscriber's link
+    std::atomic<long> dropped; // For a subscriber whose backlog was full
+    std::atomic<long> encoded_bytes; // Once per message, not per subscriber
+
+    Topic (const std::string &name)
+      {
+      this->name = name;
+      this->subscribers = std::make_shared<const SubscriberList>();
+      this->published = this->delivered = this->dropped = 0;
+      this->encoded_bytes = 0;
+      }
+
+    const std::string &get_name () const { return name; }
+
+    size_t subscriber_count ()
+      {
+      std::lock_guard<std::mutex> l (lock);
+      return subscribers->size();
+      }
+
+    void subscribe (const std::shared_ptr<Subscriber> &s)
+      {
+      std::lock_guard<std::mutex> l (lock);
+      std::shared_ptr<SubscriberList> list
+        = std::make_shared<SubscriberList> (*subscribers);
+      list->push_back (s);
+      subscribers = list;
+      }
+
+    void unsubscribe (Subscriber *s)
+      {
+      std::lock_guard<std::mutex> l (lock);
+      std::shared_ptr<SubscriberList> list
+        = std::make_shared<SubscriberList>();
+      for (size_t i = 0; i < subscribers->size(); i++)
+        if ((*subscribers)[i].get() != s) list->push_back ((*subscribers)[i]);
+      subscribers = list;
+      }
+
+    /** Give the message to every current subscriber. */
+    void publish (const SharedMessage &m);
+  };
+
+/*
+ * Subscriber handles a link on which a client receives from a topic. Each
+ *   subscriber has its own backlog of messages that it hasn't been able to
+ *   send yet, for lack of credit; the messages in it are shared with the
+ *   other subscribers. Like a Consumer, it is only ever touched by other
+ *   threads through deliver(), which schedules a pull() on the
+ *   connection's work_queue. If the client releases a message, it goes
+ *   back to the head of this subscriber's backlog -- the other
+ *   subscribers have their own references to it. The backlog is capped:
+ *   when it is full, deliver() drops the new message, rather than let a
+ *   client that has stopped reading hold on to every message published
+ *   since. A release can take it over the cap, briefly. As for a Consumer,
+ *   detach() lets go of the subscriber's Proton handles, since the last
+ *   reference to it may go on a publisher's thread.
+ */
+class Subscriber : public proton::messaging_handler,
+    public std::enable_shared_from_this<Subscriber>
+  {
+  protected:
+    ConnectionHandler *owner;
+    proton::sender sender;
+    Topic *topic;
+    proton::work_queue *work_queue;
+    std::mutex lock; // Guards alive, wake_pending and backlog
+    bool alive;
+    bool wake_pending;
+    std::deque<SharedMessage> backlog;
+    size_t max_backlog; // 0 for no limit
+    uint64_t next_tag;
+    std::map<uint64_t, SharedMessage> unsettled; // By delivery tag
+    std::vector<SharedMessage> batch;
+
+    static uint64_t tag_of (const proton::tracker &t)
+      {
+      return RawSender::tag_of (t);
+      }
+
+  public:
+    Subscriber (ConnectionHandler *owner, proton::sender &sender,
+          Topic *topic, size_t max_backlog)
+      {
+      this->owner = owner;
+      this->sender = sender;
+      this->topic = topic;
+      this->max_backlog = max_backlog;
+      this->work_queue = &sender.work_queue();
+      this->alive = true;
+      this->wake_pending = false;
+      this->next_tag = 1;
+      }
+
+    /** Stop receiving messages, and drop the references to any that
+          haven't been settled. Call on the connection's thread. */
+    void detach ()
+      {
+        {
+        std::lock_guard<std::mutex> l (lock);
+        if (!alive) return;
+        alive = false;
+        backlog.clear();
+        }
+      topic->unsubscribe (this);
+      unsettled.clear();
+      sender = proton::sender();
+      }
+
+    /** Add a message to the backlog, and make sure a pull() is on its
+          way; or drop it, if the backlog is full. Safe to call from any
+          thread. */
+    void deliver (const SharedMessage &m)
+      {
+      std::lock_guard<std::mutex> l (lock);
+      if (!alive) return;
+      if (max_backlog && backlog.size() >= max_backlog)
+        {
+        topic->dropped++;
+        return;
+        }
+      backlog.push_back (m);
+      if (wake_pending) return;
+      wake_pending = true;
+      std::shared_ptr<Subscriber> self = shared_from_this();
+      work_queue->add ([self]()
+        {
+          {
+          std::lock_guard<std::mutex> l (self->lock);
+          self->wake_pending = false;
+          if (!self->alive) return;
+          }
+        self->pull();
+        });
+      }
+
+    /** Send messages from the backlog while we have link credit. */
+    void pull ()
+      {
+      if (!sender || !sender.active()) return;
+      int credit = sender.credit();
+      if (credit <= 0) return;
+      batch.clear();
+        {
+        std::lock_guard<std::mutex> l (lock);
+        while (batch.size() < (size_t)credit && !backlog.empty())
+          {
+          batch.push_back (std::move (backlog.front()));
+          backlog.pop_front();
+          }
+        }
+      RawSender raw (sender);
+      for (size_t i = 0; i < batch.size(); i++)
+        {
+        uint64_t tag = next_tag++;
+        if (!raw.send (tag, *batch[i]))
+          unsettled[tag] = std::move (batch[i]);
+        }
+      topic->delivered += batch.size();
+      batch.clear();
+      if (sender.draining()) sender.return_credit();
+      }
+
+    void on_sender_close (proton::sender &s) override;
+
+    void on_sendable (proton::sender &s) override { pull(); }
+
+    void on_sender_drain_start (proton::sender &s) override { pull(); }
+
+    void on_tracker_accept (proton::tracker &t) override
+      {
+      unsettled.erase (tag_of (t));
+      }
+
+    void on_tracker_reject (proton::tracker &t) override
+      {
+      unsettled.erase (tag_of (t));
+      }
+
+    void on_tracker_release (proton::tracker &t) override
+      {
+      std::map<uint64_t, SharedMessage>::iterator i
+        = unsettled.find (tag_of (t));
+      if (i == unsettled.end()) return;
+        {
+        std::lock_guard<std::mutex> l (lock);
+        backlog.push_front (std::move (i->second));
+        }
+      unsettled.erase (i);
+      pull();
+      }
+  };
+
+void Topic::publish (const SharedMessage &m)
+  {
+  std::shared_ptr<const SubscriberList> list;
+    {
+    std::lock_guard<std::mutex> l (lock);
+    list = subscribers;
+    }
+  published++;
+  encoded_bytes += m->size();
+  for (size_t i = 0; i < list->size(); i++)
+    (*list)[i]->deliver (m);
+  }
+
+/*
+ * Route is where messages sent to a particular address (or address
+ *   pattern) end up: either a queue or a topic.
+ */
+struct Route
+  {
+  std::string pattern;
+  Queue *queue;
+  Topic *topic;
+  };
+
+/*
+ * RoutingTable maps the target address of an inbound link to a Route.
+ *   Addresses are made of tokens separated by dots, like 'orders.uk.eu'.
+ *   A route's pattern may use the same wildcards as AMQP 0-9-1 topic
+ *   exchanges: '*' matches exactly one token, and '#' matches zero or more.
+ *   So 'orders.*.eu' matches 'orders.uk.eu' but not 'orders.eu', and
+ *   'metrics.#' matches 'metrics', 'metrics.cpu' and 'metrics.cpu.load'.
+ *
+ * Patterns without wildcards go into a hash table, which is checked
+ *   first. The rest go into a trie with one level per token, which is
+ *   walked token by token, so the cost is proportional to the length of
+ *   the address, not to the number of routes. Where patterns overlap, a
+ *   literal token beats '*', which beats '#'. (A '#' in the middle of a
+ *   pattern can make the walk backtrack; '#' at the end never does.)
+ *
+ * Lookup is only done when a link is attached -- the link handler keeps
+ *   the Route it was given, so routing a message is just a pointer
+ *   dereference. The table is built before the container starts, and
+ *   only read after that, so it needs no lock.
+ */
+class RoutingTable
+  {
+  protected:
+    struct Node
+      {
+      std::unordered_map<std::string, Node*> children;
+      Node *star; // Child for '*'
+      Node *hash; // Child for '#'
+      Route *route; // Route for a pattern that ends here, if any
+      Node () { star = hash = 0; route = 0; }
+      ~Node ()
+        {
+        for (std::unordered_map<std::string, Node*>::iterator
+            i = children.begin(); i != children.end(); ++i)
+          delete i->second;
+        delete star;
+        delete hash;
+        }
+      };
+
+    std::unordered_map<std::string, Route*> exact;
+    Node root;
+    std::vector<Route*> routes;
+
+    static void split (const std::string &address,
+          std::vector<std::string> &tokens)
+      {
+      size_t start = 0;
+      while (true)
+        {
+        size_t dot = address.find ('.', start);
+        tokens.push_back (address.substr (start, dot - start));
+        if (dot == std::string::npos) break;
+        start = dot + 1;
+        }
+      }
+
+    /** Match tokens[i..] against the trie below node. */
+    static Route *match (Node *node, const std::vector<std::string> &tokens,
+          size_t i)
+      {
+      if (i == tokens.size())
+        {
+        if (node->route) return node->route;
+        // A trailing '#' can match nothing at all
+        if (node->hash && node->hash->route) return node->hash->route;
+        return 0;
+        }
+      std::unordered_map<std::string, Node*>::iterator child
+        = node->children.find (tokens[i]);
+      if (child != node->children.end())
+        {
+        Route *r = match (child->second, tokens, i + 1);
+        if (r) return r;
+        }
+      if (node->star)
+        {
+        Route *r = match (node->star, tokens, i + 1);
+        if (r) return r;
+        }
+      if (node->hash)
+        {
+        // '#' at the end of a pattern swallows everything that's left
+        if (node->hash->route && node->hash->children.empty()
+            && !node->hash->star && !node->hash->hash)
+          return node->hash->route;
+        for (size_t j = i; j <= tokens.size(); j++)
+          {
+          Route *r = match (node->hash, tokens, j);
+          if (r) return r;
+          }
+        }
+      return 0;
+      }
+
+  public:
+    ~RoutingTable ()
+      {
+      for (size_t i = 0; i < routes.size(); i++)
+        delete routes[i];
+      }
+
+    void add (const std::string &pattern, Queue *queue, Topic *topic)
+      {
+      Route *route = new Route { pattern, queue, topic };
+      routes.push_back (route);
+      std::vector<std::string> tokens;
+      split (pattern, tokens);
+      bool wild = false;
+      for (size_t i = 0; i < tokens.size(); i++)
+        if (tokens[i] == "*" || tokens[i] == "#") wild = true;
+      if (!wild)
+        {
+        exact[pattern] = route;
+        return;
+        }
+      Node *node = &root;
+      for (size_t i = 0; i < tokens.size(); i++)
+        {
+        Node **next;
+        if (tokens[i] == "*")
+          next = &node->star;
+        else if (tokens[i] == "#")
+          next = &node->hash;
+        else
+          next = &node->children[tokens[i]];
+        if (!*next) *next = new Node;
+        node = *next;
+        }
+      node->route = route;
+      }
+
+    /** Returns the route for an address, or null if there isn't one. */
+    Route *resolve (const std::string &address)
+      {
+      std::unordered_map<std::string, Route*>::iterator i
+        = exact.find (address);
+      if (i != exact.end()) return i->second;
+      std::vector<std::string> tokens;
+      split (address, tokens);
+      return match (&root, tokens, 0);
+      }
+  };
+
+/*
+ * Broker holds the queues and topics, and the routes from addresses to
+ *   them. In this simple server, all are fixed at start-up, so they are never
+ *   modified while the container is running, and can be read from any
+ *   thread without a lock. It also refers to the journal, if there is one.
+ */
+class Broker
+  {
+  protected:
+    std::map<std::string, Queue*> queues;
+    std::map<std::string, Topic*> topics;
+    RoutingTable routes;
+    // Journal counters at the last report
+    long last_appends;
+    long last_fsyncs;
+
+  public:
+    bool print_messages;
+    // Refuse a bad attach by closing the link, rather than the connection
+    bool refuse_links;
+    std::atomic<long> refused_links;
+    std::atomic<long> refused_connections;
+    Journal *journal; // Null if messages are only kept in memory
+    CreditScheduler *credit;
+    // Weights of producers, by target address, for the CreditScheduler.
+    //   Addresses not listed have weight 1
+    std::map<std::string, int> producer_weights;
+    // Messages a topic subscriber can have waiting for credit before
+    //   more are dropped; 0 for no limit
+    size_t subscriber_backlog;
+    SpillOptions spill;
+
+    Broker (CreditScheduler *credit)
+      {
+      this->credit = credit;
+      print_messages = false;
+      refuse_links = true;
+      subscriber_backlog = 0;
+      refused_links = refused_connections = 0;
+      journal = 0;
+      last_appends = last_fsyncs = 0;
+      spill.threshold = 0;
+      spill.chunk = 64 * 1024;
+      }
+
+    /** Should a message of this many (encoded) bytes be spilled? */
+    bool spills (size_t bytes) const
+      {
+      return spill.threshold > 0 && bytes > spill.threshold;
+      }
+
+    /** Keep an encoded message in a SpillFile, rather than in memory.
+          Only the body is dropped from memory. */
+    void spill_to_disk (StoredMessage &stored, const char *data, size_t size)
+      {
+      stored.spill = std::make_shared<SpillFile> (spill.dir, data, size);
+      stored.msg.body (proton::value());
+      stored.bytes = size;
+      }
+
+    /** As above, for a message already split into its parts, which
+          must be the parts of stored.msg. */
+    void spill_to_disk (StoredMessage &stored, const EncodedParts &parts)
+      {
+      stored.spill = std::make_shared<SpillFile> (spill.dir, parts.pieces());
+      stored.bytes = parts.size();
+      // Only now, as the parts refer to the body
+      stored.msg.body (proton::value());
+      }
+
+    /** Spill a decoded message, without making an encoded copy of its
+          body, if the body is one that can be split off (see
+          EncodedParts). */
+    void spill_to_disk (StoredMessage &stored)
+      {
+      EncodedParts parts;
+      if (parts.split (stored.msg))
+        {
+        spill_to_disk (stored, parts);
+        return;
+        }
+      // A local buffer, so that we don't hang on to its capacity
+      std::vector<char> bytes;
+      stored.msg.encode (bytes);
+      spill_to_disk (stored, bytes.data(), bytes.size());
+      }
+
+    ~Broker ()
+      {
+      for (std::map<std::string, Queue*>::iterator i = queues.begin();
+          i != queues.end(); ++i)
+        delete i->second;
+      for (std::map<std::string, Topic*>::iterator i = topics.begin();
+          i != topics.end(); ++i)
+        delete i->second;
+      }
+
+    /** Create a queue. Messages sent to the queue's name are routed
+          to it. Returns false if there is already a topic with that name,
+          since the name can only route to one of them. */
+    bool declare_queue (const std::string &name)
+      {
+      if (topics.find (name) != topics.end()) return false;
+      if (queues.find (name) != queues.end()) return true;
+      queues[name] = new Queue (name);
+      routes.add (name, queues[name], 0);
+      return true;
+      }
+
+    /** Create a topic. Messages sent to the topic's name are routed
+          to it. Returns false if there is already a queue with that
+          name. */
+    bool declare_topic (const std::string &name)
+      {
+      if (queues.find (name) != queues.end()) return false;
+      if (topics.find (name) != topics.end()) return true;
+      topics[name] = new Topic (name);
+      routes.add (name, 0, topics[name]);
+      return true;
+      }
+
+    /** Route messages sent to addresses matching a pattern to an existing
+          queue or topic. Returns false if there is no such queue or
+          topic. */
+    bool add_route (const std::string &pattern, const std::string &name)
+      {
+      Queue *q = find_queue (name);
+      Topic *t = find_topic (name);
+      if (!q && !t) return false;
+      routes.add (pattern, q, t);
+      return true;
+      }
+
+    /** Returns the route for a target address, or null if there isn't
+          one. */
+    Route *route (const std::string &address)
+      {
+      return routes.resolve (address);
+      }
+
+    /** Returns the named queue, or null if there isn't one. */
+    Queue *find_queue (const std::string &name)
+      {
+      std::map<std::string, Queue*>::iterator i = queues.find (name);
+      return i == queues.end() ? 0 : i->second;
+      }
+
+    int producer_weight (const std::string &address)
+      {
+      std::map<std::string, int>::iterator i = producer_weights.find (address);
+      return i == producer_weights.end() ? 1 : i->second;
+      }
+
+    /** Returns the named topic, or null if there isn't one. */
+    Topic *find_topic (const std::string &name)
+      {
+      std::map<std::string, Topic*>::iterator i = topics.find (name);
+      return i == topics.end() ? 0 : i->second;
+      }
+
+    /** Print one line of counters per queue and topic, and the journal's write
+          and sync rates since the last report. */
+    void report (int interval)
+      {
+      for (std::map<std::string, Queue*>::iterator i = queues.begin();
+          i != queues.end(); ++i)
+        {
+        Queue *q = i->second;
+        std::cout << "queue " << q->get_name() << ": depth " << q->depth()
+          << ", enqueued " << q->enqueued << ", acked " << q->acknowledged
+          << ", rejected " << q->rejected << ", redelivered "
+          << q->redelivered << ", spilled " << q->spilled << std::endl;
+        long evals = q->selector_evals;
+        if (evals > 0)
+          std::cout << "  selectors: " << evals << " evaluations, "
+            << q->selector_matches << " matched, "
+            << q->selector_ns / evals << " ns per evaluation" << std::endl;
+        }
+      for (std::map<std::string, Topic*>::iterator i = topics.begin();
+          i != topics.end(); ++i)
+        {
+        Topic *t = i->second;
+        std::cout << "topic " << t->get_name() << ": subscribers "
+          << t->subscriber_count() << ", published " << t->published
+          << ", delivered " << t->delivered << ", dropped " << t->dropped
+          << ", bytes encoded " << t->encoded_bytes << std::endl;
+        }
+      if (journal)
+        {
+        long appends = journal->appends;
+        long fsyncs = journal->fsyncs;
+        double msgs_per_sec = (double)(appends - last_appends) / interval;
+        double fsyncs_per_sec = (double)(fsyncs - last_fsyncs) / interval;
+        std::cout << "journal: " << (long)msgs_per_sec << " msgs/s, "
+          << (long)fsyncs_per_sec << " fsyncs/s, "
+          << (fsyncs_per_sec > 0 ? msgs_per_sec / fsyncs_per_sec : 0)
+          << " msgs/fsync" << std::endl;
+        last_appends = appends;
+        last_fsyncs = fsyncs;
+        }
+      credit->report();
+      if (refused_links > 0 || refused_connections > 0)
+        std::cout << "refused: " << refused_links << " links, "
+          << refused_connections << " connections" << std::endl;
+      }
+  };
+
+/*
+ * Producer handles a link on which a client sends messages. The route is
+ *   looked up when the link opens, not for every message.
+ *
+ * A message for a topic is encoded, once, into a SharedMessage, and
+ *   accepted as soon as it has been handed to the subscribers.
+ *
+ * Without a journal, a message for a queue is accepted as soon as it is on
+ *   the queue. With one, the message is written to the journal, but not
+ *   accepted, or put on the queue, until the journal says that it is on
+ *   disk. The journal says so on its own thread so -- as for a Consumer --
+ *   the Producer is reference-counted, and gets back onto the connection's
+ *   thread through the connection's work_queue. The last reference may go
+ *   on the journal's thread, or the scheduler's, so detach() lets go of
+ *   the receiver and the pending deliveries on the connection's thread.
+ *
+ * The link's credit comes from the CreditScheduler. The Producer asks for
+ *   more after each message, and the scheduler wakes it when credit that
+ *   was held back becomes available.
+ */
+class Producer : public proton::messaging_handler,
+    public std::enable_shared_from_this<Producer>
+  {
+  protected:
+    struct Pending
+      {
+      proton::delivery delivery;
+      StoredMessage stored;
+      };
+
+    Broker &broker;
+    ConnectionHandler *owner;
+    Route *route;
+    proton::receiver receiver;
+    std::shared_ptr<ProducerCounters> counters;
+    proton::work_queue *work_queue;
+    std::mutex wake_lock; // Guards alive
+    bool alive;
+    bool waiting; // A callback from the journal is on its way
+    std::deque<Pending> pending; // Written to the journal, but not durable
+    std::vector<char> encoded;
+
+    /** Ask the journal to call us back when the newest pending message,
+          and so all the others, are durable. */
+    void wait ()
+      {
+      if (waiting || pending.empty()) return;
+      waiting = true;
+      std::shared_ptr<Producer> self = shared_from_this();
+      broker.journal->wait_for (pending.back().stored.journal_id, [self]()
+        {
+        std::lock_guard<std::mutex> l (self->wake_lock);
+        if (!self->alive) return;
+        self->work_queue->add ([self]() { self->commit(); });
+        });
+      }
+
+    /** Accept, and queue, the pending messages that are now durable.
+          Runs on the connection's thread. */
+    void commit ()
+      {
+        {
+        std::lock_guard<std::mutex> l (wake_lock);
+        if (!alive) return;
+        }
+      waiting = false;
+      uint64_t durable = broker.journal->durable();
+      while (!pending.empty() && pending.front().stored.journal_id < durable)
+        {
+        pending.front().delivery.accept();
+        route->queue->enqueue (std::move (pending.front().stored));
+        pending.pop_front();
+        }
+      wait();
+      }
+
+    void publish (proton::delivery &d, proton::message &msg)
+      {
+      Topic *topic = route->topic;
+      if (broker.print_messages)
+        std::cout << topic->get_name() << ": " << msg.body() << std::endl;
+      std::vector<char> *bytes = new std::vector<char>;
+      msg.encode (*bytes);
+      size_t size = bytes->size();
+      CreditScheduler *credit = broker.credit;
+      std::shared_ptr<ProducerCounters> origin = counters;
+      credit->received (origin.get(), size);
+      // The bytes are buffered until the last subscriber lets go of them
+      SharedMessage shared (bytes,
+        [credit, origin, size](const std::vector<char> *p)
+          {
+          delete p;
+          credit->released (origin.get(), size);
+          });
+      topic->publish (shared);
+      // Topics aren't journalled, so there's nothing to wait for. With a
+      //   journal, Proton doesn't accept deliveries for us
+      d.accept();
+      }
+
+    void enqueue (proton::delivery &d, proton::message &msg)
+      {
+      Queue *queue = route->queue;
+      if (broker.print_messages)
+        std::cout << queue->get_name() << ": " << msg.body() << std::endl;
+      //d.reject(); // What happens if we reject? A JMS client, in particular,
+                  //    will probably behave badly
+      if (!broker.journal)
+        {
+        // Proton decodes a new message for each delivery, so we can move
+        //   it into the queue, rather than copying it. The delivery is
+        //   accepted when on_message() returns.
+        StoredMessage stored (std::move (msg));
+        stored.bytes = ByteBudget::message_bytes (stored.msg);
+        if (broker.spills (stored.bytes)) broker.spill_to_disk (stored);
+        stored.origin = counters;
+        broker.credit->received (counters.get(), stored.bytes);
+        queue->enqueue (std::move (stored));
+        return;
+        }
+      StoredMessage stored (std::move (msg));
+      EncodedParts parts;
+      BodyView body (stored.msg);
+      if (body.viewable() && broker.spills (body.size())
+          && parts.split (stored.msg))
+        {
+        // Journalled and spilled from the parts, so a large body is never
+        //   copied into an encoded buffer
+        stored.journal_id = broker.journal->append (queue->get_name(),
+          parts.pieces());
+        broker.spill_to_disk (stored, parts);
+        }
+      else
+        {
+        stored.msg.encode (encoded);
+        stored.journal_id = broker.journal->append (queue->get_name(),
+          encoded.data(), encoded.size());
+        stored.bytes = encoded.size();
+        if (broker.spills (encoded.size()))
+          {
+          broker.spill_to_disk (stored, encoded.data(), encoded.size());
+          std::vector<char>().swap (encoded);
+          }
+        }
+      stored.origin = counters;
+      broker.credit->received (counters.get(), stored.bytes);
+      pending.push_back (Pending { d, std::move (stored) });
+      wait();
+      }
+
+  public:
+    Producer (Broker &broker, ConnectionHandler *owner, Route *route,
+          proton::receiver &receiver, int weight) : broker (broker)
+      {
+      this->owner = owner;
+      this->route = route;
+      this->receiver = receiver;
+      this->counters = std::make_shared<ProducerCounters>
+        (receiver.target().address(), weight);
+      this->work_queue = &receiver.work_queue();
+      this->alive = true;
+      this->waiting = false;
+      }
+
+    const ProducerCounters &get_counters () const { return *counters; }
+
+    /** Add whatever credit the scheduler allows. Call on the connection's
+          thread. */
+    void top_up ()
+      {
+      if (!receiver || !receiver.active()) return;
+      int n = broker.credit->credit_to_issue (*counters, receiver.credit());
+      if (n <= 0) return;
+      receiver.add_credit (n);
+      counters->credit_granted += n;
+      }
+
+    /** Ask for top_up() to be called on the connection's thread. Safe to
+          call from any thread. */
+    void wake ()
+      {
+      std::lock_guard<std::mutex> l (wake_lock);
+      if (!alive) return;
+      std::shared_ptr<Producer> self = shared_from_this();
+      work_queue->add ([self]()
+        {
+          {
+          std::lock_guard<std::mutex> l (self->wake_lock);
+          if (!self->alive) return;
+          }
+        self->top_up();
+        });
+      }
+
+    /** Stop handling messages. Any that are still waiting for the journal
+          were never accepted, so the client will send them again; they
+          are acked in the journal, so that they are not recovered twice.
+          Call on the connection's thread. */
+    void detach ()
+      {
+        {
+        std::lock_guard<std::mutex> l (wake_lock);
+        if (!alive) return;
+        alive = false;
+        }
+      broker.credit->remove (this);
+      for (size_t i = 0; i < pending.size(); i++)
+        {
+        broker.journal->ack (pending[i].stored.journal_id);
+        broker.credit->released (counters.get(), pending[i].stored.bytes);
+        }
+      pending.clear();
+      receiver = proton::receiver();
+      }
+
+    void on_receiver_close (proton::receiver &r) override;
+
+    void on_message (proton::delivery &d, proton::message &msg) override
+      {
+      if (route->topic)
+        publish (d, msg);
+      else
+        enqueue (d, msg);
+      top_up();
+      }
+  };
+
+void CreditScheduler::add (const std::shared_ptr<Producer> &p)
+  {
+  std::lock_guard<std::mutex> l (lock);
+  producers[p.get()] = p;
+  total_weight += p->get_counters().weight;
+  }
+
+void CreditScheduler::remove (Producer *p)
+  {
+  std::lock_guard<std::mutex> l (lock);
+  std::map<Producer*, std::shared_ptr<Producer>>::iterator i
+    = producers.find (p);
+  if (i == producers.end()) return;
+  total_weight -= p->get_counters().weight;
+  producers.erase (i);
+  }
+
+void CreditScheduler::unthrottle ()
+  {
+  if (!throttled.exchange (false)) return;
+  std::vector<std::shared_ptr<Producer>> to_wake;
+    {
+    std::lock_guard<std::mutex> l (lock);
+    for (std::map<Producer*, std::shared_ptr<Producer>>::iterator
+        i = producers.begin(); i != producers.end(); ++i)
+      to_wake.push_back (i->second);
+    }
+  // Waking a producer means taking its lock, so do it after we've
+  //   released ours
+  for (size_t i = 0; i < to_wake.size(); i++)
+    to_wake[i]->wake();
+  }
+
+void CreditScheduler::report ()
+  {
+  std::cout << "credit: buffered " << buffered << " bytes (high "
+    << high_watermark << ", low " << low_watermark << "), "
+    << (throttled ? "throttled" : "not throttled") << ", throttled "
+    << throttle_count << " times" << std::endl;
+  std::lock_guard<std::mutex> l (lock);
+  for (std::map<Producer*, std::shared_ptr<Producer>>::iterator
+      i = producers.begin(); i != producers.end(); ++i)
+    {
+    const ProducerCounters &c = i->second->get_counters();
+    std::cout << "  producer " << c.address << " (weight " << c.weight
+      << "): credit granted " << c.credit_granted << ", bytes buffered "
+      << c.bytes_buffered << std::endl;
+    }
+  }
+
+/*
+ * ConnectionHandler handles the events for one client connection, with
+ *   lots of logging. It creates a Producer, Consumer or Subscriber for
+ *   each link that the client opens, and lets go of it when the link
+ *   closes, or the connection does -- a client that opens and closes links
+ *   on one long-lived connection would otherwise leak them.
+ */
+class ConnectionHandler : public proton::messaging_handler
+  {
+  protected:
+    Broker &broker;
+    std::map<Producer*, std::shared_ptr<Producer>> producers;
+    std::map<Consumer*, std::shared_ptr<Consumer>> consumers;
+    std::map<Subscriber*, std::shared_ptr<Subscriber>> subscribers;
+
+    /** Look for a JMS selector among the filters that the client set on
+          a link's source. Returns false if there isn't one. The filter is
+          a described string; clients mostly use the symbolic descriptor,
+          but the numeric one means the same. */
+    static bool find_selector (const proton::source &source,
+          proton::symbol &key, proton::value &filter, std::string &expression)
+      {
+      std::map<proton::symbol, proton::value> filters;
+      proton::get (source.filters(), filters);
+      for (std::map<proton::symbol, proton::value>::iterator
+          i = filters.begin(); i != filters.end(); ++i)
+        {
+        try
+          {
+          proton::codec::decoder d (i->second);
+          proton::codec::start start;
+          d >> start;
+          if (!start.is_described) continue;
+          proton::value descriptor;
+          d >> descriptor;
+          if (descriptor.type() == proton::SYMBOL)
+            {
+            if (proton::get<proton::symbol> (descriptor)
+                != "apache.org:selector-filter:string")
+              continue;
+            }
+          else if (descriptor.type() != proton::ULONG
+              || proton::get<uint64_t> (descriptor) != 0x0000468C00000004ULL)
+            continue;
+          d >> expression;
+          key = i->first;
+          filter = i->second;
+          return true;
+          }
+        catch (const proton::error &)
+          {
+          // Not a filter we understand, so not one we apply
+          }
+        }
+      return false;
+      }
+
+    /** Refuse a link that the client asked for. AMQP says that a link
+          must be attached before it is detached, even to refuse it: a
+          bare detach is a protocol error, which brings down the whole
+          connection -- that's why closing the link, or the session, on
+          its own used to fail. So the link is opened, with no handler of
+          its own, and closed straight away, with the error, and the
+          client can try again on the same connection. Closing the
+          connection instead (if refuse_links is off) makes a client
+          that retries do a new TCP and SASL handshake each time. */
+    template <class Link>
+    void refuse (Link &link, const proton::error_condition &e)
+      {
+      if (!broker.refuse_links)
+        {
+        link.connection().close (e);
+        broker.refused_connections++;
+        return;
+        }
+      link.open();
+      link.close (e);
+      broker.refused_links++;
+      }
+
+  public:
+    ConnectionHandler (Broker &broker) : broker (broker) {}
+
+    /** Let go of a link's handler, when the link has closed. The caller
+          must hold a reference of its own until it returns. */
+    void forget (Producer *p) { producers.erase (p); }
+    void forget (Consumer *c) { consumers.erase (c); }
+    void forget (Subscriber *s) { subscribers.erase (s); }
+
+  protected:
+    void on_transport_open (proton::transport &t) override
+      { LOG_FUNC;  proton::messaging_handler::on_transport_open (t); }
+
+    void on_session_open (proton::session &s) override
+      { LOG_FUNC;  proton::messaging_handler::on_session_open (s); }
+
+    void on_session_close (proton::session &s) override
+      { LOG_FUNC;  proton::messaging_handler::on_session_close (s); }
+
+    /** A client wants to receive: on our side, that's a sender. */
+    void on_sender_open (proton::sender &s) override
+      {
+      LOG_FUNC;
+      std::string address = s.source().address();
+      std::cout << "source address: " << address << std::endl;
+      Topic *topic = broker.find_topic (address);
+      if (topic)
+        {
+        std::shared_ptr<Subscriber> subscriber
+          = std::make_shared<Subscriber> (this, s, topic,
+            broker.subscriber_backlog);
+        subscribers[subscriber.get()] = subscriber;
+        topic->subscribe (subscriber);
+        std::vector<proton::symbol> caps { "topic" };
+        s.open (proton::sender_options()
+          .source (proton::source_options().address (address)
+            .capabilities (caps))
+          .handler (*subscriber));
+        return;
+        }
+      Queue *queue = broker.find_queue (address);
+      if (!queue)
+        {
+        refuse (s, proton::error_condition ("amqp:not-found",
+          "Invalid address " + address));
+        return;
+        }
+      std::vector<proton::symbol> caps = s.source().capabilities();
+      if (std::find (caps.begin(), caps.end(), proton::symbol ("topic"))
+          != caps.end())
+        {
+        refuse (s, proton::error_condition ("amqp:illegal-state",
+          "Address " + address + " is not configured for topic support"));
+        return;
+        }
+      proton::symbol filter_key;
+      proton::value filter;
+      std::string expression;
+      std::unique_ptr<CompiledSelector> selector;
+      proton::source_options source_options;
+      source_options.address (address);
+      if (find_selector (s.source(), filter_key, filter, expression))
+        {
+        try
+          {
+          selector.reset (new CompiledSelector (expression));
+          }
+        catch (const std::runtime_error &e)
+          {
+          refuse (s, proton::error_condition ("amqp:invalid-field",
+            e.what()));
+          return;
+          }
+        std::cout << "selector: " << expression << std::endl;
+        // Sending the filter back tells the client that we applied it
+        proton::source::filter_map applied;
+        applied.put (filter_key, filter);
+        source_options.filters (applied);
+        }
+      std::shared_ptr<Consumer> consumer 
+        = std::make_shared<Consumer> (this, s, queue, broker.journal,
+          broker.credit, &broker.spill, std::move (selector));
+      consumers[consumer.get()] = consumer;
+      s.open (proton::sender_options()
+        .source (source_options)
+        .handler (*consumer));
+      }
+
+    /** A client wants to send: on our side, that's a receiver. */
+    void on_receiver_open (proton::receiver &r) override
+      {
+      LOG_FUNC;
+      std::string address = r.target().address();
+      std::cout << "target address: " << address << std::endl;
+      Route *route = broker.route (address);
+      if (!route)
+        {
+        refuse (r, proton::error_condition ("amqp:not-found",
+          "Invalid address " + address));
+        return;
+        }
+      std::shared_ptr<Producer> producer = std::make_shared<Producer>
+        (broker, this, route, r, broker.producer_weight (address));
+      producers[producer.get()] = producer;
+      broker.credit->add (producer);
+      // With a journal, the Producer accepts each message itself: one for
+      //   a queue once it is on disk, one for a topic at once. Credit
+      //   comes from the CreditScheduler, not from Proton's credit window
+      r.open (proton::receiver_options()
+        .target (proton::target_options().address (address))
+        .credit_window (0)
+        .auto_accept (broker.journal == 0)
+        .handler (*producer));
+      producer->top_up();
+      }
+
+    void on_connection_open (proton::connection &c) override
+     { LOG_FUNC;  proton::messaging_handler::on_connection_open (c); }
+
+    void on_connection_close (proton::connection &c) override
+      { LOG_FUNC; proton::messaging_handler::on_connection_close (c); }
+
+    /** If we're going to be experimenting with things like rejecting messages,
+          we need to override on_transport_error() so that bad behaviour of
+          the sending client doesn't lead to the connection (and thus container)
+          being shut down. */
+    void on_transport_error (proton::transport &t) override
+      {
+      LOG_FUNC;
+      }
+
+    /** on_transport_close is the last event for the connection, whether
+          it was closed cleanly or not. Detaching the consumers puts their
+          unsettled messages back on the queues; detaching the producers
+          stops any callbacks from the journal. */
+    void on_transport_close (proton::transport &t) override
+      {
+      LOG_FUNC;
+      for (std::map<Consumer*, std::shared_ptr<Consumer>>::iterator i
+          = consumers.begin(); i != consumers.end(); ++i)
+        i->second->detach();
+      consumers.clear();
+      for (std::map<Subscriber*, std::shared_ptr<Subscriber>>::iterator i
+          = subscribers.begin(); i != subscribers.end(); ++i)
+        i->second->detach();
+      subscribers.clear();
+      for (std::map<Producer*, std::shared_ptr<Producer>>::iterator i
+          = producers.begin(); i != producers.end(); ++i)
+        i->second->detach();
+      producers.clear();
+      delete this;
+      }
+  };
+
+// The link handlers' close events need ConnectionHandler, so they are
+//   defined here. Each holds a reference to itself while the owner lets
+//   go of it, so that it isn't deleted under its own feet.
+
+void Consumer::on_sender_close (proton::sender &s)
+  {
+  LOG_FUNC;
+  std::shared_ptr<Consumer> self = shared_from_this();
+  detach();
+  owner->forget (this);
+  }
+
+void Subscriber::on_sender_close (proton::sender &s)
+  {
+  LOG_FUNC;
+  std::shared_ptr<Subscriber> self = shared_from_this();
+  detach();
+  owner->forget (this);
+  }
+
+void Producer::on_receiver_close (proton::receiver &r)
+  {
+  LOG_FUNC;
+  std::shared_ptr<Producer> self = shared_from_this();
+  detach();
+  owner->forget (this);
+  }
+
+/*
+ * ServerListenHandler creates a ConnectionHandler for each connection
+ *   that the listener accepts.
+ */
+class ServerListenHandler : public proton::listen_handler
+  {
+  protected:
+    Broker &broker;
+
+  public:
+    ServerListenHandler (Broker &broker) : broker (broker) {}
+
+    proton::connection_options on_accept (proton::listener &l) override
+      {
+      return proton::connection_options()
+        .handler (*new ConnectionHandler (broker));
+      }
+
+    void on_error (proton::listener &l, const std::string &what) override
+      {
+      std::cerr << "listener error: " << what << std::endl;
+      }
+  };
+
+/*
+ * ServerHandler is the container's handler. It starts the listener,
+ *   and prints the queue statistics every few seconds.
+ */
+class ServerHandler : public proton::messaging_handler
+  {
+  protected:
+    std::string address;
+    Broker &broker;
+    ServerListenHandler listen_handler;
+    int report_interval; // Seconds; 0 for no report
+
+  public:
+    ServerHandler (const std::string &address, Broker &broker,
+          int report_interval) :
+        broker (broker), listen_handler (broker)
+      {
+      this->address = address;
+      this->report_interval = report_interval;
+      }
+
+    void schedule_report (proton::container &c)
+      {
+      c.schedule (proton::duration::SECOND * report_interval, [this, &c]()
+        {
+        broker.report (report_interval);
+        schedule_report (c);
+        });
+      }
+
+    /** In on_container_start, we just start the listener. */
+    void on_container_start (proton::container &c) override
+      {
+      LOG_FUNC;
+      c.listen (address, listen_handler);
+      if (report_interval > 0) schedule_report (c);
+      }
+  };
+
+
+int main(int argc, char **argv)
+  {
+  try
+    {
+    std::string address ("0.0.0.0:5672");
+    std::vector<std::string> queues = { "foo", "bar" };
+    // Every consumer of a topic gets a copy of every message
+    std::vector<std::string> topics = { "news" };
+    // Messages each topic subscriber can have waiting for credit; more
+    //   are dropped until it catches up. 0 for no limit
+    size_t subscriber_backlog = 10000;
+    // Extra routes from address patterns to queues or topics. '*' matches one
+    //   dot-separated token, '#' matches any number
+    std::vector<std::pair<std::string, std::string>> routes =
+      { { "orders.*.eu", "foo" }, { "metrics.#", "bar" } };
+    // Credit shared by all the clients that send to us, in proportion to
+    //   their weights. A low value limits the number of messages in
+    //   transit, but slows down the senders
+    int producer_credit = 1000;
+    // Weights of producers by target address, for example
+    //   { { "bar", 2 } }. Addresses not listed have weight 1
+    std::map<std::string, int> producer_weights = { };
+    // Stop giving producers credit when this many bytes are waiting to
+    //   be consumed, and start again when consumers bring it below the
+    //   low watermark
+    int64_t high_watermark = 256 * 1024 * 1024;
+    int64_t low_watermark = 192 * 1024 * 1024;
+    // Seconds between statistics reports
+    int report_interval = 5;
+    // Print the body of every message? Slows things down a lot
+    bool print_messages = false;
+    // When a client attaches to an address that doesn't exist, refuse the
+    //   link (true), or close the whole connection (false), as this
+    //   server used to
+    bool refuse_links = true;
+    // Number of threads to run the container on, unless given as the
+    //   first argument. Each connection's events are handled on one
+    //   thread at a time
+    int threads = std::thread::hardware_concurrency();
+    if (argc > 1) threads = atoi (argv[1]);
+    // Directory for the journal, which keeps messages over a restart.
+    //   Empty to keep messages only in memory
+    std::string journal_dir = "";
+    // Size of each journal file
+    size_t journal_segment_size = 64 * 1024 * 1024;
+    // How long the journal waits for more messages before each disk
+    //   sync, in microseconds. Longer means fewer syncs, but each message
+    //   waits longer to be accepted
+    int commit_window = 2000;
+    // Bytes written to the journal between checkpoints, which make
+    //   restarting faster (see journal.hpp). 0 for no checkpoints
+    size_t journal_checkpoint_bytes = 16 * 1024 * 1024;
+    // Messages bigger than this many bytes are kept in a file in
+    //   spill_dir, not in memory, and sent from it stream_chunk bytes at a
+    //   time. 0 to keep everything in memory
+    size_t spill_threshold = 1024 * 1024;
+    std::string spill_dir = "/tmp";
+    size_t stream_chunk = 256 * 1024;
+
+    CreditScheduler credit (producer_credit, high_watermark, low_watermark);
+    Broker broker (&credit);
+    broker.print_messages = print_messages;
+    broker.refuse_links = refuse_links;
+    broker.producer_weights = producer_weights;
+    broker.subscriber_backlog = subscriber_backlog;
+    broker.spill.threshold = spill_threshold;
+    broker.spill.dir = spill_dir;
+    broker.spill.chunk = stream_chunk;
+    for (size_t i = 0; i < queues.size(); i++)
+      broker.declare_queue (queues[i]);
+    for (size_t i = 0; i < topics.size(); i++)
+      if (!broker.declare_topic (topics[i]))
+        std::cerr << "Topic " << topics[i] << " has the same name as a queue"
+          << " -- ignoring it" << std::endl;
+    for (size_t i = 0; i < routes.size(); i++)
+      if (!broker.add_route (routes[i].first, routes[i].second))
+        std::cerr << "No queue or topic " << routes[i].second << " for route "
+          << routes[i].first << std::endl;
+
+    std::unique_ptr<Journal> journal;
+    if (!journal_dir.empty())
+      {
+      journal.reset (new Journal (journal_dir, journal_segment_size,
+        std::chrono::microseconds (commit_window),
+        journal_checkpoint_bytes));
+      long recovered = 0;
+      std::vector<uint64_t> orphans; // Messages for queues that are gone
+      journal->recover ([&](uint64_t id, const std::string &queue,
+            const char *data, size_t length)
+        {
+        Queue *q = broker.find_queue (queue);
+        if (!q)
+          {
+          orphans.push_back (id);
+          return;
+          }
+        StoredMessage stored;
+        stored.journal_id = id;
+        stored.msg.decode (std::vector<char> (data, data + length));
+        if (broker.spills (length))
+          broker.spill_to_disk (stored, data, length);
+        stored.bytes = length;
+        credit.received (0, length);
+        q->enqueue (std::move (stored));
+        recovered++;
+        });
+      for (size_t i = 0; i < orphans.size(); i++)
+        journal->ack (orphans[i]);
+      std::cout << "recovered " << recovered << " messages from "
+        << journal_dir << (journal->last_recovery().from_checkpoint
+          ? " using checkpoint" : "") << std::endl;
+      broker.journal = journal.get();
+      }
+
+    ServerHandler h (address, broker, report_interval);
+    proton::container container (h);
+    container.run (threads > 0 ? threads : 1);
+    }
+  catch (const std::exception& e)
     {
     std::cerr << e.what() << std::endl;
     }
@@ -0,0 +1,131 @@
+/*
+  spill_file.hpp
+
+  SpillFile holds a block of bytes -- in practice, a large encoded message
+    -- in a temporary file instead of in memory. The file is unlinked as
+    soon as it is created, so it has no name, and the space is given back
+    when the SpillFile is destroyed, or when the process dies, however it
+    dies.
+
+  The bytes are read back through a read-only memory mapping, so a view of
+    them costs nothing until pages are actually touched, and then only the
+    pages touched. Those pages belong to the page cache, not to the
+    process's heap, and release() (or release_before(), for a prefix that
+    has been finished with) hands them back, so a process can work through
+    a file much bigger than the memory it is prepared to use.
+
+  A SpillFile is not thread-safe, but it can be handed from thread to
+    thread -- it's used by one link handler at a time.
+*/
+
+#ifndef SPILL_FILE_HPP
+#define SPILL_FILE_HPP
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class SpillFile
+  {
+  protected:
+    int fd;
+    size_t length;
+    char *base; // Null when not mapped
+
+  public:
+    /** Write the bytes to a new, unnamed file in dir. Throws
+          std::runtime_error if the file can't be written. */
+    SpillFile (const std::string &dir, const char *data, size_t length)
+        : SpillFile (dir, { std::string_view (data, length) })
+      {
+      }
+
+    /** Write the pieces to a new, unnamed file in dir, one after another,
+          so that bytes which are in several places needn't be put
+          together in memory first. */
+    SpillFile (const std::string &dir,
+          const std::vector<std::string_view> &pieces)
+      {
+      std::string path = dir + "/spill-XXXXXX";
+      fd = mkstemp (&path[0]);
+      if (fd < 0)
+        throw std::runtime_error ("Can't create spill file in " + dir + ": "
+          + strerror (errno));
+      unlink (path.c_str());
+      this->length = 0;
+      this->base = 0;
+      for (size_t i = 0; i < pieces.size(); i++)
+        {
+        const char *data = pieces[i].data();
+        size_t size = pieces[i].size();
+        size_t done = 0;
+        while (done < size)
+          {
+          ssize_t n = write (fd, data + done, size - done);
+          if (n < 0 && errno == EINTR) continue;
+          if (n <= 0)
+            {
+            int err = errno;
+            close (fd);
+            throw std::runtime_error (std::string ("Can't write spill file: ")
+              + strerror (err));
+            }
+          done += n;
+          }
+        this->length += size;
+        }
+      }
+
+    ~SpillFile ()
+      {
+      release();
+      close (fd);
+      }
+
+    SpillFile (const SpillFile &) = delete;
+    SpillFile &operator= (const SpillFile &) = delete;
+
+    size_t size () const { return length; }
+
+    /** A view of all the bytes, valid until release(). */
+    std::string_view view ()
+      {
+      if (!base && length > 0)
+        {
+        void *p = mmap (0, length, PROT_READ, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED)
+          throw std::runtime_error (std::string ("Can't map spill file: ")
+            + strerror (errno));
+        base = (char *)p;
+        // It's nearly always read from start to end
+        madvise (base, length, MADV_SEQUENTIAL);
+        }
+      return std::string_view (base, length);
+      }
+
+    /** Give back the memory used by the first n bytes of the view. They
+          can still be read, but will be read from the file again. */
+    void release_before (size_t n)
+      {
+      if (!base) return;
+      size_t page = sysconf (_SC_PAGESIZE);
+      n &= ~(page - 1);
+      if (n > 0) madvise (base, n, MADV_DONTNEED);
+      }
+
+    /** Unmap the file. The next view() maps it again. */
+    void release ()
+      {
+      if (!base) return;
+      munmap (base, length);
+      base = 0;
+      }
+  };
+
+#endif
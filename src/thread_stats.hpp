@@ -0,0 +1,342 @@
+/*
+  thread_stats.hpp
+
+  ThreadStats keeps counters and histograms for a multi-threaded program,
+    such as container_per_thread.cpp, without the threads contending for
+    anything when they count. A single shared counter, even an atomic
+    one, has to move between the cores of the threads that update it,
+    and so do any other variables that happen to share its cache line;
+    with ten threads counting every message, that traffic costs more
+    than the counting.
+
+  Instead, each thread gets a block of its own -- a ThreadStats::Local --
+    from attach(), and counts into that. A block is made of whole cache
+    lines, allocated separately from every other thread's, so no two
+    threads ever write to the same line. Only the owning thread writes to
+    its block, so an update is a plain load and store, not a locked
+    read-modify-write; the values are atomics only so that the reporter
+    can read them while they change.
+
+  The reporter is a thread that, every so often, reads all the blocks and
+    adds them up into process totals, which it hands to a callback, and
+    keeps for totals() to return. Reading a block pulls its lines over to
+    the reporter's core once per report -- a cost that doesn't grow with
+    the message rate. A thread that is finished detaches its block; what
+    it counted is kept in the totals.
+
+  The counters and histograms are named when the ThreadStats is created,
+    and referred to by their index in the list of names, so the hot path
+    involves no lookup. Histograms have eight buckets to each power of
+    two, so percentiles are good to about 6%; the units are whatever the
+    caller records (microseconds, bytes...).
+*/
+
+#ifndef THREAD_STATS_HPP
+#define THREAD_STATS_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class ThreadStats
+  {
+  public:
+    // Buckets in each histogram: eight for each power of two
+    static const int BUCKETS = 496;
+
+    /** A merged view: the sums of every thread's counters and
+          histograms. */
+    class Snapshot
+      {
+      friend class ThreadStats;
+
+      protected:
+        std::vector<uint64_t> counters;
+        // For each histogram, BUCKETS counts, then the sum and the max
+        std::vector<std::vector<uint64_t>> histograms;
+
+        static uint64_t lower (int b)
+          {
+          if (b < 8) return b;
+          return (uint64_t)(8 + b % 8) << (b / 8 - 1);
+          }
+
+      public:
+        Snapshot (size_t counters = 0, size_t histograms = 0)
+            : counters (counters, 0),
+              histograms (histograms, std::vector<uint64_t> (BUCKETS + 2, 0))
+          {
+          }
+
+        uint64_t counter (int i) const { return counters[i]; }
+
+        /** The number of values recorded in histogram h. */
+        uint64_t count (int h) const
+          {
+          uint64_t n = 0;
+          for (int b = 0; b < BUCKETS; b++) n += histograms[h][b];
+          return n;
+          }
+
+        double mean (int h) const
+          {
+          uint64_t n = count (h);
+          return n ? (double)histograms[h][BUCKETS] / n : 0;
+          }
+
+        uint64_t max (int h) const { return histograms[h][BUCKETS + 1]; }
+
+        /** The value below which a fraction p of histogram h lies. */
+        double percentile (int h, double p) const
+          {
+          uint64_t target = (uint64_t)(p * count (h));
+          if (target < 1) target = 1;
+          uint64_t seen = 0;
+          for (int b = 0; b < BUCKETS; b++)
+            {
+            seen += histograms[h][b];
+            // The middle of the bucket, but no more than the max
+            if (seen >= target)
+              return std::min ((lower (b) + lower (b + 1)) / 2.0,
+                (double)max (h));
+            }
+          return max (h);
+          }
+
+        /** This snapshot less an earlier one: what happened in between.
+              (The max is not a difference; it's this snapshot's.) */
+        Snapshot since (const Snapshot &earlier) const
+          {
+          Snapshot d = *this;
+          for (size_t i = 0; i < counters.size(); i++)
+            d.counters[i] -= earlier.counters[i];
+          for (size_t h = 0; h < histograms.size(); h++)
+            for (int b = 0; b <= BUCKETS; b++)
+              d.histograms[h][b] -= earlier.histograms[h][b];
+          return d;
+          }
+      };
+
+    /*
+     * Local is one thread's block. Only that thread may call add() and
+     *   record().
+     */
+    class Local
+      {
+      friend class ThreadStats;
+
+      protected:
+        struct alignas(64) Line
+          {
+          std::atomic<uint64_t> cells[8];
+          };
+
+        size_t counters;
+        size_t histograms;
+        std::unique_ptr<Line[]> lines;
+
+        Local (size_t counters, size_t histograms)
+          {
+          this->counters = counters;
+          this->histograms = histograms;
+          size_t cells = counters + histograms * (BUCKETS + 2);
+          size_t n = (cells + 7) / 8;
+          lines.reset (new Line[n]);
+          for (size_t i = 0; i < n * 8; i++)
+            lines[i / 8].cells[i % 8].store (0, std::memory_order_relaxed);
+          }
+
+        std::atomic<uint64_t> &cell (size_t i)
+          {
+          return lines[i / 8].cells[i % 8];
+          }
+
+        /** A cell of histogram h: bucket b, or BUCKETS for the sum,
+              BUCKETS + 1 for the max. */
+        std::atomic<uint64_t> &histogram_cell (int h, int b)
+          {
+          return cell (counters + h * (BUCKETS + 2) + b);
+          }
+
+        static int bucket (uint64_t v)
+          {
+          if (v < 8) return v;
+          int p = 63 - __builtin_clzll (v);
+          return (p - 2) * 8 + (int)((v >> (p - 3)) & 7);
+          }
+
+        // Only the owner writes, so there's no need for a locked add
+        static void increase (std::atomic<uint64_t> &c, uint64_t n)
+          {
+          c.store (c.load (std::memory_order_relaxed) + n,
+            std::memory_order_relaxed);
+          }
+
+        void add_to (Snapshot &s)
+          {
+          for (size_t i = 0; i < counters; i++)
+            s.counters[i] += cell (i).load (std::memory_order_relaxed);
+          for (size_t h = 0; h < histograms; h++)
+            {
+            std::vector<uint64_t> &to = s.histograms[h];
+            for (int b = 0; b <= BUCKETS; b++)
+              to[b] += histogram_cell (h, b).load (std::memory_order_relaxed);
+            uint64_t max = histogram_cell (h, BUCKETS + 1)
+              .load (std::memory_order_relaxed);
+            if (max > to[BUCKETS + 1]) to[BUCKETS + 1] = max;
+            }
+          }
+
+      public:
+        /** Add n to counter i. */
+        void add (int i, uint64_t n = 1)
+          {
+          increase (cell (i), n);
+          }
+
+        /** This thread's count, for counter i. */
+        uint64_t get (int i)
+          {
+          return cell (i).load (std::memory_order_relaxed);
+          }
+
+        /** Record the value v in histogram h. */
+        void record (int h, uint64_t v)
+          {
+          increase (histogram_cell (h, bucket (v)), 1);
+          increase (histogram_cell (h, BUCKETS), v);
+          std::atomic<uint64_t> &max = histogram_cell (h, BUCKETS + 1);
+          if (v > max.load (std::memory_order_relaxed))
+            max.store (v, std::memory_order_relaxed);
+          }
+      };
+
+    typedef std::function<void (const Snapshot &totals,
+      const Snapshot &interval)> Callback;
+
+  protected:
+    std::vector<std::string> counter_names;
+    std::vector<std::string> histogram_names;
+    std::mutex lock; // Guards the members below
+    std::vector<Local*> locals;
+    Snapshot detached; // What threads that have gone counted
+    Snapshot last; // As of the last merge
+    bool stopping;
+    std::condition_variable stop_requested;
+    std::thread reporter;
+
+    void run_reporter (std::chrono::milliseconds interval,
+          Callback callback)
+      {
+      std::unique_lock<std::mutex> l (lock);
+      while (!stopping)
+        {
+        stop_requested.wait_for (l, interval);
+        if (stopping) break;
+        l.unlock();
+        Snapshot previous = totals();
+        Snapshot now = merge();
+        if (callback) callback (now, now.since (previous));
+        l.lock();
+        }
+      }
+
+  public:
+    ThreadStats (const std::vector<std::string> &counter_names,
+          const std::vector<std::string> &histogram_names
+            = std::vector<std::string>())
+        : detached (counter_names.size(), histogram_names.size()),
+          last (counter_names.size(), histogram_names.size())
+      {
+      this->counter_names = counter_names;
+      this->histogram_names = histogram_names;
+      this->stopping = false;
+      }
+
+    ~ThreadStats ()
+      {
+      stop_reporter();
+      for (size_t i = 0; i < locals.size(); i++) delete locals[i];
+      }
+
+    const std::string &counter_name (int i) const
+      { return counter_names[i]; }
+
+    const std::string &histogram_name (int h) const
+      { return histogram_names[h]; }
+
+    /** A block for the calling thread to count into. */
+    Local &attach ()
+      {
+      Local *local = new Local (counter_names.size(),
+        histogram_names.size());
+      std::lock_guard<std::mutex> l (lock);
+      locals.push_back (local);
+      return *local;
+      }
+
+    /** Give back a block, when its thread has finished with it; what it
+          counted stays in the totals. */
+    void detach (Local &local)
+      {
+      std::lock_guard<std::mutex> l (lock);
+      for (size_t i = 0; i < locals.size(); i++)
+        {
+        if (locals[i] != &local) continue;
+        local.add_to (detached);
+        locals.erase (locals.begin() + i);
+        delete &local;
+        return;
+        }
+      }
+
+    /** Add up every thread's block, now. */
+    Snapshot merge ()
+      {
+      std::lock_guard<std::mutex> l (lock);
+      Snapshot s = detached;
+      for (size_t i = 0; i < locals.size(); i++) locals[i]->add_to (s);
+      last = s;
+      return s;
+      }
+
+    /** The totals as of the last merge, by the reporter or anyone else. */
+    Snapshot totals ()
+      {
+      std::lock_guard<std::mutex> l (lock);
+      return last;
+      }
+
+    /** Start a thread that merges the blocks every 'interval', and passes
+          the totals, and what happened since the last merge, to
+          'callback'. */
+    void start_reporter (std::chrono::milliseconds interval,
+          Callback callback = Callback())
+      {
+      stop_reporter();
+      std::lock_guard<std::mutex> l (lock);
+      stopping = false;
+      reporter = std::thread (&ThreadStats::run_reporter, this, interval,
+        callback);
+      }
+
+    void stop_reporter ()
+      {
+        {
+        std::lock_guard<std::mutex> l (lock);
+        stopping = true;
+        }
+      stop_requested.notify_all();
+      if (reporter.joinable()) reporter.join();
+      }
+  };
+
+#endif